@@ -636,6 +636,20 @@ class Shell(cmdln.Cmdln):
             scan_count = 0
             lang_warnings = set()
             tree = None
+            # Unless the whole tree is needed for pretty printing, each
+            # <file> is written out as soon as it's scanned (with the
+            # Python 3 ciElementTree; the Python 2 one has no XMLWriter).
+            writer = None
+            stream = not quiet and not opts.pretty_print and hasattr(ET, 'XMLWriter')
+
+            def strip_func_vars(elem):
+                # For stdlibs, we don't care about variables inside of
+                # functions and they take up a lot of space.
+                for function in elem.getiterator('scope'):
+                    if function.get('ilk') == 'function':
+                        function[:] = [child for child in function
+                                       if child.tag != 'variable']
+
             for path in _paths_from_path_patterns(path_patterns,
                                                   recursive=opts.recursive,
                                                   includes=opts.includes):
@@ -674,13 +688,23 @@ class Shell(cmdln.Cmdln):
                         buf.scan()
                     if tree is None:
                         tree = ET.Element("codeintel", version="2.0")
-                    file_elem = ET.SubElement(tree, "file",
-                                              lang=buf.lang,
-                                              mtime=str(int(time.time())),
-                                              path=os.path.basename(path))
+                    file_elem = ET.Element("file",
+                                           lang=buf.lang,
+                                           mtime=str(int(time.time())),
+                                           path=os.path.basename(path))
                     for lang, blob in sorted(buf.blob_from_lang.items()):
                         blob = buf.blob_from_lang[lang]
                         file_elem.append(blob)
+                    if stream:
+                        if writer is None:
+                            sys.stdout.write('<?xml version="1.0" encoding="UTF-8"?>\n')
+                            writer = ET.XMLWriter(sys.stdout)
+                            writer.start(tree.tag, tree.attrib)
+                        if opts.stripfuncvars:
+                            strip_func_vars(file_elem)
+                        writer.write_element(file_elem)
+                    else:
+                        tree.append(file_elem)
                 except KeyError as ex:
                     # Unknown cile language.
                     if not opts.recursive:
@@ -696,18 +720,17 @@ class Shell(cmdln.Cmdln):
                     sys.stderr.flush()
 
             if tree is not None:
-                if opts.stripfuncvars:
-                    # For stdlibs, we don't care about variables inside of
-                    # functions and they take up a lot of space.
-                    for function in tree.getiterator('scope'):
-                        if function.get('ilk') == 'function':
-                            function[:] = [child for child in function
-                                           if child.tag != 'variable']
-                if opts.pretty_print:
-                    tree = pretty_tree_from_tree(tree)
-                if not quiet:
-                    sys.stdout.write('<?xml version="1.0" encoding="UTF-8"?>\n')
-                    ET.dump(tree)
+                if writer is not None:
+                    writer.end()
+                    writer.close()
+                else:
+                    if opts.stripfuncvars:
+                        strip_func_vars(tree)
+                    if opts.pretty_print:
+                        tree = pretty_tree_from_tree(tree)
+                    if not quiet:
+                        sys.stdout.write('<?xml version="1.0" encoding="UTF-8"?>\n')
+                        ET.dump(tree)
                 if opts.time_it:
                     end = time.time()
                     sys.stderr.write("scan took %.3fs\n" % (end - start))
@@ -830,12 +853,18 @@ class Shell(cmdln.Cmdln):
                        "PATH.json, use '-' for stdout)")
     @cmdln.option("-f", "--force", action="store_true",
                   help="allow overwrite of existing file")
+    @cmdln.option("-t", dest="time_it", action="store_true",
+                  help="dump a time summary of the conversion")
+    @cmdln.option("--python", dest="python_encoder", action="store_true",
+                  help="convert with the json module rather than "
+                       "Element.to_json() (for comparison with -t)")
     def do_json(self, subcmd, opts, path):
         """Convert cix XML file into json format.
 
         ${cmd_usage}
         ${cmd_option_list}
         """
+        import time
         import json
         from collections import defaultdict
         from codeintel2.manager import Manager
@@ -869,25 +898,37 @@ class Shell(cmdln.Cmdln):
                 buf = mgr.buf_from_path(path, lang=opts.lang)
                 tree = buf.tree
 
-            result = {}
-            ci = result["codeintel"] = defaultdict(list)
-
-            def _elemToDict(parent, elem):
-                data = defaultdict(list)
-                name = elem.get("name")
-                if name is not None:
-                    data["name"] = name
-                data["tag"] = elem.tag
-                for attr_name, attr in elem.attrib.items():
-                    data[attr_name] = attr
-                parent["children"].append(data)
-                for child in elem:
-                    _elemToDict(data, child)
-
-            for child in tree:
-                _elemToDict(ci, child)
-
-            json.dump(result, output_file, indent=2)
+            if opts.time_it:
+                start = time.time()
+
+            # Element.to_json() is only in the Python 3 ciElementTree
+            if opts.python_encoder or not hasattr(tree, 'to_json'):
+                result = {}
+                ci = result["codeintel"] = defaultdict(list)
+
+                def _elemToDict(parent, elem):
+                    data = defaultdict(list)
+                    name = elem.get("name")
+                    if name is not None:
+                        data["name"] = name
+                    data["tag"] = elem.tag
+                    for attr_name, attr in elem.attrib.items():
+                        data[attr_name] = attr
+                    parent["children"].append(data)
+                    for child in elem:
+                        _elemToDict(data, child)
+
+                for child in tree:
+                    _elemToDict(ci, child)
+
+                json.dump(result, output_file, indent=2)
+            else:
+                # Same output, written straight from the tree.
+                tree.to_json(output_file, indent=2)
+
+            if opts.time_it:
+                end = time.time()
+                sys.stderr.write("json took %.3fs\n" % (end - start))
 
         finally:
             mgr.finalize()
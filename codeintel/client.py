@@ -31,12 +31,18 @@ import os
 import sys
 
 import json
+import math
 import time
 import threading
 import logging
 import socket
+import errno
+import mmap
+import struct
 import weakref
+import zlib
 import functools
+import collections
 from distutils.spawn import find_executable
 
 try:
@@ -50,6 +56,372 @@ PRIORITY_IMMEDIATE = 1      # UI is requesting info on this file now
 PRIORITY_CURRENT = 2        # UI requires info on this file soon
 PRIORITY_OPEN = 3           # UI will likely require info on this file soon
 PRIORITY_BACKGROUND = 4     # info may be needed sometime
+PRIORITY_AGING = 2.0        # seconds a queued request waits per priority level gained
+
+# Priorities of the requests sent without one
+COMMAND_PRIORITIES = {
+    'abort': PRIORITY_CONTROL,
+    'quit': PRIORITY_CONTROL,
+    'set-environment': PRIORITY_CONTROL,
+    'trg-from-pos': PRIORITY_IMMEDIATE,
+    'eval': PRIORITY_IMMEDIATE,
+    'calltip-arg-range': PRIORITY_IMMEDIATE,
+    'buf-to-html': PRIORITY_CURRENT,
+    'get-available-catalogs': PRIORITY_BACKGROUND,
+    'set-xml-catalogs': PRIORITY_BACKGROUND,
+    'memory-report': PRIORITY_BACKGROUND,
+}
+
+# Binary frames, used once the OOP process accepts them (see the
+# 'set-protocol' command); legacy frames are "<length>{json}".  A binary
+# frame is an 8 byte header (magic byte, flags, number of segments, body
+# length) followed by the body: the segment lengths, the JSON document and
+# then the segments.  Segments carry large strings (like the buffer text)
+# as raw UTF-8, rather than as escaped JSON strings; the document lists the
+# keys they belong to under "segments".
+FRAME_MAGIC = 0xC1  # never the first byte of a legacy frame
+FRAME_HEADER = struct.Struct(str('>BBHI'))
+FRAME_SEGMENT_LENGTH = struct.Struct(str('>I'))
+FRAME_FLAGS_JSON = 0x00  # body document is JSON (the only one so far)
+FRAME_SEGMENT_MIN = 1024  # shorter strings stay in the document
+FRAME_MAGIC_BYTE = struct.pack(str('B'), FRAME_MAGIC)
+FRAME_READ_SIZE = 64 * 1024  # initial size of the response read buffer
+FRAME_READ_MIN = 4 * 1024  # smallest free space worth a read
+
+# Shared memory transport (oop mode 'shm', POSIX only); see _ShmRing
+SHM_DIR = '/dev/shm'
+SHM_RING_SIZE = 4 * 1024 * 1024  # bytes of data in each direction
+SHM_CONNECT_TIMEOUT = 10  # seconds for the child to open its ends
+SHM_POSITION = struct.Struct(str('=Q'))
+SHM_WRITE_POS = 0  # header offsets
+SHM_READ_POS = 8
+SHM_DATA = 64
+
+# Buffer texts are cached by the OOP process once it accepts text deltas
+# (see the 'set-protocol' command); after the first full text, requests
+# for the same path carry the edits against the previous version instead.
+TEXT_DELTA_MIN = 4 * 1024  # shorter texts are always sent in full
+TEXT_DELTA_CHUNK = 4 * 1024  # characters compared at once by text_delta()
+
+# Request latency histograms; see LatencyHistogram
+LATENCY_MIN = 0.0001  # upper bound of the first bucket, in seconds
+LATENCY_GROWTH = 2 ** 0.25  # ratio between the bounds of consecutive buckets
+LATENCY_BUCKETS = 96  # the last bucket (about 28 minutes) takes the rest
+LATENCY_STAGES = ('queued', 'server', 'dispatch', 'total')
+
+# Requests that a newer request of the same kind, for the same buffer,
+# makes useless; see request_key()
+COALESCED_COMMANDS = ('scan-document', 'trg-from-pos', 'calltip-arg-range', 'eval')
+
+_text_type = type('')
+
+
+def encode_frame(obj):
+    """Encode a request or response dict as a binary frame"""
+    keys = [key for key, value in obj.items()
+            if isinstance(value, _text_type) and len(value) >= FRAME_SEGMENT_MIN]
+    segments = []
+    if keys:
+        obj = dict(obj)
+        for key in keys:
+            segments.append(obj.pop(key).encode('utf-8'))
+        obj['segments'] = keys
+    document = json.dumps(obj, separators=(',', ':')).encode('utf-8')
+    length = FRAME_SEGMENT_LENGTH.size * len(segments) + len(document) + sum(len(segment) for segment in segments)
+    parts = [FRAME_HEADER.pack(FRAME_MAGIC, FRAME_FLAGS_JSON, len(segments), length)]
+    parts.extend(FRAME_SEGMENT_LENGTH.pack(len(segment)) for segment in segments)
+    parts.append(document)
+    parts.extend(segments)
+    return b''.join(parts)
+
+
+def decode_frame(flags, count, body):
+    """Decode the body of a binary frame, given the values from its header"""
+    if flags != FRAME_FLAGS_JSON:
+        raise ValueError("Unsupported frame flags: %#x" % flags)
+    body = memoryview(body)
+    lengths = [FRAME_SEGMENT_LENGTH.unpack_from(body, FRAME_SEGMENT_LENGTH.size * i)[0] for i in range(count)]
+    start = FRAME_SEGMENT_LENGTH.size * count
+    end = len(body) - sum(lengths)
+    if end < start:
+        raise ValueError("Invalid frame segment lengths")
+    obj = json.loads(body[start:end].tobytes().decode('utf-8'))
+    keys = obj.pop('segments', []) if count else []
+    if len(keys) != count:
+        raise ValueError("Invalid frame segments")
+    for key, length in zip(keys, lengths):
+        obj[key] = body[end:end + length].tobytes().decode('utf-8')
+        end += length
+    return obj
+
+
+class FrameDecoder(object):
+    """Buffered decoder for the frames read from the OOP process
+
+    Reads go straight into a reusable bytearray (with readinto() when the
+    stream has it), and all the complete frames in it are decoded from
+    memoryview slices, so a single read can yield many responses.  The
+    bytes of a partial frame are only moved to the front when the space
+    after them runs out; the buffer grows to fit frames larger than it."""
+
+    def __init__(self, size=FRAME_READ_SIZE):
+        self._buf = bytearray(size)
+        self._start = 0  # first byte not decoded yet
+        self._end = 0  # end of the bytes read so far
+        self._want = 0  # size of the partial frame at _start, if known
+
+    def fill(self, stream):
+        """Read whatever is available from the stream into the buffer.
+        Returns the number of bytes read (zero on EOF)."""
+        buf = self._buf
+        pending = self._end - self._start
+        if not pending:
+            self._start = self._end = 0
+        elif len(buf) - self._end < FRAME_READ_MIN or len(buf) - self._start < self._want:
+            buf[:pending] = buf[self._start:self._end]
+            self._start, self._end = 0, pending
+        if len(buf) - self._end < FRAME_READ_MIN or len(buf) < self._want:
+            buf.extend(bytearray(max(len(buf), self._want - len(buf))))
+        readinto = getattr(stream, 'readinto', None)
+        if readinto:
+            view = memoryview(buf)
+            try:
+                count = readinto(view[self._end:]) or 0
+            finally:
+                _release(view)
+        else:
+            # Streams without readinto() may block until all the requested
+            # bytes arrive; only ask for what the current frame needs
+            data = stream.read(max(self._want - pending, 1))
+            count = len(data)
+            buf[self._end:self._end + count] = data
+        self._end += count
+        return count
+
+    def decode(self):
+        """Decode and return the list of complete frames in the buffer"""
+        buf = self._buf
+        responses = []
+        pos, end = self._start, self._end
+        self._want = 0
+        view = memoryview(buf)
+        try:
+            while pos < end:
+                ch = bytes(buf[pos:pos + 1])  # bytearray isn't 'in' a str on Python 2
+                if ch == FRAME_MAGIC_BYTE:
+                    size = FRAME_HEADER.size
+                    if end - pos >= size:
+                        magic, flags, count, length = FRAME_HEADER.unpack_from(buf, pos)
+                        size += length
+                    if end - pos < size:
+                        self._want = size
+                        break
+                    responses.append(decode_frame(flags, count, view[pos + FRAME_HEADER.size:pos + size]))
+                    pos += size
+                elif ch in b'0123456789':
+                    brace = buf.find(b'{', pos, end)
+                    digits = bytes(buf[pos:end if brace == -1 else brace])
+                    if not digits.isdigit():
+                        raise ValueError("Invalid frame length characters: %r" % digits)
+                    if brace == -1:
+                        break
+                    length = int(digits)
+                    if end - brace < length:
+                        self._want = brace - pos + length
+                        break
+                    responses.append(json.loads(view[brace:brace + length].tobytes().decode('utf-8')))
+                    pos = brace + length
+                elif ch in b' \t\r\n':
+                    pos += 1
+                else:
+                    raise ValueError("Invalid frame length character: %r" % ch)
+        finally:
+            _release(view)
+        self._start = pos
+        return responses
+
+
+def _release(view):
+    """Release a memoryview of the read buffer, so the buffer can be resized;
+    Python 2 has no memoryview.release(), and frees it by refcount instead"""
+    release = getattr(view, 'release', None)
+    if release:
+        release()
+
+
+def _common_length(old, new, limit, suffix=False):
+    """Length of the common prefix (or suffix) of two texts, up to limit"""
+    def part(text, start, end):
+        return text[len(text) - end:len(text) - start] if suffix else text[start:end]
+    # skip whole equal chunks, then bisect the first unequal one
+    length = 0
+    while length < limit:
+        end = min(length + TEXT_DELTA_CHUNK, limit)
+        if part(old, length, end) != part(new, length, end):
+            break
+        length = end
+    end = min(length + TEXT_DELTA_CHUNK, limit)
+    while length < end:
+        mid = (length + end + 1) // 2
+        if part(old, length, mid) == part(new, length, mid):
+            length = mid
+        else:
+            end = mid - 1
+    return length
+
+
+def text_delta(old, new):
+    """Find the region that changed between two texts.
+    Returns (start, end, text) such that replacing old[start:end] with text
+    gives new; offsets are in characters."""
+    limit = min(len(old), len(new))
+    start = _common_length(old, new, limit)
+    suffix = _common_length(old, new, limit - start, suffix=True)
+    return start, len(old) - suffix, new[start:len(new) - suffix]
+
+
+def text_checksum(text):
+    """Checksum the OOP process verifies after applying text deltas"""
+    return zlib.crc32(text.encode('utf-8')) & 0xffffffff
+
+
+def request_key(kwargs):
+    """Key under which a request supersedes older ones (None if it doesn't)"""
+    command = kwargs.get('command')
+    if command not in COALESCED_COMMANDS:
+        return None
+    path = kwargs.get('path')
+    kind = kwargs.get('type')
+    trg = kwargs.get('trg')
+    if isinstance(trg, dict):
+        # completions, calltips and definitions are all 'eval' requests;
+        # only the trigger tells them apart
+        if path is None:
+            path = trg.get('path')
+        if kind is None:
+            kind = (trg.get('form'), trg.get('type'))
+    # preceding_trg_from_pos() looks back from 'curr-pos' and mustn't
+    # replace a plain trg_from_pos() for the same buffer
+    return (command, path, kind, 'curr-pos' in kwargs)
+
+
+def request_priority(kwargs):
+    """Priority at which a request is sent (one of the PRIORITY_* values)"""
+    priority = kwargs.get('priority')
+    if priority is None:
+        priority = COMMAND_PRIORITIES.get(kwargs.get('command'), PRIORITY_OPEN)
+    return min(max(priority, PRIORITY_CONTROL), PRIORITY_BACKGROUND)
+
+
+class RequestQueue(object):
+    """Queue of the requests waiting to be sent to the OOP process
+
+    Items are (callback, kwargs) tuples.  Each priority (see
+    request_priority()) has its own FIFO lane, and the lanes are drained
+    highest priority first; a request gains one priority level for every
+    PRIORITY_AGING seconds it waits, so background work isn't starved.
+    A request with a key (see request_key()) replaces the pending request
+    with the same key, which is handed to the superseded callback instead;
+    the new request keeps the place of the one it replaced in its lane (or
+    only its aging, if the new request has a different priority)."""
+
+    def __init__(self, superseded=None, aging=PRIORITY_AGING):
+        self._superseded = superseded
+        self._aging = aging
+        self._cond = threading.Condition()
+        self._lanes = [collections.deque() for priority in range(PRIORITY_BACKGROUND + 1)]  # of [callback, kwargs, superseded, aging since, time queued]
+        self._pending = {}  # keyed by request key; value is the item in _lanes
+
+    def put(self, request):
+        callback, kwargs = request
+        if kwargs:
+            key = request_key(kwargs)
+            priority = request_priority(kwargs)
+        else:
+            key = None
+            priority = PRIORITY_CONTROL  # end of queue
+        now = time.time()
+        item = [callback, kwargs, False, now, now]
+        with self._cond:
+            old = self._pending.pop(key, None) if key else None
+            if old:
+                superseded = old[:2]
+                if any(entry is old for entry in self._lanes[priority]):
+                    # same lane: take over its slot (and aging) in place
+                    old[0], old[1], old[4] = callback, kwargs, now
+                    item = old
+                else:
+                    old[2] = True  # skipped by get()
+                    item[3] = old[3]  # aging starts with the first request
+            if key:
+                self._pending[key] = item
+            if item is not old:
+                self._lanes[priority].append(item)
+            self._cond.notify()
+        if old and self._superseded:
+            self._superseded(*superseded)
+
+    def get(self):
+        """Wait for the next request; returns (callback, kwargs, time queued)"""
+        with self._cond:
+            while True:
+                now = time.time()
+                best = None
+                for priority, lane in enumerate(self._lanes):
+                    while lane and lane[0][2]:
+                        lane.popleft()  # superseded
+                    if lane:
+                        aged = priority - int((now - lane[0][3]) / self._aging)
+                        if best is None or aged < best[0]:
+                            best = (aged, lane)
+                if best is None:
+                    self._cond.wait()
+                    continue
+                callback, kwargs, superseded, aging, queued = item = best[1].popleft()
+                key = request_key(kwargs) if kwargs else None
+                if key and self._pending.get(key) is item:
+                    del self._pending[key]
+                return callback, kwargs, queued
+
+    def pending(self, key):
+        """Whether a request with the given key is waiting to be sent"""
+        with self._cond:
+            return key in self._pending
+
+
+class LatencyHistogram(object):
+    """Log-scale histogram of request durations
+
+    Bucket i counts the durations up to LATENCY_MIN * LATENCY_GROWTH ** i
+    seconds, so percentiles come out within a bucket (about 19%) of the
+    real value, in constant memory."""
+
+    def __init__(self):
+        self.buckets = [0] * LATENCY_BUCKETS
+        self.count = 0
+        self.total = 0.0
+        self.max = 0.0
+
+    def add(self, seconds):
+        if seconds > LATENCY_MIN:
+            bucket = min(int(math.ceil(math.log(seconds / LATENCY_MIN, LATENCY_GROWTH))), LATENCY_BUCKETS - 1)
+        else:
+            bucket = 0
+        self.buckets[bucket] += 1
+        self.count += 1
+        self.total += seconds
+        self.max = max(self.max, seconds)
+
+    def percentile(self, fraction):
+        """Upper bound of the duration of the given fraction of the requests"""
+        rank = fraction * self.count
+        seen = 0
+        for bucket, count in enumerate(self.buckets):
+            seen += count
+            if count and seen >= rank:
+                return min(LATENCY_MIN * LATENCY_GROWTH ** bucket, self.max)
+        return self.max
+
 
 logger_name = 'CodeIntel.codeintel'
 logger_level = logging.INFO  # INFO
@@ -115,7 +487,7 @@ class CodeIntel(object):
             if self.mgr is mgr:
                 self.mgr = None
 
-    def activate(self, reset_db_as_necessary=False, codeintel_command=None, oop_mode=None, log_levels=None, env=None, prefs=None):
+    def activate(self, reset_db_as_necessary=False, codeintel_command=None, oop_mode=None, log_levels=None, env=None, prefs=None, latency_log_interval=None):
         self.log.debug("activating codeintel service")
 
         if self._quit_application:
@@ -136,6 +508,7 @@ class CodeIntel(object):
                     log_levels=log_levels,
                     env=env,
                     prefs=prefs,
+                    latency_log_interval=latency_log_interval,
                 )
                 while True:
                     try:
@@ -230,6 +603,18 @@ class CodeIntel(object):
         while not have_response:
             time.sleep(0.1)
 
+    def collectLatencyReports(self, callback, closure):
+        """Report the request latency percentiles (see
+        CodeIntelManager.latency_report), like collectReports does for memory"""
+        if not self.mgr:
+            return
+        for command, stages in sorted(self.mgr.latency_report().items()):
+            for stage, values in sorted(stages.items()):
+                for name in ('p50', 'p95', 'p99'):
+                    path = 'latency/%s/%s/%s' % (command, stage, name)
+                    desc = "%s latency of %s requests (%s of %d)" % (stage.capitalize(), command, name, values['count'])
+                    callback(path, 'other', 'ms', values[name], desc)
+
     def buf_from_path(self, path):
         """
         Get an existing buffer given the path
@@ -282,6 +667,9 @@ class _TCPConnection(_Connection):
     def read(self, count):
         return self._read.read(count)
 
+    def readinto(self, buffer):
+        return self._read.readinto(buffer)
+
     def write(self, data):
         return self._write.write(data)
 
@@ -314,6 +702,9 @@ class _ServerConnection(_Connection):
     def read(self, count):
         return self._read.read(count)
 
+    def readinto(self, buffer):
+        return self._read.readinto(buffer)
+
     def write(self, data):
         return self._write.write(data)
 
@@ -341,6 +732,8 @@ if sys.platform.startswith("win"):
             return
     del Win32Pipe
 
+    _ShmConnection = None  # no shared memory transport on Windows yet
+
     CODEINTEL_COMMAND = 'codeintel.exe'
     CODEINTEL_PATHS = (
         '/',
@@ -387,6 +780,9 @@ else:
         def read(self, count):
             return self._read.read(count)
 
+        def readinto(self, buffer):
+            return self._read.readinto(buffer)
+
         def write(self, data):
             return self._write.write(data)
 
@@ -409,6 +805,185 @@ else:
             self._read.close()
             self._write.close()
 
+    import fcntl
+
+    class _ShmRing(object):
+        """One direction of a _ShmConnection: a memory-mapped ring buffer
+
+        The file starts with a header holding the write and read positions
+        (which only grow; offsets into the data are taken modulo its size),
+        followed by the data.  Every move of a position is followed by a
+        ring of a FIFO "bell" (non-blocking; a full bell already wakes the
+        other side up), and a side about to block reads its bell until the
+        positions let it go on; since the ring always comes after the store,
+        a side that saw a stale position still finds the ring waiting."""
+
+        def __init__(self, path, size, data_bell, space_bell):
+            fd = os.open(path, os.O_RDWR)
+            try:
+                self.map = mmap.mmap(fd, SHM_DATA + size)
+            finally:
+                os.close(fd)
+            self.size = size
+            self.data_bell = data_bell  # rung by the writer, waited on by the reader
+            self.space_bell = space_bell  # rung by the reader, waited on by the writer
+
+        def _pos(self, offset):
+            return SHM_POSITION.unpack_from(self.map, offset)[0]
+
+        def _wait(self, bell, ready):
+            while not ready():
+                if not os.read(bell, 4096):
+                    return False  # the other side closed the bell
+            return True
+
+        def _ring(self, bell):
+            try:
+                os.write(bell, b'.')
+            except OSError as e:
+                if e.errno != errno.EAGAIN:
+                    raise  # a full bell wakes up the other side anyway
+
+        def readinto(self, buffer):
+            read = self._pos(SHM_READ_POS)
+            if self._pos(SHM_WRITE_POS) == read:
+                if not self._wait(self.data_bell, lambda: self._pos(SHM_WRITE_POS) != read):
+                    return 0  # EOF
+            count = min(len(buffer), self._pos(SHM_WRITE_POS) - read)
+            start = read % self.size
+            first = min(count, self.size - start)
+            buffer[:first] = self.map[SHM_DATA + start:SHM_DATA + start + first]
+            buffer[first:count] = self.map[SHM_DATA:SHM_DATA + count - first]
+            SHM_POSITION.pack_into(self.map, SHM_READ_POS, read + count)
+            self._ring(self.space_bell)
+            return count
+
+        def write(self, data):
+            view = memoryview(data)
+            while len(view):
+                write = self._pos(SHM_WRITE_POS)
+                if write - self._pos(SHM_READ_POS) == self.size:
+                    if not self._wait(self.space_bell, lambda: write - self._pos(SHM_READ_POS) < self.size):
+                        raise IOError("Shared memory ring closed")
+                count = min(len(view), self.size - (write - self._pos(SHM_READ_POS)))
+                start = write % self.size
+                first = min(count, self.size - start)
+                self.map[SHM_DATA + start:SHM_DATA + start + first] = view[:first]
+                self.map[SHM_DATA:SHM_DATA + count - first] = view[first:count]
+                SHM_POSITION.pack_into(self.map, SHM_WRITE_POS, write + count)
+                self._ring(self.data_bell)
+                view = view[count:]
+            return len(data)
+
+        def close(self):
+            for bell in (self.data_bell, self.space_bell):
+                try:
+                    os.close(bell)
+                except OSError:
+                    pass
+            self.map.close()
+
+    class _ShmConnection(_Connection):
+        """A connection through two shared memory rings (see _ShmRing): 'in'
+        for requests, 'out' for responses.  Each ring has a '.data' and a
+        '.space' FIFO as its bells.  Each side opens the read ends of its
+        bells, then the write ends, maps both rings, rings each of its write
+        bells once and waits for the other side's ring on each of its read
+        bells; a child that doesn't know about --shm makes get_stream() time
+        out."""
+        _dir = None
+        _in = None
+        _out = None
+
+        def get_commandline_args(self):
+            import tempfile
+            shm_dir = SHM_DIR if os.path.isdir(SHM_DIR) else None
+            self._dir = tempfile.mkdtemp(prefix='codeintel-', suffix='-oop-shm', dir=shm_dir)
+            for name in ('in', 'out'):
+                path = os.path.join(self._dir, name)
+                with open(path, 'wb') as f:
+                    f.truncate(SHM_DATA + SHM_RING_SIZE)
+                os.mkfifo(path + '.data', 0o600)
+                os.mkfifo(path + '.space', 0o600)
+            return ['--shm', self._dir, '--shm-size', str(SHM_RING_SIZE)]
+
+        def _open_bell(self, name, write, deadline):
+            path = os.path.join(self._dir, name)
+            if not write:
+                # opening the read end doesn't wait for the other side
+                return os.open(path, os.O_RDONLY | os.O_NONBLOCK)
+            # the write end (left non-blocking) can't open until the child opens the read end
+            while True:
+                try:
+                    return os.open(path, os.O_WRONLY | os.O_NONBLOCK)
+                except OSError as e:
+                    if e.errno != errno.ENXIO or time.time() > deadline:
+                        raise
+                time.sleep(0.05)
+
+        def _wait_bell(self, bell, deadline):
+            # until the child rings the bell, reads see EOF (no writer yet)
+            # or EAGAIN (nothing written yet)
+            while True:
+                try:
+                    if os.read(bell, 1):
+                        break
+                except OSError as e:
+                    if e.errno != errno.EAGAIN:
+                        raise
+                if time.time() > deadline:
+                    raise IOError("Timed out waiting for the shared memory connection")
+                time.sleep(0.05)
+            fcntl.fcntl(bell, fcntl.F_SETFL, fcntl.fcntl(bell, fcntl.F_GETFL) & ~os.O_NONBLOCK)
+
+        def get_stream(self):
+            deadline = time.time() + SHM_CONNECT_TIMEOUT
+            bells = []
+            try:
+                for name, write in (('out.data', False), ('in.space', False), ('out.space', True), ('in.data', True)):
+                    bells.append(self._open_bell(name, write, deadline))
+                out_data, in_space, out_space, in_data = bells
+                path = os.path.join(self._dir, '%s')
+                self._out = _ShmRing(path % 'out', SHM_RING_SIZE, out_data, out_space)
+                self._in = _ShmRing(path % 'in', SHM_RING_SIZE, in_data, in_space)
+                os.write(out_space, b'.')
+                os.write(in_data, b'.')
+                self._wait_bell(out_data, deadline)
+                self._wait_bell(in_space, deadline)
+            except Exception:
+                for bell in bells:
+                    os.close(bell)
+                raise
+            return self
+
+        def read(self, count):
+            buffer = bytearray(count)
+            return bytes(buffer[:self.readinto(buffer)])
+
+        def readinto(self, buffer):
+            return self._out.readinto(buffer)
+
+        def write(self, data):
+            return self._in.write(data)
+
+        def cleanup(self):
+            # The rings stay mapped and the bells open; only the names go
+            for name in ('in', 'in.data', 'in.space', 'out', 'out.data', 'out.space'):
+                try:
+                    os.remove(os.path.join(self._dir, name))
+                except OSError:
+                    pass
+            try:
+                os.rmdir(self._dir)
+            except OSError:
+                pass
+
+        def close(self):
+            self.cleanup()
+            for ring in (self._in, self._out):
+                if ring:
+                    ring.close()
+
     CODEINTEL_COMMAND = 'codeintel'
     CODEINTEL_PATHS = (
         '/usr',
@@ -436,6 +1011,9 @@ class CodeIntelManager(threading.Thread):
     _watchdog_thread = None  # background thread to watch for process termination
     _memory_error_restart_count = 0
     _cmd_messge = True
+    _binary_frames = False  # the OOP process accepts binary frames
+    _text_deltas = False  # the OOP process accepts buffer text deltas
+    _latency_log_interval = None  # seconds between latency reports in the log (None for never)
     proc = None
     pipe = None
 
@@ -469,7 +1047,7 @@ class CodeIntelManager(threading.Thread):
         },
     ]
 
-    def __init__(self, service, progress_callback=None, shutdown_callback=None, codeintel_command=None, oop_mode=None, log_levels=None, env=None, prefs=None):
+    def __init__(self, service, progress_callback=None, shutdown_callback=None, codeintel_command=None, oop_mode=None, log_levels=None, env=None, prefs=None, latency_log_interval=None):
         self.log = logging.getLogger(logger_name + '.' + self.__class__.__name__)
         self.service = service
         self.languages = service.languages
@@ -487,10 +1065,17 @@ class CodeIntelManager(threading.Thread):
             self.prefs = [prefs] if isinstance(prefs, dict) else prefs
         if env is not None:
             self.env = env
+        if latency_log_interval is not None:
+            self._latency_log_interval = latency_log_interval
         self._state_condvar = threading.Condition()
         self._discard_time = time.time()
         self.requests = {}  # keyed by request id; value is tuple (callback, request data, time sent) requests will time out at some point...
-        self.unsent_requests = queue.Queue()
+        self.unsent_requests = RequestQueue(superseded=self._superseded)
+        self._inflight = {}  # keyed by request key; value is the id of the latest request sent
+        self._cancelled = set()  # ids of the sent requests superseded by newer ones
+        self._timings = {}  # keyed by request id; value is tuple (command, time queued, time sent)
+        self.latency = {}  # keyed by command; value is dict of LatencyHistogram keyed by stage
+        self._latency_logged = time.time()
         threading.Thread.__init__(self, name="CodeIntel Manager Thread")
 
     @property
@@ -590,6 +1175,12 @@ class CodeIntelManager(threading.Thread):
             "CodeIntelManager.init_child should run on background thread!"
         self.log.debug("initializing child process")
         conn = None
+        self._binary_frames = False
+        self._text_deltas = False
+        self._sent_texts = {}  # keyed by path; value is tuple (version, text) last sent
+        self._inflight = {}
+        self._cancelled = set()
+        self._timings = {}
         try:
             codeintel_command = self.find_command()
             cmd = [codeintel_command]
@@ -609,6 +1200,8 @@ class CodeIntelManager(threading.Thread):
                 conn = _TCPConnection()
             elif _oop_mode == 'server':
                 conn = _ServerConnection()
+            elif _oop_mode == 'shm' and _ShmConnection:
+                conn = _ShmConnection()
             else:
                 self.log.warn("Unknown codeintel oop mode %s, falling back to pipes", _oop_mode)
                 conn = _PipeConnection()
@@ -635,8 +1228,17 @@ class CodeIntelManager(threading.Thread):
                 self.pipe = conn.get_stream()
                 self._cmd_messge = True
                 self.log.info("Successfully connected with OOP CodeIntel!")
-            except Exception:
+            except Exception as e:
                 self.pipe = None
+                if _oop_mode == 'shm':
+                    # The child doesn't support the shared memory transport
+                    # (or couldn't attach); restart it using pipes
+                    self.log.warn("Shared memory connection failed (%s), falling back to pipes", e)
+                    self._oop_mode = 'pipe'
+                    try:
+                        self.proc.kill()
+                    except Exception:
+                        pass
 
             conn.cleanup()  # This will remove the filesystem files (it keeps the fds open)
 
@@ -666,6 +1268,15 @@ class CodeIntelManager(threading.Thread):
 
         outstanding_cpln_langs = set()
 
+        def set_protocol(request, response):
+            # Older OOP processes fail the unknown command; keep legacy frames
+            if response.get('success') and response.get('framing') == 'binary':
+                self.log.debug("using binary frames")
+                self._binary_frames = True
+            if response.get('success') and response.get('text_deltas'):
+                self.log.debug("using buffer text deltas")
+                self._text_deltas = True
+
         def update(message=None, state=None, response=None):
             if state in (CodeIntelManager.STATE_DESTROYED, CodeIntelManager.STATE_BROKEN):
                 self.kill()
@@ -801,6 +1412,7 @@ class CodeIntelManager(threading.Thread):
                 self._send_request_thread.start()
             update("CodeIntel ready.", state=CodeIntelManager.STATE_READY)
 
+        self._send(callback=set_protocol, command='set-protocol', framing=['binary', 'legacy'], text_deltas=True)
         self._send(callback=get_citadel_langs, command='get-languages', type='citadel')
         self._send(callback=get_xml_langs, command='get-languages', type='xml')
         self._send(callback=get_stdlib_langs, command='get-languages', type='stdlib-supported')
@@ -841,6 +1453,8 @@ class CodeIntelManager(threading.Thread):
         the main thread if desired."""
         if self.state is CodeIntelManager.STATE_DESTROYED:
             raise RuntimeError("Manager already shut down")
+        # The OOP process uses the priority too, to yield background scans
+        kwargs.setdefault('priority', request_priority(kwargs))
         self.unsent_requests.put((callback, kwargs))
 
     def _send_queued_requests(self):
@@ -853,15 +1467,15 @@ class CodeIntelManager(threading.Thread):
                 with self._state_condvar:
                     self._state_condvar.wait()
                     continue  # wait...
-            callback, kwargs = self.unsent_requests.get()
+            callback, kwargs, queued_time = self.unsent_requests.get()
             if callback is None and kwargs is None:
                 # end of queue (shutting down)
                 break
-            self._send(callback, **kwargs)
+            self._send(callback, queued_time=queued_time, **kwargs)
 
         self.log.info("%s thread ended!" % threading.current_thread().name)
 
-    def _send(self, callback=None, **kwargs):
+    def _send(self, callback=None, queued_time=None, **kwargs):
         """
         Private API for sending; ignores the current state of the manager and
         just dumps things over.  The caller should check that it things are in
@@ -871,20 +1485,34 @@ class CodeIntelManager(threading.Thread):
         """
         if not self.pipe:
             return
+        key = request_key(kwargs)
+        if key:
+            self._cancel(self._inflight.get(key))
         req_id = hex(self._next_id)
         kwargs['req_id'] = req_id
-        text = json.dumps(kwargs, separators=(',', ':'))
+        if key:
+            self._inflight[key] = req_id
+        if self._text_deltas and kwargs.get('path') and isinstance(kwargs.get('text'), _text_type):
+            callback, kwargs = self._text_delta_request(callback, kwargs)
+        if self._binary_frames:
+            buf = encode_frame(kwargs)
+            self.log.debug("sending binary frame: %s (%d bytes)", kwargs.get('command'), len(buf))
+        else:
+            text = json.dumps(kwargs, separators=(',', ':'))
+            self.log.debug("sending frame: %s", text)
+            text = text.encode('utf-8')
+            length = "%i" % len(text)
+            length = length.encode('utf-8')
+            buf = length + text
         # Keep the request parameters so the handler can examine it; however,
         # drop the text and env, because those are huge and usually useless
         kwargs.pop('text', None)
+        kwargs.pop('text_edits', None)
         kwargs.pop('env', None)
-        self.requests[req_id] = (callback, kwargs, time.time())
+        now = time.time()
+        self.requests[req_id] = (callback, kwargs, now)
+        self._timings[req_id] = (kwargs.get('command'), queued_time or now, now)
         self._next_id += 1
-        self.log.debug("sending frame: %s", text)
-        text = text.encode('utf-8')
-        length = "%i" % len(text)
-        length = length.encode('utf-8')
-        buf = length + text
         try:
             self.pipe.write(buf)
         except Exception as e:
@@ -893,6 +1521,64 @@ class CodeIntelManager(threading.Thread):
             self._progress_callback(self, message)
             self.close()
 
+    def _cancel(self, req_id):
+        """Abort a sent request superseded by a newer one; its callback still
+        gets the final response, flagged as 'superseded'"""
+        if req_id not in self.requests or req_id in self._cancelled:
+            return
+        self.log.debug("Cancelling superseded request %s", req_id)
+        self._cancelled.add(req_id)
+        self._send(command='abort', id=req_id)
+
+    def _superseded(self, callback, request):
+        """Drop a queued request replaced by a newer one before being sent"""
+        self.log.debug("Dropping superseded request %r", request.get('command'))
+        if callback:
+            response = {'success': False, 'superseded': True}
+            self.service._main_thread_runner(lambda: callback(request, response))
+
+    def _text_delta_request(self, callback, kwargs):
+        """
+        Replace the text of a request by the edits against the version last
+        sent for the same path.  Every text gets a new version number, and the
+        edits carry a checksum of the resulting text; when the OOP process
+        doesn't have the base version (or the checksum doesn't match after
+        applying the edits) it fails the request with 'text_mismatch', and the
+        request is sent again with the full text, unless a newer request for
+        the same key (see request_key()) has replaced it.
+        """
+        path = kwargs['path']
+        text = kwargs['text']
+        full_kwargs = dict(kwargs)
+        del full_kwargs['req_id']
+        base_version, base_text = self._sent_texts.get(path, (None, None))
+        version = (base_version or 0) + 1
+        self._sent_texts[path] = (version, text)
+        kwargs['text_version'] = version
+        if base_text is not None and len(text) >= TEXT_DELTA_MIN:
+            start, end, new_text = text_delta(base_text, text)
+            if len(new_text) < len(text) // 2:
+                del kwargs['text']
+                kwargs['text_base'] = base_version
+                kwargs['text_edits'] = [[start, end, new_text]]
+                kwargs['text_checksum'] = text_checksum(text)
+
+        def resend_on_mismatch(request, response):
+            if response.get('text_mismatch') and 'text' not in kwargs:
+                self._sent_texts.pop(path, None)
+                # a resend would supersede (and abort) a newer request for
+                # the same key, so only resend if this is still the latest
+                key = request_key(request)
+                if not response.get('superseded') and not (key and (
+                        self._inflight.get(key, request['req_id']) != request['req_id'] or
+                        self.unsent_requests.pending(key))):
+                    self.log.debug("text mismatch for %s; resending full text", path)
+                    self.send(callback=callback, **full_kwargs)
+                    return
+            if callback:
+                callback(request, response)
+        return resend_on_mismatch, kwargs
+
     def run(self):
         """Event loop for the codeintel manager background thread"""
         assert threading.current_thread().name != "MainThread", \
@@ -909,37 +1595,22 @@ class CodeIntelManager(threading.Thread):
 
             first_buf = True
             try:
-                buf = b''
+                decoder = FrameDecoder()
                 while self.proc and self.pipe:
                     # Loop to read from the pipe
-                    ch = self.pipe.read(1)
-                    if not ch:
+                    if not decoder.fill(self.pipe):
                         # nothing read, EOF
                         raise IOError("Failed to read from socket")
                     ok = True
-                    if ch == b'{':
-                        length = int(buf)
-                        buf = ch
-                        while len(buf) < length:
-                            data = self.pipe.read(length - len(buf))
-                            if not data:
-                                # nothing read, EOF
-                                raise IOError("Failed to read from socket")
-                            buf += data
-                        self.log.debug("Got codeintel response: %r" % buf)
-                        if first_buf and buf == b'{}':
-                            first_buf = False
-                            buf = b''
-                            continue
-                        response = json.loads(buf.decode('utf-8'))
-                        self.handle(response)  # handle runs asynchronously and shouldn't raise exceptions
-                        buf = b''
-                    elif ch in b'0123456789':
-                        buf += ch
-                    elif ch in b' \t\r\n':
-                        pass
-                    else:
-                        raise ValueError("Invalid frame length character: %r" % ch)
+                    responses = decoder.decode()
+                    if not responses:
+                        continue
+                    self.log.debug("Got %d codeintel responses", len(responses))
+                    if first_buf and responses[0] == {}:
+                        first_buf = False
+                        del responses[0]
+                    if responses:
+                        self.handle(*responses)  # handle runs asynchronously and shouldn't raise exceptions
 
             except Exception as e:
                 if self.state in (CodeIntelManager.STATE_QUITTING, CodeIntelManager.STATE_DESTROYED):
@@ -956,8 +1627,11 @@ class CodeIntelManager(threading.Thread):
 
         self.log.info("%s thread ended!" % threading.current_thread().name)
 
-    def handle(self, response):
-        """Handle a response from the codeintel process"""
+    def handle(self, *responses):
+        """Handle responses from the codeintel process; the responses read
+        together are all handled in a single main thread call"""
+        received = time.time()
+
         def _handle():
             assert threading.current_thread().name == "MainThread", \
                 "CodeIntelManager.handle() should run on main thread!"
@@ -976,42 +1650,97 @@ class CodeIntelManager(threading.Thread):
                         else:
                             self.log.debug("Discarding request %r", request)
                         del self.requests[req_id]
+                        self._timings.pop(req_id, None)
+
+            def _handle_response(response):
+                self.log.debug("handling: %r", response)
+                req_id = response.get('req_id')
+                callback, request, sent_time = self.requests.get(req_id, (None, None, None))
+                request_command = request.get('command', '') if request else None
+                response_command = response.get('command', request_command)
+                if req_id is None or request_command != response_command:
+                    # unsolicited response, look for a handler
+                    try:
+                        if not response_command:
+                            self.log.error("No 'command' in response %r", response)
+                            raise ValueError("Invalid response frame %r" % response)
+                        meth = getattr(self, 'do_' + response_command.replace('-', '_'), None)
+                        if not meth:
+                            self.log.error("Unknown command %r, response %r", response_command, response)
+                            raise ValueError("Unknown unsolicited response \"%s\"" % response_command)
+                        meth(response)
+                    except Exception as e:
+                        self.log.error("Error handling unsolicited response")
+                    return
+                if not request:
+                    self.log.error("Discard response for unknown request %s (command %s): have %s",
+                            req_id, response_command or '%r' % response, sorted(self.requests.keys()))
+                    return
+                self.log.debug("Request %s (command %s) took %0.2f seconds", req_id, request_command or '<unknown>', time.time() - sent_time)
+                if req_id in self._cancelled:
+                    response = dict(response, superseded=True)
+                if 'success' in response:
+                    # remove completed request
+                    self.log.debug("Removing completed request %s", req_id)
+                    del self.requests[req_id]
+                    timing = self._timings.pop(req_id, None)
+                    if timing and not response.get('superseded'):
+                        self._record_latency(received, *timing)
+                    self._cancelled.discard(req_id)
+                    key = request_key(request)
+                    if key and self._inflight.get(key) == req_id:
+                        del self._inflight[key]
+                else:
+                    # unfinished response; update the sent time so it doesn't time out
+                    self.requests[req_id] = (callback, request, time.time())
+                if callback:
+                    callback(request, response)
 
-            self.log.debug("handling: %r", response)
-            req_id = response.get('req_id')
-            callback, request, sent_time = self.requests.get(req_id, (None, None, None))
-            request_command = request.get('command', '') if request else None
-            response_command = response.get('command', request_command)
-            if req_id is None or request_command != response_command:
-                # unsolicited response, look for a handler
+            for response in responses:
                 try:
-                    if not response_command:
-                        self.log.error("No 'command' in response %r", response)
-                        raise ValueError("Invalid response frame %r" % response)
-                    meth = getattr(self, 'do_' + response_command.replace('-', '_'), None)
-                    if not meth:
-                        self.log.error("Unknown command %r, response %r", response_command, response)
-                        raise ValueError("Unknown unsolicited response \"%s\"" % response_command)
-                    meth(response)
+                    _handle_response(response)
                 except Exception as e:
-                    self.log.error("Error handling unsolicited response")
-                return
-            if not request:
-                self.log.error("Discard response for unknown request %s (command %s): have %s",
-                        req_id, response_command or '%r' % response, sorted(self.requests.keys()))
-                return
-            self.log.debug("Request %s (command %s) took %0.2f seconds", req_id, request_command or '<unknown>', time.time() - sent_time)
-            if 'success' in response:
-                # remove completed request
-                self.log.debug("Removing completed request %s", req_id)
-                del self.requests[req_id]
-            else:
-                # unfinished response; update the sent time so it doesn't time out
-                self.requests[req_id] = (callback, request, time.time())
-            if callback:
-                callback(request, response)
+                    self.log.error("Error handling response %r: %s", response.get('req_id'), e)
         self.service._main_thread_runner(_handle)  # Do handling in main thread
 
+    def _record_latency(self, received, command, queued, sent):
+        """Add the durations of a completed request to its command's histograms"""
+        now = time.time()
+        histograms = self.latency.get(command)
+        if histograms is None:
+            histograms = self.latency[command] = dict((stage, LatencyHistogram()) for stage in LATENCY_STAGES)
+        histograms['queued'].add(sent - queued)
+        histograms['server'].add(received - sent)
+        histograms['dispatch'].add(now - received)
+        histograms['total'].add(now - queued)
+        if self._latency_log_interval is not None and now - self._latency_logged >= self._latency_log_interval:
+            self._latency_logged = now
+            for command, stages in sorted(self.latency_report().items()):
+                self.log.info("Latency of %s (%d requests), p50/p95/p99 ms: %s", command, stages['total']['count'],
+                    ", ".join("%s %0.1f/%0.1f/%0.1f" % (stage, stages[stage]['p50'], stages[stage]['p95'], stages[stage]['p99']) for stage in LATENCY_STAGES))
+
+    def latency_report(self):
+        """
+        Latency of the completed requests, in milliseconds, keyed by command
+        and then by stage: 'queued' (until written to the OOP process),
+        'server' (until its final response was read), 'dispatch' (until the
+        main thread handled it) and 'total'.  Each stage is a dict with
+        'count', 'mean', 'max', 'p50', 'p95' and 'p99'.
+        """
+        report = {}
+        for command, histograms in list(self.latency.items()):
+            stages = report[command] = {}
+            for stage, histogram in histograms.items():
+                stages[stage] = {
+                    'count': histogram.count,
+                    'mean': 1000 * histogram.total / histogram.count if histogram.count else 0.0,
+                    'max': 1000 * histogram.max,
+                    'p50': 1000 * histogram.percentile(0.50),
+                    'p95': 1000 * histogram.percentile(0.95),
+                    'p99': 1000 * histogram.percentile(0.99),
+                }
+        return report
+
     def do_scan_complete(self, response):
         """Scan complete unsolicited response"""
         path = response.get('path')
@@ -1098,6 +1827,12 @@ class CodeIntelBuffer(object):
 
     def scan_document(self, handler, lines_added, file_mtime=False, callback=None):
         def invoke_callback(request, response):
+            if response.get('superseded'):
+                # a newer scan of this buffer is on its way; the handler
+                # hears about that one, but the caller waits on this one
+                if callback is not None:
+                    callback(request, response)
+                return
             if not response.get('success'):
                 msg = response.get('message')
                 if not msg:
@@ -1136,6 +1871,8 @@ class CodeIntelBuffer(object):
 
     def _post_trg_from_pos_handler(self, handler, context, request, response):
         # This needs to be proxied to the main thread for the callback invocation
+        if response.get('superseded'):
+            return  # a newer trigger request for this buffer replaced it
         if not response.get('success'):
             msg = response.get('message')
             if not msg:
@@ -1206,6 +1943,8 @@ class CodeIntelBuffer(object):
     def async_eval_at_trg(self, handler, trg, silent=False, keep_existing=False):
         def callback(request, response):
             try:
+                if response.get('superseded'):
+                    return  # a newer evaluation replaced it
                 if not response.get('success'):
                     try:
                         handler.set_status_message(self, response.get('message', ""), response.get('highlight', False))
@@ -1281,6 +2020,8 @@ class CodeIntelBuffer(object):
 
     def get_calltip_arg_range(self, handler, trg_pos, calltip, curr_pos):
         def callback(request, response):
+            if response.get('superseded'):
+                return  # a newer calltip range request replaced it
             if not response.get('success'):
                 msg = response.get('message')
                 if not msg:
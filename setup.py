@@ -194,10 +194,15 @@ cElementTree_ext = Extension(
     define_macros=xElementTree_define_macros,
 )
 
+# CIX is always UTF-8: build the tokenizer into xmlparse.c, so the parser
+# calls the UTF-8 scanners directly instead of through the encoding vtable
+# (see XML_DIRECT_UTF8_TOK in xmlparse.c)
+ciElementTree_src_files = [f for f in xElementTree_src_files if not f.endswith('xmltok.c')]
+
 ciElementTree_ext = Extension(
-    'codeintel._ciElementTree', ['xElementTree/src/py%s_ciElementTree.c' % sys.version_info[0]] + xElementTree_src_files,
+    'codeintel._ciElementTree', ['xElementTree/src/py%s_ciElementTree.c' % sys.version_info[0]] + ciElementTree_src_files,
     include_dirs=xElementTree_include_dirs,
-    define_macros=xElementTree_define_macros,
+    define_macros=xElementTree_define_macros + [('XML_DIRECT_UTF8_TOK', '1')],
 )
 
 
@@ -8,6 +8,7 @@
 
 from distutils.core import setup, Extension
 from distutils import sysconfig
+import os
 import sys
 
 # --------------------------------------------------------------------
@@ -55,6 +56,11 @@ else:
         defines.append(("BYTEORDER", "4321"))
     defines.append(("XML_CONTEXT_BYTES", "1024"))
 
+# parser instrumentation for XMLParser.stats() is compiled out unless
+# XML_PARSER_STATS is set in the environment
+if os.environ.get("XML_PARSER_STATS"):
+    defines.append(("XML_PARSER_STATS", "1"))
+
 
 # --------------------------------------------------------------------
 # distutils declarations
@@ -69,10 +75,15 @@ ext_modules.append(
     )
 )
 
+# CIX is always UTF-8: build the tokenizer into xmlparse.c, so the parser
+# calls the UTF-8 scanners directly instead of through the encoding vtable
+# (see XML_DIRECT_UTF8_TOK in xmlparse.c)
+ci_sources = [s for s in sources if not s.endswith("xmltok.c")]
+
 ext_modules.append(
     Extension(
-        "_ciElementTree", ["src/py%s_ciElementTree.c" % sys.version_info[0]] + sources,
-        define_macros=defines,
+        "_ciElementTree", ["src/py%s_ciElementTree.c" % sys.version_info[0]] + ci_sources,
+        define_macros=defines + [("XML_DIRECT_UTF8_TOK", "1")],
         include_dirs=includes,
     )
 )
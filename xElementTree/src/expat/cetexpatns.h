@@ -30,10 +30,12 @@
 #define XML_ErrorString                 CET_XML_ErrorString
 #define XML_ExpatVersion                CET_XML_ExpatVersion
 #define XML_ExpatVersionInfo            CET_XML_ExpatVersionInfo
+#define XML_CopyDTD                     CET_XML_CopyDTD
 #define XML_ExternalEntityParserCreate  CET_XML_ExternalEntityParserCreate
 #define XML_FreeContentModel            CET_XML_FreeContentModel
 #define XML_GetBase                     CET_XML_GetBase
 #define XML_GetBuffer                   CET_XML_GetBuffer
+#define XML_GetBufferStats              CET_XML_GetBufferStats
 #define XML_GetCurrentByteCount         CET_XML_GetCurrentByteCount
 #define XML_GetCurrentByteIndex         CET_XML_GetCurrentByteIndex
 #define XML_GetCurrentColumnNumber      CET_XML_GetCurrentColumnNumber
@@ -42,8 +44,11 @@
 #define XML_GetFeatureList              CET_XML_GetFeatureList
 #define XML_GetIdAttributeIndex         CET_XML_GetIdAttributeIndex
 #define XML_GetInputContext             CET_XML_GetInputContext
+#define XML_GetParserStats              CET_XML_GetParserStats
 #define XML_GetParsingStatus            CET_XML_GetParsingStatus
+#define XML_GetPoolGrowCount            CET_XML_GetPoolGrowCount
 #define XML_GetSpecifiedAttributeCount  CET_XML_GetSpecifiedAttributeCount
+#define XML_GetStatsTokenName           CET_XML_GetStatsTokenName
 #define XmlGetUtf16InternalEncoding     CET_XmlGetUtf16InternalEncoding
 #define XmlGetUtf16InternalEncodingNS   CET_XmlGetUtf16InternalEncodingNS
 #define XmlGetUtf8InternalEncoding      CET_XmlGetUtf8InternalEncoding
@@ -61,6 +66,7 @@
 #define XML_ParserCreate_MM             CET_XML_ParserCreate_MM
 #define XML_ParserCreateNS              CET_XML_ParserCreateNS
 #define XML_ParserFree                  CET_XML_ParserFree
+#define XML_ParseDTD                    CET_XML_ParseDTD
 #define XML_ParserReset                 CET_XML_ParserReset
 #define XmlParseXmlDecl                 CET_XmlParseXmlDecl
 #define XmlParseXmlDeclNS               CET_XmlParseXmlDeclNS
@@ -72,6 +78,7 @@
 #define XML_SetCdataSectionHandler      CET_XML_SetCdataSectionHandler
 #define XML_SetCharacterDataHandler     CET_XML_SetCharacterDataHandler
 #define XML_SetCommentHandler           CET_XML_SetCommentHandler
+#define XML_SetContextBytes             CET_XML_SetContextBytes
 #define XML_SetDefaultHandler           CET_XML_SetDefaultHandler
 #define XML_SetDefaultHandlerExpand     CET_XML_SetDefaultHandlerExpand
 #define XML_SetDoctypeDeclHandler       CET_XML_SetDoctypeDeclHandler
@@ -89,6 +96,7 @@
 #define XML_SetNotationDeclHandler      CET_XML_SetNotationDeclHandler
 #define XML_SetNotStandaloneHandler     CET_XML_SetNotStandaloneHandler
 #define XML_SetParamEntityParsing       CET_XML_SetParamEntityParsing
+#define XML_SetPoolSizeHint             CET_XML_SetPoolSizeHint
 #define XML_SetProcessingInstructionHandler CET_XML_SetProcessingInstructionHandler
 #define XML_SetReturnNSTriplet          CET_XML_SetReturnNSTriplet
 #define XML_SetSkippedEntityHandler     CET_XML_SetSkippedEntityHandler
@@ -97,6 +105,7 @@
 #define XML_SetStartElementHandler      CET_XML_SetStartElementHandler
 #define XML_SetStartNamespaceDeclHandler    CET_XML_SetStartNamespaceDeclHandler
 #define XML_SetUnknownEncodingHandler   CET_XML_SetUnknownEncodingHandler
+#define XML_SetUndefinedEntityHandler   CET_XML_SetUndefinedEntityHandler
 #define XML_SetUnparsedEntityDeclHandler    CET_XML_SetUnparsedEntityDeclHandler
 #define XML_SetUserData                 CET_XML_SetUserData
 #define XML_SetXmlDeclHandler           CET_XML_SetXmlDeclHandler
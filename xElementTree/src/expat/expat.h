@@ -451,6 +451,16 @@ typedef void (XMLCALL *XML_SkippedEntityHandler) (
                                     const XML_Char *entityName,
                                     int is_parameter_entity);
 
+/* This is called for a reference to a general entity in content for
+   which no declaration has been read (case 1 above), when no skipped
+   entity handler is set.  It lets an application resolve such
+   references itself without installing a default handler, which would
+   also be called for every other unhandled piece of the document.
+*/
+typedef void (XMLCALL *XML_UndefinedEntityHandler) (
+                                    void *userData,
+                                    const XML_Char *entityName);
+
 /* This structure is filled in by the XML_UnknownEncodingHandler to
    provide information to the parser about encodings that are unknown
    to the parser.
@@ -637,6 +647,10 @@ XMLPARSEAPI(void)
 XML_SetSkippedEntityHandler(XML_Parser parser,
                             XML_SkippedEntityHandler handler);
 
+XMLPARSEAPI(void)
+XML_SetUndefinedEntityHandler(XML_Parser parser,
+                              XML_UndefinedEntityHandler handler);
+
 XMLPARSEAPI(void)
 XML_SetUnknownEncodingHandler(XML_Parser parser,
                               XML_UnknownEncodingHandler handler,
@@ -917,6 +931,41 @@ XML_SetHashSalt(XML_Parser parser,
 
 #define XML_HAS_SET_HASH_SALT  /* Python Only: Defined for pyexpat.c. */
 
+/* Parses s as an external DTD subset into the parser's DTD, so that it
+   can be handed to other parsers with XML_CopyDTD.  The parser itself
+   is only used as a holder for the declarations and should not be used
+   to parse documents.  On errors, the error code and position are
+   available from the parser as usual.  Requires XML_DTD.
+*/
+XMLPARSEAPI(enum XML_Status)
+XML_ParseDTD(XML_Parser parser, const char *s, int len);
+
+/* Copies the declarations read by XML_ParseDTD on dtdParser into
+   parser, as if the document had an external subset with them; no DTD
+   text is tokenized again.  They are copied where the external subset
+   would be read, after the internal subset, so the document's own
+   declarations take precedence; dtdParser must not be freed before
+   then.  This must be called before parsing is started.  Returns 1 if
+   successful, 0 when called after parsing has started.
+*/
+XMLPARSEAPI(int)
+XML_CopyDTD(XML_Parser parser, XML_Parser dtdParser);
+
+/* Sets the size of the first block allocated by the parser's string
+   pool for attribute values, e.g. from the expected size of the
+   document; the pools for names and DTD text don't grow with the
+   document and keep their default size.  Pool blocks are kept by
+   XML_ParserReset, so a reset parser starts at its high-water size.
+*/
+XMLPARSEAPI(void)
+XML_SetPoolSizeHint(XML_Parser parser, int size);
+
+/* Returns the number of times the parser's string pools allocated or
+   reallocated a block.  Not reset by XML_ParserReset.
+*/
+XMLPARSEAPI(unsigned long)
+XML_GetPoolGrowCount(XML_Parser parser);
+
 /* If XML_Parse or XML_ParseBuffer have returned XML_STATUS_ERROR, then
    XML_GetErrorCode returns information about the error.
 */
@@ -949,6 +998,51 @@ XMLPARSEAPI(XML_Index) XML_GetCurrentByteIndex(XML_Parser parser);
 XMLPARSEAPI(int)
 XML_GetCurrentByteCount(XML_Parser parser);
 
+/* Sets how many bytes of already parsed input are kept in front of the
+   unparsed data for XML_GetInputContext; the default is
+   XML_CONTEXT_BYTES.  With 0, which suits bulk parsing, XML_Parse parses
+   the caller's data in place whenever it can, and input is never moved
+   around to keep context; XML_GetInputContext then returns NULL.
+*/
+XMLPARSEAPI(void)
+XML_SetContextBytes(XML_Parser parser, int bytes);
+
+/* Returns the number of input bytes copied or moved between parse
+   buffers, and the number of parse buffers allocated.
+*/
+XMLPARSEAPI(void)
+XML_GetBufferStats(XML_Parser parser, unsigned long *bytesMoved,
+                   unsigned long *allocations);
+
+/* Counters kept by the parser when xmlparse.c is compiled with
+   XML_PARSER_STATS; see XML_GetParserStats.
+*/
+#define XML_STATS_TOKEN_TYPES 48
+
+typedef struct {
+  /* tokens scanned in the prolog and content, by token type; see
+     XML_GetStatsTokenName */
+  unsigned long tokens[XML_STATS_TOKEN_TYPES];
+  unsigned long lookups;            /* hash table lookups */
+  unsigned long lookupProbes;       /* occupied slots stepped over */
+  unsigned long poolGrows;          /* string pool grow calls */
+  unsigned long poolGrowBytes;      /* bytes allocated by them */
+  unsigned long movedBytes;         /* as for XML_GetBufferStats */
+  unsigned long bufferAllocations;
+} XML_ParserStats;
+
+/* Fills in *stats and returns 1 if xmlparse.c was compiled with
+   XML_PARSER_STATS; returns 0 otherwise.
+*/
+XMLPARSEAPI(int)
+XML_GetParserStats(XML_Parser parser, XML_ParserStats *stats);
+
+/* Returns the name of the token type counted in tokens[index] of
+   XML_ParserStats, or NULL if index is out of range.
+*/
+XMLPARSEAPI(const char *)
+XML_GetStatsTokenName(int index);
+
 /* If XML_CONTEXT_BYTES is defined, returns the input buffer, sets
    the integer pointed to by offset to the offset within this buffer
    of the current parse position, and sets the integer pointed to by size
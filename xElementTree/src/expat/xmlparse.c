@@ -88,6 +88,45 @@ typedef char ICHAR;
 #include "xmltok.h"
 #include "xmlrole.h"
 
+#ifdef XML_DIRECT_UTF8_TOK
+/* The tokenizer is compiled into this translation unit (setup.py leaves
+   xmltok.c out of such builds), so that the hot tokenizer calls below can
+   go straight to the normal_ scanners, which serve UTF-8 and the other
+   single byte encodings, and the compiler can inline them.  Any other
+   encoding still goes through the ENCODING vtable. */
+#include "xmltok.c"
+#undef PREFIX
+
+#define DIRECT_TOK(enc, slot, fn) ((enc)->slot == fn)
+
+#undef XmlPrologTok
+#define XmlPrologTok(enc, ptr, end, nextTokPtr) \
+  (DIRECT_TOK(enc, scanners[XML_PROLOG_STATE], normal_prologTok) \
+   ? normal_prologTok(enc, ptr, end, nextTokPtr) \
+   : XmlTok(enc, XML_PROLOG_STATE, ptr, end, nextTokPtr))
+#undef XmlContentTok
+#define XmlContentTok(enc, ptr, end, nextTokPtr) \
+  (DIRECT_TOK(enc, scanners[XML_CONTENT_STATE], normal_contentTok) \
+   ? normal_contentTok(enc, ptr, end, nextTokPtr) \
+   : XmlTok(enc, XML_CONTENT_STATE, ptr, end, nextTokPtr))
+#undef XmlAttributeValueTok
+#define XmlAttributeValueTok(enc, ptr, end, nextTokPtr) \
+  (DIRECT_TOK(enc, literalScanners[XML_ATTRIBUTE_VALUE_LITERAL], \
+              normal_attributeValueTok) \
+   ? normal_attributeValueTok(enc, ptr, end, nextTokPtr) \
+   : XmlLiteralTok(enc, XML_ATTRIBUTE_VALUE_LITERAL, ptr, end, nextTokPtr))
+#undef XmlNameLength
+#define XmlNameLength(enc, ptr) \
+  (DIRECT_TOK(enc, nameLength, normal_nameLength) \
+   ? normal_nameLength(enc, ptr) \
+   : (((enc)->nameLength)(enc, ptr)))
+#undef XmlGetAttributes
+#define XmlGetAttributes(enc, ptr, attsMax, atts) \
+  (DIRECT_TOK(enc, getAtts, normal_getAtts) \
+   ? normal_getAtts(enc, ptr, attsMax, atts) \
+   : (((enc)->getAtts)(enc, ptr, attsMax, atts)))
+#endif /* XML_DIRECT_UTF8_TOK */
+
 typedef const XML_Char *KEY;
 
 typedef struct {
@@ -138,6 +177,9 @@ typedef struct {
 #define INIT_ATTS_VERSION 0xFFFFFFFF
 #define INIT_BLOCK_SIZE 1024
 #define INIT_BUFFER_SIZE 1024
+/* parse buffers grow in powers of two up to this size, and in multiples
+   of it beyond */
+#define BUFFER_GROWTH_CEILING (16 * 1024 * 1024)
 
 #define EXPAND_SPARE 24
 
@@ -227,6 +269,12 @@ typedef struct {
   XML_Char *ptr;
   XML_Char *start;
   const XML_Memory_Handling_Suite *mem;
+  int blockSize;                /* size of the first new block */
+  unsigned long grows;          /* number of blocks (re)allocated */
+#ifdef XML_PARSER_STATS
+  unsigned long growCalls;
+  unsigned long growBytes;
+#endif
 } STRING_POOL;
 
 /* The XML_Char before the name is used to determine whether
@@ -259,6 +307,20 @@ typedef struct {
   DEFAULT_ATTRIBUTE *defaultAtts;
 } ELEMENT_TYPE;
 
+/* Small direct-mapped cache in front of the attributeIds and elementTypes
+   hash tables, so that storeAtts doesn't need a lookup (and for attribute
+   names, a pool copy) for names it has seen recently.  Slots are picked
+   from the name's length and first and last characters. */
+#define NAME_CACHE_SIZE 64  /* must be a power of 2 */
+#define NAME_CACHE_SLOT(len, first, last) \
+  ((((len) << 3) ^ ((unsigned char)(first) << 1) ^ (unsigned char)(last)) \
+   & (NAME_CACHE_SIZE - 1))
+
+typedef struct {
+  NAMED *named;                 /* ATTRIBUTE_ID or ELEMENT_TYPE */
+  int len;                      /* length of named->name */
+} NAME_CACHE;
+
 typedef struct {
   HASH_TABLE generalEntities;
   HASH_TABLE elementTypes;
@@ -366,6 +428,11 @@ appendAttributeValue(XML_Parser parser, const ENCODING *, XML_Bool isCdata,
 static ATTRIBUTE_ID *
 getAttributeId(XML_Parser parser, const ENCODING *enc, const char *start,
                const char *end);
+static ATTRIBUTE_ID *
+getCachedAttributeId(XML_Parser parser, const ENCODING *enc,
+                     const char *start, const char *end);
+static ELEMENT_TYPE *
+getCachedElementType(XML_Parser parser, const XML_Char *name);
 static int
 setElementTypePrefix(XML_Parser parser, ELEMENT_TYPE *);
 static enum XML_Error
@@ -398,6 +465,8 @@ dtdCopy(XML_Parser oldParser,
 static int
 copyEntityTable(XML_Parser oldParser,
                 HASH_TABLE *, STRING_POOL *, const HASH_TABLE *);
+static int
+dtdMerge(XML_Parser parser, DTD *newDtd, const DTD *oldDtd);
 static NAMED *
 lookup(XML_Parser parser, HASH_TABLE *table, KEY name, size_t createSize);
 static void FASTCALL
@@ -419,6 +488,7 @@ static XML_Char *
 poolStoreString(STRING_POOL *pool, const ENCODING *enc,
                 const char *ptr, const char *end);
 static XML_Bool FASTCALL poolGrow(STRING_POOL *pool);
+static XML_Bool FASTCALL poolGrowBy(STRING_POOL *pool, int extra);
 static const XML_Char * FASTCALL
 poolCopyString(STRING_POOL *pool, const XML_Char *s);
 static const XML_Char *
@@ -491,6 +561,7 @@ struct XML_ParserStruct {
   XML_ExternalEntityRefHandler m_externalEntityRefHandler;
   XML_Parser m_externalEntityRefHandlerArg;
   XML_SkippedEntityHandler m_skippedEntityHandler;
+  XML_UndefinedEntityHandler m_undefinedEntityHandler;
   XML_UnknownEncodingHandler m_unknownEncodingHandler;
   XML_ElementDeclHandler m_elementDeclHandler;
   XML_AttlistDeclHandler m_attlistDeclHandler;
@@ -540,6 +611,8 @@ struct XML_ParserStruct {
   NS_ATT *m_nsAtts;
   unsigned long m_nsAttsVersion;
   unsigned char m_nsAttsPower;
+  NAME_CACHE m_attIdCache[NAME_CACHE_SIZE];
+  NAME_CACHE m_elementTypeCache[NAME_CACHE_SIZE];
 #ifdef XML_ATTR_INFO
   XML_AttrInfo *m_attInfo;
 #endif
@@ -557,6 +630,13 @@ struct XML_ParserStruct {
   enum XML_ParamEntityParsing m_paramEntityParsing;
 #endif
   unsigned long m_hash_secret_salt;
+  XML_Parser m_copiedDTD; /* from XML_CopyDTD, until it is merged in */
+  int m_contextBytes;
+  unsigned long m_bufferBytesMoved;
+  unsigned long m_bufferAllocs;
+#ifdef XML_PARSER_STATS
+  XML_ParserStats m_parserStats;
+#endif
 };
 
 #define MALLOC(s) (parser->m_mem.malloc_fcn((s)))
@@ -591,6 +671,7 @@ struct XML_ParserStruct {
 #define internalEntityRefHandler \
         (parser->m_internalEntityRefHandler)
 #define skippedEntityHandler (parser->m_skippedEntityHandler)
+#define undefinedEntityHandler (parser->m_undefinedEntityHandler)
 #define unknownEncodingHandler (parser->m_unknownEncodingHandler)
 #define elementDeclHandler (parser->m_elementDeclHandler)
 #define attlistDeclHandler (parser->m_attlistDeclHandler)
@@ -651,6 +732,8 @@ struct XML_ParserStruct {
 #define nsAtts (parser->m_nsAtts)
 #define nsAttsVersion (parser->m_nsAttsVersion)
 #define nsAttsPower (parser->m_nsAttsPower)
+#define attIdCache (parser->m_attIdCache)
+#define elementTypeCache (parser->m_elementTypeCache)
 #define attInfo (parser->m_attInfo)
 #define tempPool (parser->m_tempPool)
 #define temp2Pool (parser->m_temp2Pool)
@@ -666,6 +749,23 @@ struct XML_ParserStruct {
 #define paramEntityParsing (parser->m_paramEntityParsing)
 #endif /* XML_DTD */
 #define hash_secret_salt (parser->m_hash_secret_salt)
+#define copiedDTD (parser->m_copiedDTD)
+#define contextBytes (parser->m_contextBytes)
+#define bufferBytesMoved (parser->m_bufferBytesMoved)
+#define bufferAllocs (parser->m_bufferAllocs)
+#define parserStats (parser->m_parserStats)
+
+#ifdef XML_PARSER_STATS
+#define STATS_ADD(counter, n) (parserStats.counter += (n))
+#define STATS_TOKEN(tok) \
+  do { \
+    if ((unsigned)((tok) - XML_TOK_TRAILING_RSQB) < XML_STATS_TOKEN_TYPES) \
+      parserStats.tokens[(tok) - XML_TOK_TRAILING_RSQB]++; \
+  } while (0)
+#else
+#define STATS_ADD(counter, n) ((void)0)
+#define STATS_TOKEN(tok) do { } while (0)
+#endif
 
 XML_Parser XMLCALL
 XML_ParserCreate(const XML_Char *encodingName)
@@ -866,6 +966,7 @@ parserInit(XML_Parser parser, const XML_Char *encodingName)
   externalEntityRefHandler = NULL;
   externalEntityRefHandlerArg = parser;
   skippedEntityHandler = NULL;
+  undefinedEntityHandler = NULL;
   elementDeclHandler = NULL;
   attlistDeclHandler = NULL;
   entityDeclHandler = NULL;
@@ -886,6 +987,9 @@ parserInit(XML_Parser parser, const XML_Char *encodingName)
   declAttributeIsCdata = XML_FALSE;
   declAttributeIsId = XML_FALSE;
   memset(&position, 0, sizeof(POSITION));
+  /* the cached names belong to the DTD, which is reset along with us */
+  memset(attIdCache, 0, sizeof(attIdCache));
+  memset(elementTypeCache, 0, sizeof(elementTypeCache));
   errorCode = XML_ERROR_NONE;
   eventPtr = NULL;
   eventEndPtr = NULL;
@@ -907,6 +1011,17 @@ parserInit(XML_Parser parser, const XML_Char *encodingName)
   paramEntityParsing = XML_PARAM_ENTITY_PARSING_NEVER;
 #endif
   hash_secret_salt = 0;
+  copiedDTD = NULL;
+#ifdef XML_CONTEXT_BYTES
+  contextBytes = XML_CONTEXT_BYTES;
+#else
+  contextBytes = 0;
+#endif
+  bufferBytesMoved = 0;
+  bufferAllocs = 0;
+#ifdef XML_PARSER_STATS
+  memset(&parserStats, 0, sizeof(parserStats));
+#endif
 }
 
 /* moves list of bindings to freeBindingList */
@@ -1006,6 +1121,8 @@ XML_ExternalEntityParserCreate(XML_Parser oldParser,
   XML_ExternalEntityRefHandler oldExternalEntityRefHandler
       = externalEntityRefHandler;
   XML_SkippedEntityHandler oldSkippedEntityHandler = skippedEntityHandler;
+  XML_UndefinedEntityHandler oldUndefinedEntityHandler
+      = undefinedEntityHandler;
   XML_UnknownEncodingHandler oldUnknownEncodingHandler
       = unknownEncodingHandler;
   XML_ElementDeclHandler oldElementDeclHandler = elementDeclHandler;
@@ -1067,6 +1184,7 @@ XML_ExternalEntityParserCreate(XML_Parser oldParser,
   notStandaloneHandler = oldNotStandaloneHandler;
   externalEntityRefHandler = oldExternalEntityRefHandler;
   skippedEntityHandler = oldSkippedEntityHandler;
+  undefinedEntityHandler = oldUndefinedEntityHandler;
   unknownEncodingHandler = oldUnknownEncodingHandler;
   elementDeclHandler = oldElementDeclHandler;
   attlistDeclHandler = oldAttlistDeclHandler;
@@ -1434,6 +1552,13 @@ XML_SetSkippedEntityHandler(XML_Parser parser,
   skippedEntityHandler = handler;
 }
 
+void XMLCALL
+XML_SetUndefinedEntityHandler(XML_Parser parser,
+                              XML_UndefinedEntityHandler handler)
+{
+  undefinedEntityHandler = handler;
+}
+
 void XMLCALL
 XML_SetUnknownEncodingHandler(XML_Parser parser,
                               XML_UnknownEncodingHandler handler,
@@ -1496,6 +1621,148 @@ XML_SetHashSalt(XML_Parser parser,
   return 1;
 }
 
+enum XML_Status XMLCALL
+XML_ParseDTD(XML_Parser parser, const char *s, int len)
+{
+#ifdef XML_DTD
+  XML_Parser dtdParser;
+  enum XML_Status status;
+
+  /* the subset parser shares our DTD, and our salt for its tables */
+  if (hash_secret_salt == 0)
+    hash_secret_salt = generate_hash_secret_salt();
+  dtdParser = XML_ExternalEntityParserCreate(parser, NULL, NULL);
+  if (!dtdParser) {
+    errorCode = XML_ERROR_NO_MEMORY;
+    return XML_STATUS_ERROR;
+  }
+  status = XML_Parse(dtdParser, s, len, XML_TRUE);
+  if (status == XML_STATUS_ERROR) {
+    errorCode = XML_GetErrorCode(dtdParser);
+    position.lineNumber = XML_GetCurrentLineNumber(dtdParser) - 1;
+    position.columnNumber = XML_GetCurrentColumnNumber(dtdParser);
+    eventPtr = eventEndPtr = NULL;
+  }
+  XML_ParserFree(dtdParser);
+  /* as after reading a document's external subset */
+  _dtd->hasParamEntityRefs = XML_TRUE;
+  return status;
+#else
+  errorCode = XML_ERROR_FEATURE_REQUIRES_XML_DTD;
+  return XML_STATUS_ERROR;
+#endif /* XML_DTD */
+}
+
+int XMLCALL
+XML_CopyDTD(XML_Parser parser, XML_Parser dtdParser)
+{
+  /* block after XML_Parse()/XML_ParseBuffer() has been called */
+  if (ps_parsing == XML_PARSING || ps_parsing == XML_SUSPENDED)
+    return 0;
+  /* the declarations are merged in where an external subset would be
+     read (see doProlog), after the internal subset, which takes
+     precedence as the first declaration of a name */
+  copiedDTD = dtdParser;
+  /* as for a document with an external subset */
+  _dtd->hasParamEntityRefs = XML_TRUE;
+  return 1;
+}
+
+void XMLCALL
+XML_SetPoolSizeHint(XML_Parser parser, int size)
+{
+  /* only tempPool, which holds the attribute values (character data is
+     passed straight from the buffer), grows with the document; the other
+     pools hold names, the XML declaration and DTD text, and keep the
+     default size */
+  if (size < INIT_BLOCK_SIZE)
+    size = INIT_BLOCK_SIZE;
+  tempPool.blockSize = size;
+}
+
+unsigned long XMLCALL
+XML_GetPoolGrowCount(XML_Parser parser)
+{
+  return tempPool.grows + temp2Pool.grows
+         + _dtd->pool.grows + _dtd->entityValuePool.grows;
+}
+
+void XMLCALL
+XML_SetContextBytes(XML_Parser parser, int bytes)
+{
+  contextBytes = bytes > 0 ? bytes : 0;
+}
+
+void XMLCALL
+XML_GetBufferStats(XML_Parser parser, unsigned long *bytesMoved,
+                   unsigned long *allocations)
+{
+  *bytesMoved = bufferBytesMoved;
+  *allocations = bufferAllocs;
+}
+
+/* names of the XML_TOK_* token types, from XML_TOK_TRAILING_RSQB up */
+static const char * const statsTokenNames[XML_STATS_TOKEN_TYPES] = {
+  "TRAILING_RSQB", "NONE", "TRAILING_CR", "PARTIAL_CHAR", "PARTIAL",
+  "INVALID", "START_TAG_WITH_ATTS", "START_TAG_NO_ATTS",
+  "EMPTY_ELEMENT_WITH_ATTS", "EMPTY_ELEMENT_NO_ATTS", "END_TAG",
+  "DATA_CHARS", "DATA_NEWLINE", "CDATA_SECT_OPEN", "ENTITY_REF",
+  "CHAR_REF", "PI", "XML_DECL", "COMMENT", "BOM", "PROLOG_S",
+  "DECL_OPEN", "DECL_CLOSE", "NAME", "NMTOKEN", "POUND_NAME", "OR",
+  "PERCENT", "OPEN_PAREN", "CLOSE_PAREN", "OPEN_BRACKET",
+  "CLOSE_BRACKET", "LITERAL", "PARAM_ENTITY_REF", "INSTANCE_START",
+  "NAME_QUESTION", "NAME_ASTERISK", "NAME_PLUS", "COND_SECT_OPEN",
+  "COND_SECT_CLOSE", "CLOSE_PAREN_QUESTION", "CLOSE_PAREN_ASTERISK",
+  "CLOSE_PAREN_PLUS", "COMMA", "ATTRIBUTE_VALUE_S", "CDATA_SECT_CLOSE",
+  "PREFIXED_NAME", "IGNORE_SECT"
+};
+
+int XMLCALL
+XML_GetParserStats(XML_Parser parser, XML_ParserStats *stats)
+{
+#ifdef XML_PARSER_STATS
+  const STRING_POOL *pools[4];
+  int i;
+  pools[0] = &tempPool;
+  pools[1] = &temp2Pool;
+  pools[2] = &_dtd->pool;
+  pools[3] = &_dtd->entityValuePool;
+  *stats = parserStats;
+  stats->poolGrows = 0;
+  stats->poolGrowBytes = 0;
+  for (i = 0; i < 4; i++) {
+    stats->poolGrows += pools[i]->growCalls;
+    stats->poolGrowBytes += pools[i]->growBytes;
+  }
+  stats->movedBytes = bufferBytesMoved;
+  stats->bufferAllocations = bufferAllocs;
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+const char * XMLCALL
+XML_GetStatsTokenName(int index)
+{
+  if (index < 0 || index >= XML_STATS_TOKEN_TYPES)
+    return NULL;
+  return statsTokenNames[index];
+}
+
+/* Size for a parse buffer that must hold neededSize bytes. */
+static int
+bufferGrowSize(int neededSize)
+{
+  int bufferSize = INIT_BUFFER_SIZE;
+  if (neededSize > BUFFER_GROWTH_CEILING)
+    return ((neededSize - 1) / BUFFER_GROWTH_CEILING + 1)
+           * BUFFER_GROWTH_CEILING;
+  while (bufferSize < neededSize)
+    bufferSize *= 2;
+  return bufferSize;
+}
+
 enum XML_Status XMLCALL
 XML_Parse(XML_Parser parser, const char *s, int len, int isFinal)
 {
@@ -1546,11 +1813,12 @@ XML_Parse(XML_Parser parser, const char *s, int len, int isFinal)
     processor = errorProcessor;
     return XML_STATUS_ERROR;
   }
-#ifndef XML_CONTEXT_BYTES
-  else if (bufferPtr == bufferEnd) {
+  else if (bufferPtr == bufferEnd && contextBytes == 0) {
+    /* nothing buffered and no context to keep: parse the caller's data
+       in place */
     const char *end;
     int nLeftOver;
-    enum XML_Error result;
+    enum XML_Status result;
     parseEndByteIndex += len;
     positionPtr = s;
     ps_finalBuffer = (XML_Bool)isFinal;
@@ -1584,20 +1852,24 @@ XML_Parse(XML_Parser parser, const char *s, int len, int isFinal)
     if (nLeftOver) {
       if (buffer == NULL || nLeftOver > bufferLim - buffer) {
         /* FIXME avoid integer overflow */
+        /* leave room for the next chunk as well */
+        int bufferSize = bufferGrowSize(nLeftOver + len);
         char *temp;
         temp = (buffer == NULL
-                ? (char *)MALLOC(len * 2)
-                : (char *)REALLOC(buffer, len * 2));
+                ? (char *)MALLOC(bufferSize)
+                : (char *)REALLOC(buffer, bufferSize));
         if (temp == NULL) {
           errorCode = XML_ERROR_NO_MEMORY;
           eventPtr = eventEndPtr = NULL;
           processor = errorProcessor;
           return XML_STATUS_ERROR;
         }
+        bufferAllocs++;
         buffer = temp;
-        bufferLim = buffer + len * 2;
+        bufferLim = buffer + bufferSize;
       }
       memcpy(buffer, end, nLeftOver);
+      bufferBytesMoved += nLeftOver;
     }
     bufferPtr = buffer;
     bufferEnd = buffer + nLeftOver;
@@ -1607,7 +1879,6 @@ XML_Parse(XML_Parser parser, const char *s, int len, int isFinal)
     eventEndPtr = bufferPtr;
     return result;
   }
-#endif  /* not defined XML_CONTEXT_BYTES */
   else {
     void *buff = XML_GetBuffer(parser, len);
     if (buff == NULL)
@@ -1691,47 +1962,34 @@ XML_GetBuffer(XML_Parser parser, int len)
   if (len > bufferLim - bufferEnd) {
     /* FIXME avoid integer overflow */
     int neededSize = len + (int)(bufferEnd - bufferPtr);
-#ifdef XML_CONTEXT_BYTES
+    /* already parsed input to keep for XML_GetInputContext */
     int keep = (int)(bufferPtr - buffer);
 
-    if (keep > XML_CONTEXT_BYTES)
-      keep = XML_CONTEXT_BYTES;
+    if (keep > contextBytes)
+      keep = contextBytes;
     neededSize += keep;
-#endif  /* defined XML_CONTEXT_BYTES */
     if (neededSize  <= bufferLim - buffer) {
-#ifdef XML_CONTEXT_BYTES
       if (keep < bufferPtr - buffer) {
         int offset = (int)(bufferPtr - buffer) - keep;
         memmove(buffer, &buffer[offset], bufferEnd - bufferPtr + keep);
+        bufferBytesMoved += bufferEnd - bufferPtr + keep;
         bufferEnd -= offset;
         bufferPtr -= offset;
       }
-#else
-      memmove(buffer, bufferPtr, bufferEnd - bufferPtr);
-      bufferEnd = buffer + (bufferEnd - bufferPtr);
-      bufferPtr = buffer;
-#endif  /* not defined XML_CONTEXT_BYTES */
     }
     else {
       char *newBuf;
-      int bufferSize = (int)(bufferLim - bufferPtr);
-      if (bufferSize == 0)
-        bufferSize = INIT_BUFFER_SIZE;
-      do {
-        bufferSize *= 2;
-      } while (bufferSize < neededSize);
+      int bufferSize = bufferGrowSize(neededSize);
       newBuf = (char *)MALLOC(bufferSize);
       if (newBuf == 0) {
         errorCode = XML_ERROR_NO_MEMORY;
         return NULL;
       }
+      bufferAllocs++;
       bufferLim = newBuf + bufferSize;
-#ifdef XML_CONTEXT_BYTES
       if (bufferPtr) {
-        int keep = (int)(bufferPtr - buffer);
-        if (keep > XML_CONTEXT_BYTES)
-          keep = XML_CONTEXT_BYTES;
         memcpy(newBuf, &bufferPtr[-keep], bufferEnd - bufferPtr + keep);
+        bufferBytesMoved += bufferEnd - bufferPtr + keep;
         FREE(buffer);
         buffer = newBuf;
         bufferEnd = buffer + (bufferEnd - bufferPtr) + keep;
@@ -1741,14 +1999,6 @@ XML_GetBuffer(XML_Parser parser, int len)
         bufferEnd = newBuf + (bufferEnd - bufferPtr);
         bufferPtr = buffer = newBuf;
       }
-#else
-      if (bufferPtr) {
-        memcpy(newBuf, bufferPtr, bufferEnd - bufferPtr);
-        FREE(buffer);
-      }
-      bufferEnd = newBuf + (bufferEnd - bufferPtr);
-      bufferPtr = buffer = newBuf;
-#endif  /* not defined XML_CONTEXT_BYTES */
     }
     eventPtr = eventEndPtr = NULL;
     positionPtr = NULL;
@@ -1857,7 +2107,8 @@ const char * XMLCALL
 XML_GetInputContext(XML_Parser parser, int *offset, int *size)
 {
 #ifdef XML_CONTEXT_BYTES
-  if (eventPtr && buffer) {
+  /* with no context kept, the event may not even be in our buffer */
+  if (eventPtr && buffer && contextBytes) {
     *offset = (int)(eventPtr - buffer);
     *size   = (int)(bufferEnd - buffer);
     return buffer;
@@ -2255,6 +2506,7 @@ doContent(XML_Parser parser,
     const char *next = s; /* XmlContentTok doesn't always set the last arg */
     int tok = XmlContentTok(enc, s, end, &next);
     *eventEndPP = next;
+    STATS_TOKEN(tok);
     switch (tok) {
     case XML_TOK_TRAILING_CR:
       if (haveMore) {
@@ -2338,6 +2590,8 @@ doContent(XML_Parser parser,
         else if (!entity) {
           if (skippedEntityHandler)
             skippedEntityHandler(handlerArg, name, 0);
+          else if (undefinedEntityHandler)
+            undefinedEntityHandler(handlerArg, name);
           else if (defaultHandler)
             reportDefault(parser, enc, s, next);
           break;
@@ -2713,7 +2967,7 @@ storeAtts(XML_Parser parser, const ENCODING *enc,
   const XML_Char *localPart;
 
   /* lookup the element type name */
-  elementType = (ELEMENT_TYPE *)lookup(parser, &dtd->elementTypes, tagNamePtr->str,0);
+  elementType = getCachedElementType(parser, tagNamePtr->str);
   if (!elementType) {
     const XML_Char *name = poolCopyString(&dtd->pool, tagNamePtr->str);
     if (!name)
@@ -2757,9 +3011,9 @@ storeAtts(XML_Parser parser, const ENCODING *enc,
     XML_AttrInfo *currAttInfo = &attInfo[i];
 #endif
     /* add the name and value to the attribute list */
-    ATTRIBUTE_ID *attId = getAttributeId(parser, enc, currAtt->name,
-                                         currAtt->name
-                                         + XmlNameLength(enc, currAtt->name));
+    ATTRIBUTE_ID *attId = getCachedAttributeId(parser, enc, currAtt->name,
+                                               currAtt->name
+                                               + XmlNameLength(enc, currAtt->name));
     if (!attId)
       return XML_ERROR_NO_MEMORY;
 #ifdef XML_ATTR_INFO
@@ -3794,6 +4048,7 @@ doProlog(XML_Parser parser,
     XML_Bool handleDefault = XML_TRUE;
     *eventPP = s;
     *eventEndPP = next;
+    STATS_TOKEN(tok);
     if (tok <= 0) {
       if (haveMore && tok != XML_TOK_INVALID) {
         *nextPtr = s;
@@ -3970,6 +4225,11 @@ doProlog(XML_Parser parser,
         useForeignDTD = XML_FALSE;
       }
 #endif /* XML_DTD */
+      if (copiedDTD) {
+        if (!dtdMerge(parser, dtd, copiedDTD->m_dtd))
+          return XML_ERROR_NO_MEMORY;
+        copiedDTD = NULL;
+      }
       if (endDoctypeDeclHandler) {
         endDoctypeDeclHandler(handlerArg);
         handleDefault = XML_FALSE;
@@ -4012,6 +4272,12 @@ doProlog(XML_Parser parser,
         }
       }
 #endif /* XML_DTD */
+      /* without a DOCTYPE declaration, the copied DTD goes in now */
+      if (copiedDTD) {
+        if (!dtdMerge(parser, dtd, copiedDTD->m_dtd))
+          return XML_ERROR_NO_MEMORY;
+        copiedDTD = NULL;
+      }
       processor = contentProcessor;
       return contentProcessor(parser, s, end, nextPtr);
     case XML_ROLE_ATTLIST_ELEMENT_NAME:
@@ -5396,6 +5662,55 @@ defineAttribute(ELEMENT_TYPE *type, ATTRIBUTE_ID *attId, XML_Bool isCdata,
   return 1;
 }
 
+/* getAttributeId() through the attribute name cache.  The cache is keyed
+   on the raw name, so it is only used when no conversion is needed. */
+static ATTRIBUTE_ID *
+getCachedAttributeId(XML_Parser parser, const ENCODING *enc,
+                     const char *start, const char *end)
+{
+#ifndef XML_UNICODE
+  if (!MUST_CONVERT(enc, start)) {
+    int len = (int)(end - start);
+    NAME_CACHE *slot = &attIdCache[NAME_CACHE_SLOT(len, start[0], end[-1])];
+    ATTRIBUTE_ID *id = (ATTRIBUTE_ID *)slot->named;
+    if (id && slot->len == len && memcmp(id->name, start, len) == 0)
+      return id;
+    id = getAttributeId(parser, enc, start, end);
+    if (id) {
+      slot->named = (NAMED *)id;
+      slot->len = len;
+    }
+    return id;
+  }
+#endif
+  return getAttributeId(parser, enc, start, end);
+}
+
+/* Look up (but don't create) an element type, through the element type
+   name cache. */
+static ELEMENT_TYPE *
+getCachedElementType(XML_Parser parser, const XML_Char *name)
+{
+  NAME_CACHE *slot;
+  ELEMENT_TYPE *elementType;
+  int len = 0;
+  while (name[len])
+    len++;
+  if (!len)
+    return NULL;
+  slot = &elementTypeCache[NAME_CACHE_SLOT(len, name[0], name[len - 1])];
+  elementType = (ELEMENT_TYPE *)slot->named;
+  if (elementType && slot->len == len
+      && memcmp(elementType->name, name, len * sizeof(XML_Char)) == 0)
+    return elementType;
+  elementType = (ELEMENT_TYPE *)lookup(parser, &_dtd->elementTypes, name, 0);
+  if (elementType) {
+    slot->named = (NAMED *)elementType;
+    slot->len = len;
+  }
+  return elementType;
+}
+
 static int
 setElementTypePrefix(XML_Parser parser, ELEMENT_TYPE *elementType)
 {
@@ -5879,6 +6194,124 @@ dtdCopy(XML_Parser oldParser, DTD *newDtd, const DTD *oldDtd, const XML_Memory_H
   return 1;
 }  /* End dtdCopy */
 
+/* Adds the declarations of oldDtd (from XML_ParseDTD) that newDtd doesn't
+   have yet, the way reading them as an external subset would: names
+   newDtd already declared keep their declaration.  Unlike dtdCopy, all
+   lookups use parser's hash salt, since newDtd's tables are in use.
+*/
+static int
+dtdMerge(XML_Parser parser, DTD *newDtd, const DTD *oldDtd)
+{
+  HASH_TABLE_ITER iter;
+
+  hashTableIterInit(&iter, &(oldDtd->prefixes));
+  for (;;) {
+    const XML_Char *name;
+    const PREFIX *oldP = (PREFIX *)hashTableIterNext(&iter);
+    if (!oldP)
+      break;
+    if (lookup(parser, &(newDtd->prefixes), oldP->name, 0))
+      continue;
+    name = poolCopyString(&(newDtd->pool), oldP->name);
+    if (!name)
+      return 0;
+    if (!lookup(parser, &(newDtd->prefixes), name, sizeof(PREFIX)))
+      return 0;
+  }
+
+  hashTableIterInit(&iter, &(oldDtd->attributeIds));
+  for (;;) {
+    ATTRIBUTE_ID *newA;
+    const XML_Char *name;
+    const ATTRIBUTE_ID *oldA = (ATTRIBUTE_ID *)hashTableIterNext(&iter);
+    if (!oldA)
+      break;
+    newA = (ATTRIBUTE_ID *)lookup(parser, &(newDtd->attributeIds),
+                                  oldA->name, 0);
+    if (newA) {
+      newA->maybeTokenized |= oldA->maybeTokenized;
+      continue;
+    }
+    /* Remember to allocate the scratch byte before the name. */
+    if (!poolAppendChar(&(newDtd->pool), XML_T('\0')))
+      return 0;
+    name = poolCopyString(&(newDtd->pool), oldA->name);
+    if (!name)
+      return 0;
+    ++name;
+    newA = (ATTRIBUTE_ID *)lookup(parser, &(newDtd->attributeIds), name,
+                                  sizeof(ATTRIBUTE_ID));
+    if (!newA)
+      return 0;
+    newA->maybeTokenized = oldA->maybeTokenized;
+    if (oldA->prefix) {
+      newA->xmlns = oldA->xmlns;
+      if (oldA->prefix == &oldDtd->defaultPrefix)
+        newA->prefix = &newDtd->defaultPrefix;
+      else
+        newA->prefix = (PREFIX *)lookup(parser, &(newDtd->prefixes),
+                                        oldA->prefix->name, 0);
+    }
+  }
+
+  hashTableIterInit(&iter, &(oldDtd->elementTypes));
+  for (;;) {
+    int i;
+    ELEMENT_TYPE *newE;
+    const ELEMENT_TYPE *oldE = (ELEMENT_TYPE *)hashTableIterNext(&iter);
+    if (!oldE)
+      break;
+    newE = (ELEMENT_TYPE *)lookup(parser, &(newDtd->elementTypes),
+                                  oldE->name, 0);
+    if (!newE) {
+      const XML_Char *name = poolCopyString(&(newDtd->pool), oldE->name);
+      if (!name)
+        return 0;
+      newE = (ELEMENT_TYPE *)lookup(parser, &(newDtd->elementTypes), name,
+                                    sizeof(ELEMENT_TYPE));
+      if (!newE)
+        return 0;
+      if (oldE->prefix)
+        newE->prefix = (PREFIX *)lookup(parser, &(newDtd->prefixes),
+                                        oldE->prefix->name, 0);
+    }
+    /* defineAttribute skips the defaults the element already has, and
+       only takes the ID attribute if the element has none */
+    for (i = 0; i < oldE->nDefaultAtts; i++) {
+      const DEFAULT_ATTRIBUTE *oldAtt = oldE->defaultAtts + i;
+      const XML_Char *value = NULL;
+      ATTRIBUTE_ID *id = (ATTRIBUTE_ID *)
+          lookup(parser, &(newDtd->attributeIds), oldAtt->id->name, 0);
+      if (oldAtt->value) {
+        value = poolCopyString(&(newDtd->pool), oldAtt->value);
+        if (!value)
+          return 0;
+      }
+      if (!defineAttribute(newE, id, oldAtt->isCdata,
+                           (XML_Bool)(oldE->idAtt == oldAtt->id),
+                           value, parser))
+        return 0;
+    }
+  }
+
+  /* copyEntityTable skips the entities newDtd already declared */
+  if (!copyEntityTable(parser,
+                       &(newDtd->generalEntities),
+                       &(newDtd->pool),
+                       &(oldDtd->generalEntities)))
+      return 0;
+#ifdef XML_DTD
+  if (!copyEntityTable(parser,
+                       &(newDtd->paramEntities),
+                       &(newDtd->pool),
+                       &(oldDtd->paramEntities)))
+      return 0;
+#endif /* XML_DTD */
+
+  newDtd->hasParamEntityRefs = XML_TRUE;
+  return 1;
+}
+
 static int
 copyEntityTable(XML_Parser oldParser,
                 HASH_TABLE *newTable,
@@ -5897,6 +6330,8 @@ copyEntityTable(XML_Parser oldParser,
     const ENTITY *oldE = (ENTITY *)hashTableIterNext(&iter);
     if (!oldE)
       break;
+    if (newTable->used && lookup(oldParser, newTable, oldE->name, 0))
+      continue;  /* the first declaration wins (see dtdMerge) */
     name = poolCopyString(newPool, oldE->name);
     if (!name)
       return 0;
@@ -5991,9 +6426,11 @@ lookup(XML_Parser parser, HASH_TABLE *table, KEY name, size_t createSize)
     unsigned long mask = (unsigned long)table->size - 1;
     unsigned char step = 0;
     i = h & mask;
+    STATS_ADD(lookups, 1);
     while (table->v[i]) {
       if (keyeq(name, table->v[i]->name))
         return table->v[i];
+      STATS_ADD(lookupProbes, 1);
       if (!step)
         step = PROBE_STEP(h, mask, table->power);
       i < step ? (i += table->size - step) : (i -= step);
@@ -6102,11 +6539,19 @@ poolInit(STRING_POOL *pool, const XML_Memory_Handling_Suite *ms)
   pool->ptr = NULL;
   pool->end = NULL;
   pool->mem = ms;
+  pool->blockSize = INIT_BLOCK_SIZE;
+  pool->grows = 0;
+#ifdef XML_PARSER_STATS
+  pool->growCalls = 0;
+  pool->growBytes = 0;
+#endif
 }
 
 static void FASTCALL
 poolClear(STRING_POOL *pool)
 {
+  BLOCK **largest;
+  BLOCK **pp;
   if (!pool->freeBlocks)
     pool->freeBlocks = pool->blocks;
   else {
@@ -6118,6 +6563,18 @@ poolClear(STRING_POOL *pool)
       p = tem;
     }
   }
+  /* poolGrow only looks at the first free block, so put the largest one
+     first; this way the pool picks up at its high-water size */
+  largest = &pool->freeBlocks;
+  for (pp = largest; *pp; pp = &(*pp)->next)
+    if ((*pp)->size > (*largest)->size)
+      largest = pp;
+  if (*largest && largest != &pool->freeBlocks) {
+    BLOCK *tem = *largest;
+    *largest = tem->next;
+    tem->next = pool->freeBlocks;
+    pool->freeBlocks = tem;
+  }
   pool->blocks = NULL;
   pool->start = NULL;
   pool->ptr = NULL;
@@ -6145,6 +6602,17 @@ static XML_Char *
 poolAppend(STRING_POOL *pool, const ENCODING *enc,
            const char *ptr, const char *end)
 {
+#ifndef XML_UNICODE
+  if (!MUST_CONVERT(enc, ptr)) {
+    /* UTF-8 to UTF-8: make room for all of it and copy it in one go */
+    int n = (int)(end - ptr);
+    if ((!pool->ptr || pool->end - pool->ptr < n) && !poolGrowBy(pool, n))
+      return NULL;
+    memcpy(pool->ptr, ptr, n);
+    pool->ptr += n;
+    return pool->start;
+  }
+#endif
   if (!pool->ptr && !poolGrow(pool))
     return NULL;
   for (;;) {
@@ -6209,7 +6677,19 @@ poolStoreString(STRING_POOL *pool, const ENCODING *enc,
 static XML_Bool FASTCALL
 poolGrow(STRING_POOL *pool)
 {
-  if (pool->freeBlocks) {
+  return poolGrowBy(pool, 0);
+}
+
+/* Grow the current string's block, making sure at least extra more
+   characters fit after pool->ptr. */
+static XML_Bool FASTCALL
+poolGrowBy(STRING_POOL *pool, int extra)
+{
+  int needed = (int)(pool->ptr - pool->start) + extra;
+#ifdef XML_PARSER_STATS
+  pool->growCalls++;
+#endif
+  if (pool->freeBlocks && pool->freeBlocks->size >= needed) {
     if (pool->start == 0) {
       pool->blocks = pool->freeBlocks;
       pool->freeBlocks = pool->freeBlocks->next;
@@ -6234,12 +6714,19 @@ poolGrow(STRING_POOL *pool)
   }
   if (pool->blocks && pool->start == pool->blocks->s) {
     int blockSize = (int)(pool->end - pool->start)*2;
-    BLOCK *temp = (BLOCK *)
+    BLOCK *temp;
+    if (blockSize < needed)
+      blockSize = needed;
+    temp = (BLOCK *)
       pool->mem->realloc_fcn(pool->blocks,
                              (offsetof(BLOCK, s)
                               + blockSize * sizeof(XML_Char)));
     if (temp == NULL)
       return XML_FALSE;
+    pool->grows++;
+#ifdef XML_PARSER_STATS
+    pool->growBytes += blockSize * sizeof(XML_Char);
+#endif
     pool->blocks = temp;
     pool->blocks->size = blockSize;
     pool->ptr = pool->blocks->s + (pool->ptr - pool->start);
@@ -6249,14 +6736,20 @@ poolGrow(STRING_POOL *pool)
   else {
     BLOCK *tem;
     int blockSize = (int)(pool->end - pool->start);
-    if (blockSize < INIT_BLOCK_SIZE)
-      blockSize = INIT_BLOCK_SIZE;
+    if (blockSize < pool->blockSize)
+      blockSize = pool->blockSize;
     else
       blockSize *= 2;
+    if (blockSize < needed)
+      blockSize = needed;
     tem = (BLOCK *)pool->mem->malloc_fcn(offsetof(BLOCK, s)
                                         + blockSize * sizeof(XML_Char));
     if (!tem)
       return XML_FALSE;
+    pool->grows++;
+#ifdef XML_PARSER_STATS
+    pool->growBytes += blockSize * sizeof(XML_Char);
+#endif
     tem->size = blockSize;
     tem->next = pool->blocks;
     pool->blocks = tem;
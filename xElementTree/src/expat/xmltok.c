@@ -3,6 +3,7 @@
 */
 
 #include <stddef.h>
+#include <string.h>
 
 #ifdef COMPILED_FROM_DSP
 #include "winconfig.h"
@@ -323,18 +324,29 @@ utf8_toUtf8(const ENCODING *enc,
             const char **fromP, const char *fromLim,
             char **toP, const char *toLim)
 {
-  char *to;
-  const char *from;
+  size_t n;
   if (fromLim - *fromP > toLim - *toP) {
-    /* Avoid copying partial characters. */
-    for (fromLim = *fromP + (toLim - *toP); fromLim > *fromP; fromLim--)
-      if (((unsigned char)fromLim[-1] & 0xc0) != 0x80)
+    /* Avoid copying partial characters.  Only the last character can be
+       cut, so look no further back than its lead byte. */
+    const char *lead;
+    fromLim = *fromP + (toLim - *toP);
+    for (lead = fromLim; lead > *fromP && fromLim - lead < 4; lead--) {
+      unsigned char c = (unsigned char)lead[-1];
+      if ((c & 0xc0) != 0x80) {
+        if (c >= 0xc0) {
+          /* lead byte: keep the character only if it is complete */
+          int len = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : 2;
+          if (fromLim - (lead - 1) < len)
+            fromLim = lead - 1;
+        }
         break;
+      }
+    }
   }
-  for (to = *toP, from = *fromP; from != fromLim; from++, to++)
-    *to = *from;
-  *fromP = from;
-  *toP = to;
+  n = fromLim - *fromP;
+  memcpy(*toP, *fromP, n);
+  *fromP += n;
+  *toP += n;
 }
 
 static void PTRCALL
@@ -162,6 +162,47 @@ is_empty_dict(PyObject *obj)
 /* -------------------------------------------------------------------- */
 /* the Element type */
 
+/* position of an element's start or end tag, as reported by expat.  this
+   is kept as plain integers; the (line, col, bytePos) tuple is only built
+   when the start or end attribute is accessed. */
+typedef struct {
+    int line;
+    int col;
+    long bytePos;
+} ElementPosition;
+
+/* position index: every positioned element in a subtree, in document
+   order, with the byte range it covers.  built by the tree builder when
+   the document is closed, and used by element_at/elements_in_range.
+   the element pointers are borrowed: the subtree keeps them alive until
+   it is changed, and any change makes the index stale (see
+   element_generation) */
+typedef struct {
+    PyObject* element;
+    long start;
+    long end; /* where the end tag finishes */
+    long end_tag; /* where the end tag starts */
+    Py_ssize_t parent; /* entry of the enclosing element, or -1 */
+} ElementIndexEntry;
+
+typedef struct {
+    Py_ssize_t length;
+    Py_ssize_t allocated;
+    ElementIndexEntry* entries;
+    unsigned long generation; /* element_generation when built */
+} ElementIndex;
+
+/* bumped whenever the children or positions of any element change;
+   position indexes built before that are rebuilt when next used.
+   elements don't know the trees they are in, so this is one counter
+   for all of them: any change to any element costs every indexed tree
+   an O(n) rebuild on its next lookup.  that's fine for the usual parse,
+   then look up, then drop pattern, but not for interleaving lookups with
+   edits of unrelated trees */
+static unsigned long element_generation = 0;
+
+#define ELEMENT_MUTATED() (element_generation++)
+
 typedef struct {
 
     /* attributes (a dictionary object), or None if no attributes */
@@ -176,6 +217,9 @@ typedef struct {
 
     PyObject* _children[STATIC_CHILDREN];
 
+    /* position index for this subtree, or NULL if not built */
+    ElementIndex* index;
+
 } ElementObjectExtra;
 
 typedef struct {
@@ -198,8 +242,16 @@ typedef struct {
 
     PyObject* localName; /* string */
     PyObject* ns; /* string */
-    PyObject* start; /* tuple(line, col, bytePos) */
-    PyObject* end; /* tuple(line, col, bytePos) */
+
+    /* tuple(line, col, bytePos), or NULL if the tuple for start_pos or
+       end_pos hasn't been built yet (None if there is no position) */
+    PyObject* start;
+    PyObject* end;
+
+    ElementPosition start_pos;
+    ElementPosition end_pos;
+    long end_length; /* length of the end tag in bytes (0 for <tag/>) */
+    char end_parsed; /* end_pos and end_length came from the parser */
 
     ElementObjectExtra* extra;
 
@@ -231,9 +283,21 @@ create_extra(ElementObject* self, PyObject* attrib)
     self->extra->allocated = STATIC_CHILDREN;
     self->extra->children = self->extra->_children;
 
+    self->extra->index = NULL;
+
     return 0;
 }
 
+LOCAL(void)
+dealloc_index(ElementIndex* index)
+{
+    if (!index)
+        return;
+
+    PyObject_Free(index->entries);
+    PyObject_Free(index);
+}
+
 LOCAL(void)
 dealloc_extra(ElementObject* self)
 {
@@ -256,6 +320,8 @@ dealloc_extra(ElementObject* self)
     if (myextra->children != myextra->_children)
         PyObject_Free(myextra->children);
 
+    dealloc_index(myextra->index);
+
     PyObject_Free(myextra);
 }
 
@@ -353,6 +419,8 @@ feed_new_element(ElementObject* self, PyObject* tag, PyObject* attrib)
 
     Py_INCREF(Py_None);
     self->end = Py_None;
+    self->end_length = 0;
+    self->end_parsed = 0;
 
     self->weakreflist = NULL;
 
@@ -489,16 +557,35 @@ element_init(PyObject *self, PyObject *args, PyObject *kwds)
 LOCAL(void)
 element_add_position(ElementObject* self, int end, long line, long col, long bytePos)
 {
-    PyObject* position;
-    position = PyTuple_New(3);
-    PyTuple_SET_ITEM(position, 0, (PyObject*) PyLong_FromLong(line));
-    PyTuple_SET_ITEM(position, 1, (PyObject*) PyLong_FromLong(col));
-    PyTuple_SET_ITEM(position, 2, (PyObject*) PyLong_FromLong(bytePos));
+    /* record a position; the tuple is built lazily, see
+       element_get_position */
     if (end) {
-        self->end = position;
+        Py_CLEAR(self->end);
+        self->end_pos.line = (int) line;
+        self->end_pos.col = (int) col;
+        self->end_pos.bytePos = bytePos;
     } else {
-        self->start = position;
+        Py_CLEAR(self->start);
+        self->start_pos.line = (int) line;
+        self->start_pos.col = (int) col;
+        self->start_pos.bytePos = bytePos;
+    }
+}
+
+LOCAL(PyObject*)
+element_get_position(ElementObject* self, int end)
+{
+    /* return borrowed reference to the start or end position tuple,
+       building (and caching) it if needed */
+
+    PyObject** res = end ? &self->end : &self->start;
+
+    if (!*res) {
+        ElementPosition* pos = end ? &self->end_pos : &self->start_pos;
+        *res = Py_BuildValue("(iil)", pos->line, pos->col, pos->bytePos);
     }
+
+    return *res;
 }
 
 
@@ -668,6 +755,8 @@ subelement(PyObject *self, PyObject *args, PyObject *kwds)
 
     Py_DECREF(attrib);
 
+    ELEMENT_MUTATED();
+
     if (element_add_subelement(parent, elem) < 0) {
         Py_DECREF(elem);
         return NULL;
@@ -756,6 +845,8 @@ element_append(ElementObject* self, PyObject* args)
     if (!PyArg_ParseTuple(args, "O!:append", &Element_Type, &element))
         return NULL;
 
+    ELEMENT_MUTATED();
+
     if (element_add_subelement(self, element) < 0)
         return NULL;
 
@@ -768,6 +859,8 @@ element_clearmethod(ElementObject* self, PyObject* args)
     if (!PyArg_ParseTuple(args, ":clear"))
         return NULL;
 
+    ELEMENT_MUTATED();
+
     dealloc_extra(self);
 
     Py_INCREF(Py_None);
@@ -787,11 +880,11 @@ element_clearmethod(ElementObject* self, PyObject* args)
     self->ns = Py_None;
 
     Py_INCREF(Py_None);
-    Py_DECREF(self->start);
+    Py_XDECREF(self->start);
     self->start = Py_None;
 
     Py_INCREF(Py_None);
-    Py_DECREF(self->end);
+    Py_XDECREF(self->end);
     self->end = Py_None;
 
     Py_RETURN_NONE;
@@ -829,11 +922,15 @@ element_copy(ElementObject* self, PyObject* args)
 
     Py_DECREF(element->start);
     element->start = self->start;
-    Py_INCREF(element->start);
+    element->start_pos = self->start_pos;
+    Py_XINCREF(element->start);
 
     Py_DECREF(element->end);
     element->end = self->end;
-    Py_INCREF(element->end);
+    element->end_pos = self->end_pos;
+    element->end_length = self->end_length;
+    element->end_parsed = self->end_parsed;
+    Py_XINCREF(element->end);
 
     if (self->extra) {
 
@@ -950,6 +1047,9 @@ element_sizeof(PyObject* _self, PyObject* args)
         result += sizeof(ElementObjectExtra);
         if (self->extra->children != self->extra->_children)
             result += sizeof(PyObject*) * self->extra->allocated;
+        if (self->extra->index)
+            result += sizeof(ElementIndex) +
+                sizeof(ElementIndexEntry) * self->extra->index->allocated;
     }
     return PyLong_FromSsize_t(result);
 }
@@ -977,6 +1077,9 @@ element_getstate(ElementObject *self)
     int i, noattrib;
     PyObject *instancedict = NULL, *children;
 
+    if (!element_get_position(self, 0) || !element_get_position(self, 1))
+        return NULL;
+
     /* Build a list of children. */
     children = PyList_New(self->extra ? self->extra->length : 0);
     if (!children)
@@ -990,7 +1093,7 @@ element_getstate(ElementObject *self)
     /* Construct the state object. */
     noattrib = (self->extra == NULL || self->extra->attrib == Py_None);
     if (noattrib)
-        instancedict = Py_BuildValue("{sOsOs{}sOsOsOsOsOsOsOsO}",
+        instancedict = Py_BuildValue("{sOsOs{}sOsOsOsOsOsO}",
                                      PICKLED_TAG, self->tag,
                                      PICKLED_CHILDREN, children,
                                      PICKLED_ATTRIB,
@@ -1001,7 +1104,7 @@ element_getstate(ElementObject *self)
                                      PICKLED_TEXT, JOIN_OBJ(self->text),
                                      PICKLED_TAIL, JOIN_OBJ(self->tail));
     else
-        instancedict = Py_BuildValue("{sOsOsOsOsOsOsOsOsOsOsO}",
+        instancedict = Py_BuildValue("{sOsOsOsOsOsOsOsOsO}",
                                      PICKLED_TAG, self->tag,
                                      PICKLED_CHILDREN, children,
                                      PICKLED_ATTRIB, self->extra->attrib,
@@ -1063,11 +1166,11 @@ element_setstate_from_attributes(ElementObject *self,
     self->ns = ns ? ns : Py_None;
     Py_INCREF(self->ns);
 
-    Py_CLEAR(self->start);
+    Py_XDECREF(self->start);
     self->start = start ? start : Py_None;
     Py_INCREF(self->start);
 
-    Py_CLEAR(self->end);
+    Py_XDECREF(self->end);
     self->end = end ? end : Py_None;
     Py_INCREF(self->end);
 
@@ -1088,6 +1191,8 @@ element_setstate_from_attributes(ElementObject *self,
         nchildren = 0;
     }
 
+    ELEMENT_MUTATED();
+
     /* Allocate 'extra'. */
     if (element_resize(self, nchildren)) {
         return NULL;
@@ -1217,6 +1322,8 @@ element_extend(ElementObject* self, PyObject* args)
         return NULL;
     }
 
+    ELEMENT_MUTATED();
+
     seqlen = PySequence_Size(seq);
     for (i = 0; i < seqlen; i++) {
         PyObject* element = PySequence_Fast_GET_ITEM(seq, i);
@@ -1522,6 +1629,8 @@ element_insert(ElementObject* self, PyObject* args)
     if (index > self->extra->length)
         index = self->extra->length;
 
+    ELEMENT_MUTATED();
+
     if (element_resize(self, 1) < 0)
         return NULL;
 
@@ -1624,6 +1733,8 @@ element_remove(ElementObject* self, PyObject* args)
         return NULL;
     }
 
+    ELEMENT_MUTATED();
+
     Py_DECREF(self->extra->children[i]);
 
     self->extra->length--;
@@ -1680,6 +1791,8 @@ element_setitem(PyObject* self_, Py_ssize_t index, PyObject* item)
         return -1;
     }
 
+    ELEMENT_MUTATED();
+
     old = self->extra->children[index];
 
     if (item) {
@@ -1753,6 +1866,8 @@ element_ass_subscr(PyObject* self_, PyObject* item, PyObject* value)
 {
     ElementObject* self = (ElementObject*) self_;
 
+    ELEMENT_MUTATED();
+
     if (PyIndex_Check(item)) {
         Py_ssize_t i = PyNumber_AsSsize_t(item, PyExc_IndexError);
 
@@ -1929,6 +2044,266 @@ element_ass_subscr(PyObject* self_, PyObject* item, PyObject* value)
     }
 }
 
+/* -------------------------------------------------------------------- */
+/* position index */
+
+LOCAL(int)
+element_position_read(ElementObject* self, int end, ElementPosition* out)
+{
+    /* get the start or end position as integers.  returns 0 if the
+       element has no (usable) position */
+
+    PyObject* pos = end ? self->end : self->start;
+
+    if (!pos) {
+        *out = end ? self->end_pos : self->start_pos;
+        return out->bytePos >= 0;
+    }
+
+    /* position assigned by application code */
+    if (!PyTuple_Check(pos) || PyTuple_GET_SIZE(pos) != 3)
+        return 0;
+    out->line = (int) PyLong_AsLong(PyTuple_GET_ITEM(pos, 0));
+    out->col = (int) PyLong_AsLong(PyTuple_GET_ITEM(pos, 1));
+    out->bytePos = PyLong_AsLong(PyTuple_GET_ITEM(pos, 2));
+    if (PyErr_Occurred()) {
+        PyErr_Clear();
+        return 0;
+    }
+    return out->bytePos >= 0;
+}
+
+LOCAL(long)
+element_position_offset(ElementObject* self, int end)
+{
+    /* return the byte offset of the start or end tag, or -1 if unknown */
+
+    ElementPosition pos;
+
+    if (!element_position_read(self, end, &pos))
+        return -1;
+    return pos.bytePos;
+}
+
+LOCAL(int)
+element_index_add(ElementIndex* index, ElementObject* self,
+                  Py_ssize_t parent, long parent_end)
+{
+    ElementIndexEntry* entry;
+    long start, end, end_tag;
+    int i;
+
+    start = element_position_offset(self, 0);
+
+    /* elements without a position (or out of document order) are left
+       out of the index, but their children are still considered */
+    if (start >= 0 && (index->length == 0 ||
+                       start >= index->entries[index->length - 1].start)) {
+        if (index->length >= index->allocated) {
+            Py_ssize_t size = index->allocated ? index->allocated * 2 : 64;
+            entry = PyObject_Realloc(index->entries,
+                                     size * sizeof(ElementIndexEntry));
+            if (!entry) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            index->entries = entry;
+            index->allocated = size;
+        }
+
+        /* an element that was never closed extends to its parent's end.
+           positions set by application code have no end tag length; the
+           element then covers the first byte of its end tag.  for <tag/>
+           the parser reports the end after the tag, with no length */
+        end_tag = element_position_offset(self, 1);
+        if (end_tag < start)
+            end = end_tag = parent_end;
+        else if (!self->end_parsed)
+            end = end_tag + 1;
+        else
+            end = end_tag + self->end_length;
+
+        entry = &index->entries[index->length];
+        entry->element = (PyObject*) self;
+        entry->start = start;
+        entry->end = end;
+        entry->end_tag = end_tag;
+        entry->parent = parent;
+
+        parent = index->length++;
+        parent_end = end;
+    }
+
+    if (self->extra) {
+        for (i = 0; i < self->extra->length; i++) {
+            PyObject* child = self->extra->children[i];
+            if (!PyObject_TypeCheck(child, &Element_Type))
+                continue;
+            if (element_index_add(index, (ElementObject*) child,
+                                  parent, parent_end) < 0)
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+LOCAL(ElementIndex*)
+element_build_index(ElementObject* self)
+{
+    /* (re)build the position index for this subtree */
+
+    ElementIndex* index;
+
+    if (!self->extra && create_extra(self, NULL) < 0) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    index = PyObject_Malloc(sizeof(ElementIndex));
+    if (!index) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    index->length = index->allocated = 0;
+    index->entries = NULL;
+    index->generation = element_generation;
+
+    if (element_index_add(index, self, -1, LONG_MAX) < 0) {
+        dealloc_index(index);
+        return NULL;
+    }
+
+    dealloc_index(self->extra->index);
+    self->extra->index = index;
+
+    return index;
+}
+
+LOCAL(ElementIndex*)
+element_get_index(ElementObject* self)
+{
+    if (self->extra && self->extra->index &&
+        self->extra->index->generation == element_generation)
+        return self->extra->index;
+    return element_build_index(self);
+}
+
+LOCAL(Py_ssize_t)
+element_index_search(ElementIndex* index, long offset)
+{
+    /* return the first entry starting after offset */
+
+    Py_ssize_t lo = 0, hi = index->length;
+
+    while (lo < hi) {
+        Py_ssize_t mid = lo + (hi - lo) / 2;
+        if (index->entries[mid].start <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static PyObject*
+element_element_at(ElementObject* self, PyObject* args)
+{
+    ElementIndex* index;
+    Py_ssize_t i;
+    long offset;
+
+    if (!PyArg_ParseTuple(args, "l:element_at", &offset))
+        return NULL;
+
+    index = element_get_index(self);
+    if (!index)
+        return NULL;
+
+    /* the innermost element containing offset is the last one starting
+       at or before it, or the nearest of its ancestors that spans it */
+    i = element_index_search(index, offset) - 1;
+    while (i >= 0 && index->entries[i].end <= offset)
+        i = index->entries[i].parent;
+
+    if (i < 0)
+        Py_RETURN_NONE;
+
+    Py_INCREF(index->entries[i].element);
+    return index->entries[i].element;
+}
+
+static PyObject*
+element_elements_in_range(ElementObject* self, PyObject* args)
+{
+    ElementIndex* index;
+    PyObject* list;
+    Py_ssize_t i;
+    long start, end;
+
+    if (!PyArg_ParseTuple(args, "ll:elements_in_range", &start, &end))
+        return NULL;
+
+    index = element_get_index(self);
+    if (!index)
+        return NULL;
+
+    list = PyList_New(0);
+    if (!list)
+        return NULL;
+
+    /* elements starting within [start, end), in document order */
+    for (i = element_index_search(index, start - 1);
+         i < index->length && index->entries[i].start < end; i++) {
+        if (PyList_Append(list, index->entries[i].element) < 0) {
+            Py_DECREF(list);
+            return NULL;
+        }
+    }
+
+    return list;
+}
+
+/* how to move positions after a region of the document was replaced:
+   all positions move by lines/bytes, those on the given line also move
+   by col columns */
+typedef struct {
+    int line;
+    int col;
+    int lines;
+    long bytes;
+} PositionShift;
+
+LOCAL(void)
+element_shift_position(ElementObject* self, int end, PositionShift* shift)
+{
+    ElementPosition pos;
+
+    if (!element_position_read(self, end, &pos))
+        return;
+
+    if (pos.line == shift->line)
+        pos.col += shift->col;
+    element_add_position(self, end, pos.line + shift->lines, pos.col,
+                         pos.bytePos + shift->bytes);
+}
+
+LOCAL(void)
+element_shift_subtree(ElementObject* self, PositionShift* shift)
+{
+    int i;
+
+    element_shift_position(self, 0, shift);
+    element_shift_position(self, 1, shift);
+
+    if (self->extra)
+        for (i = 0; i < self->extra->length; i++) {
+            PyObject* child = self->extra->children[i];
+            if (PyObject_TypeCheck(child, &Element_Type))
+                element_shift_subtree((ElementObject*) child, shift);
+        }
+}
+
 static PyMethodDef element_methods[] = {
 
     {"clear", (PyCFunction) element_clearmethod, METH_VARARGS},
@@ -1949,6 +2324,9 @@ static PyMethodDef element_methods[] = {
     {"itertext", (PyCFunction) element_itertext, METH_VARARGS},
     {"iterfind", (PyCFunction) element_iterfind, METH_VARARGS | METH_KEYWORDS},
 
+    {"element_at", (PyCFunction) element_element_at, METH_VARARGS},
+    {"elements_in_range", (PyCFunction) element_elements_in_range, METH_VARARGS},
+
     {"getiterator", (PyCFunction) element_iter, METH_VARARGS | METH_KEYWORDS},
     {"getchildren", (PyCFunction) element_getchildren, METH_VARARGS},
 
@@ -2011,10 +2389,10 @@ element_getattro(ElementObject* self, PyObject* nameobj)
         res = self->ns;
     } else if (strcmp(name, "start") == 0) {
         PyErr_Clear();
-        res = self->start;
+        res = element_get_position(self, 0);
     } else if (strcmp(name, "end") == 0) {
         PyErr_Clear();
-        res = self->end;
+        res = element_get_position(self, 1);
     }
 
     if (!res)
@@ -2053,13 +2431,17 @@ element_setattro(ElementObject* self, PyObject* nameobj, PyObject* value)
         self->extra->attrib = value;
         Py_INCREF(self->extra->attrib);
     } else if (strcmp(name, "start") == 0) {
-        Py_DECREF(self->start);
+        ELEMENT_MUTATED();
+        Py_XDECREF(self->start);
         self->start = value;
         Py_INCREF(self->start);
     } else if (strcmp(name, "end") == 0) {
-        Py_DECREF(self->end);
+        ELEMENT_MUTATED();
+        Py_XDECREF(self->end);
         self->end = value;
         Py_INCREF(self->end);
+        self->end_length = 0;
+        self->end_parsed = 0;
     } else {
         PyErr_SetString(PyExc_AttributeError, name);
         return NULL;
@@ -2130,6 +2512,23 @@ static PyTypeObject Element_Type = {
 /* ==================================================================== */
 /* the tree builder type */
 
+/* an entry in the tree builder's event ring buffer.  events are kept as
+   (action, item) pairs and only turned into tuples when consumed; for
+   "end" events, the parent of the closed element is kept as well so
+   that iterparse can detach consumed subtrees. */
+typedef struct {
+    PyObject* action; /* event name object */
+    PyObject* item; /* element, (prefix, uri) tuple, or None */
+    PyObject* parent; /* parent element ("end" events only), or NULL */
+} EventItem;
+
+/* initial size of the event ring buffer (must be a power of two) */
+#define EVENT_RING_SIZE 64
+
+/* per open element flags kept on the tree builder's filter stack */
+#define FILTER_MATCH 1 /* element matches the filter; report its events */
+#define FILTER_BUILT 2 /* element was materialized */
+
 typedef struct {
     PyObject_HEAD
 
@@ -2151,6 +2550,24 @@ typedef struct {
     PyObject *end_event_obj;
     PyObject *start_ns_event_obj;
     PyObject *end_ns_event_obj;
+
+    /* event ring buffer, used instead of the events list by iterparse */
+    EventItem *ring; /* NULL if not collecting into the ring */
+    Py_ssize_t ring_head; /* index of the oldest pending event */
+    Py_ssize_t ring_length; /* number of pending events */
+    Py_ssize_t ring_allocated; /* ring size (a power of two) */
+
+    /* event filter (iterparse tags/attrib/skip); see
+       treebuilder_filter_start */
+    int filter; /* true if events are filtered */
+    PyObject *filter_tags; /* set of tags to report, or NULL for any tag */
+    PyObject *filter_key; /* raw UTF-8 attribute name (bytes), or NULL */
+    PyObject *filter_value; /* required UTF-8 value (bytes), or NULL */
+    int filter_skip; /* don't build elements that don't match */
+    int filter_drop_data; /* drop data (tail of a skipped element) */
+    char *filter_stack; /* FILTER_* flags for each open element */
+    Py_ssize_t filter_depth;
+    Py_ssize_t filter_allocated;
 } TreeBuilderObject;
 
 static PyTypeObject TreeBuilder_Type;
@@ -2186,6 +2603,14 @@ treebuilder_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
         t->events = NULL;
         t->start_event_obj = t->end_event_obj = NULL;
         t->start_ns_event_obj = t->end_ns_event_obj = NULL;
+
+        t->ring = NULL;
+        t->ring_head = t->ring_length = t->ring_allocated = 0;
+
+        t->filter = t->filter_skip = t->filter_drop_data = 0;
+        t->filter_tags = t->filter_key = t->filter_value = NULL;
+        t->filter_stack = NULL;
+        t->filter_depth = t->filter_allocated = 0;
     }
     return (PyObject *)t;
 }
@@ -2222,12 +2647,56 @@ treebuilder_gc_traverse(TreeBuilderObject *self, visitproc visit, void *arg)
     Py_VISIT(self->data);
     Py_VISIT(self->stack);
     Py_VISIT(self->element_factory);
+    Py_VISIT(self->filter_tags);
+    if (self->ring) {
+        Py_ssize_t i;
+        for (i = 0; i < self->ring_length; i++) {
+            EventItem* event = &self->ring[
+                (self->ring_head + i) & (self->ring_allocated - 1)];
+            Py_VISIT(event->item);
+            Py_VISIT(event->parent);
+        }
+    }
     return 0;
 }
 
+LOCAL(void)
+treebuilder_clear_ring(TreeBuilderObject *self)
+{
+    /* drop all pending events, and release the ring buffer itself */
+
+    EventItem* ring = self->ring;
+    Py_ssize_t i;
+
+    if (!ring)
+        return;
+
+    self->ring = NULL;
+
+    for (i = 0; i < self->ring_length; i++) {
+        EventItem* event = &ring[
+            (self->ring_head + i) & (self->ring_allocated - 1)];
+        Py_DECREF(event->action);
+        Py_DECREF(event->item);
+        Py_XDECREF(event->parent);
+    }
+
+    self->ring_head = self->ring_length = self->ring_allocated = 0;
+
+    PyObject_Free(ring);
+}
+
 static int
 treebuilder_gc_clear(TreeBuilderObject *self)
 {
+    treebuilder_clear_ring(self);
+    if (self->filter_stack) {
+        PyObject_Free(self->filter_stack);
+        self->filter_stack = NULL;
+    }
+    Py_CLEAR(self->filter_value);
+    Py_CLEAR(self->filter_key);
+    Py_CLEAR(self->filter_tags);
     Py_CLEAR(self->end_ns_event_obj);
     Py_CLEAR(self->start_ns_event_obj);
     Py_CLEAR(self->end_event_obj);
@@ -2309,94 +2778,326 @@ treebuilder_add_subelement(PyObject *element, PyObject *child)
 }
 
 /* -------------------------------------------------------------------- */
-/* handlers */
+/* event buffer */
 
-LOCAL(PyObject*)
-treebuilder_handle_start(TreeBuilderObject* self, PyObject* tag,
-                         PyObject* attrib, long line, long col, long pos)
+LOCAL(int)
+treebuilder_init_ring(TreeBuilderObject* self)
 {
-    PyObject* node;
-    PyObject* this;
+    /* switch event collection over to the ring buffer */
 
-    if (self->data) {
-        if (self->this == self->last) {
-            if (treebuilder_set_element_text(self->last, self->data))
-                return NULL;
-        }
-        else {
-            if (treebuilder_set_element_tail(self->last, self->data))
-                return NULL;
-        }
-        self->data = NULL;
-    }
+    if (self->ring)
+        return 0;
 
-    if (self->element_factory) {
-        node = PyObject_CallFunction(self->element_factory, "OO", tag, attrib);
-    } else {
-        node = create_new_element(tag, attrib);
-    }
-    if (!node) {
-        return NULL;
+    self->ring = PyObject_Malloc(EVENT_RING_SIZE * sizeof(EventItem));
+    if (!self->ring) {
+        PyErr_NoMemory();
+        return -1;
     }
+    self->ring_head = self->ring_length = 0;
+    self->ring_allocated = EVENT_RING_SIZE;
 
-    element_add_position((ElementObject*) node, 0, line, col, pos);
-
-    this = self->this;
-
-    if (this != Py_None) {
-        if (treebuilder_add_subelement(this, node) < 0)
-            goto error;
-    } else {
-        if (self->root) {
-            PyErr_SetString(
-                elementtree_parseerror_obj,
-                "multiple elements on top level"
-                );
-            goto error;
-        }
-        Py_INCREF(node);
-        self->root = node;
-    }
+    Py_CLEAR(self->events);
 
-    if (self->index < PyList_GET_SIZE(self->stack)) {
-        if (PyList_SetItem(self->stack, self->index, this) < 0)
-            goto error;
-        Py_INCREF(this);
-    } else {
-        if (PyList_Append(self->stack, this) < 0)
-            goto error;
-    }
-    self->index++;
+    return 0;
+}
 
-    Py_DECREF(this);
-    Py_INCREF(node);
-    self->this = node;
+LOCAL(int)
+treebuilder_push_event(TreeBuilderObject* self, PyObject* action,
+                       PyObject* item, PyObject* parent)
+{
+    /* record an event; the ring takes new references to action, item and
+       parent.  returns -1 (with an exception set) if this fails */
 
-    Py_DECREF(self->last);
-    Py_INCREF(node);
-    self->last = node;
+    EventItem* event;
 
-    if (self->start_event_obj) {
-        PyObject* res;
-        PyObject* action = self->start_event_obj;
-        res = PyTuple_Pack(2, action, node);
+    if (!self->ring) {
+        /* legacy list collector (used by _setevents) */
+        PyObject* res = PyTuple_Pack(2, action, item);
         if (res) {
             PyList_Append(self->events, res);
             Py_DECREF(res);
         } else
             PyErr_Clear(); /* FIXME: propagate error */
+        return 0;
     }
 
-    return node;
+    if (self->ring_length == self->ring_allocated) {
+        /* ring is full; double it, unwrapping the pending events so that
+           they start at the beginning of the new buffer */
+        Py_ssize_t size = self->ring_allocated;
+        Py_ssize_t head = self->ring_head;
+        EventItem* ring = PyObject_Malloc(2 * size * sizeof(EventItem));
+        if (!ring) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        memcpy(ring, self->ring + head, (size - head) * sizeof(EventItem));
+        memcpy(ring + size - head, self->ring, head * sizeof(EventItem));
+        PyObject_Free(self->ring);
+        self->ring = ring;
+        self->ring_head = 0;
+        self->ring_allocated = 2 * size;
+    }
 
-  error:
-    Py_DECREF(node);
-    return NULL;
+    event = &self->ring[
+        (self->ring_head + self->ring_length) & (self->ring_allocated - 1)];
+    Py_INCREF(action); event->action = action;
+    Py_INCREF(item); event->item = item;
+    Py_XINCREF(parent); event->parent = parent;
+    self->ring_length++;
+
+    return 0;
+}
+
+LOCAL(int)
+treebuilder_pop_event(TreeBuilderObject* self, EventItem* event)
+{
+    /* move the oldest pending event into *event (the caller takes over
+       the references).  returns 0 if there are no pending events */
+
+    if (!self->ring_length)
+        return 0;
+
+    *event = self->ring[self->ring_head];
+    self->ring_head = (self->ring_head + 1) & (self->ring_allocated - 1);
+    self->ring_length--;
+
+    return 1;
+}
+
+/* -------------------------------------------------------------------- */
+/* event filter */
+
+LOCAL(int)
+treebuilder_filter_start(TreeBuilderObject* self, PyObject* tag,
+                         const char **attrib_in)
+{
+    /* decide what to do with an element that is about to start, and
+       push the resulting FILTER_* flags on the filter stack.  tag is the
+       universal tag name; the attribute predicate is checked against the
+       raw expat attributes, so skipped elements never get an attribute
+       dictionary.  returns the flags, or -1 on error */
+
+    int flags = FILTER_BUILT;
+    int match = 1;
+
+    if (self->filter_tags) {
+        match = PySet_Contains(self->filter_tags, tag);
+        if (match < 0)
+            return -1;
+    }
+
+    if (match && self->filter_key) {
+        const char* key = PyBytes_AS_STRING(self->filter_key);
+        match = 0;
+        for (; attrib_in[0] && attrib_in[1]; attrib_in += 2) {
+            if (strcmp(attrib_in[0], key) == 0) {
+                match = !self->filter_value ||
+                    strcmp(attrib_in[1],
+                           PyBytes_AS_STRING(self->filter_value)) == 0;
+                break;
+            }
+        }
+    }
+
+    if (match)
+        flags |= FILTER_MATCH;
+    else if (self->filter_skip)
+        flags = 0;
+
+    if (self->filter_depth == self->filter_allocated) {
+        Py_ssize_t size = self->filter_allocated ?
+            2 * self->filter_allocated : 64;
+        char* stack = PyObject_Realloc(self->filter_stack, size);
+        if (!stack) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        self->filter_stack = stack;
+        self->filter_allocated = size;
+    }
+    self->filter_stack[self->filter_depth++] = flags;
+
+    if (flags & FILTER_BUILT)
+        self->filter_drop_data = 0;
+
+    return flags;
+}
+
+LOCAL(int)
+treebuilder_set_filter(TreeBuilderObject* self, PyObject* tags,
+                       PyObject* attrib, int skip)
+{
+    /* configure event filtering.  tags is a tag name or a sequence of tag
+       names (None for any tag), attrib an attribute name or a (name,
+       value) pair that matching elements must also have (None for no
+       predicate).  in skip mode, elements that don't match are not
+       built, and character data inside them is ignored */
+
+    PyObject* key = NULL;
+    PyObject* value = NULL;
+
+    Py_CLEAR(self->filter_tags);
+    Py_CLEAR(self->filter_key);
+    Py_CLEAR(self->filter_value);
+    self->filter = self->filter_skip = 0;
+
+    if (tags != Py_None) {
+        if (PyUnicode_Check(tags)) {
+            self->filter_tags = PySet_New(NULL);
+            if (!self->filter_tags || PySet_Add(self->filter_tags, tags) < 0)
+                return -1;
+        } else {
+            self->filter_tags = PySet_New(tags);
+            if (!self->filter_tags)
+                return -1;
+        }
+    }
+
+    if (attrib != Py_None) {
+        if (PyTuple_Check(attrib)) {
+            if (!PyArg_ParseTuple(attrib, "UU:attrib", &key, &value))
+                return -1;
+        } else if (PyUnicode_Check(attrib))
+            key = attrib;
+        else {
+            PyErr_SetString(
+                PyExc_TypeError,
+                "attrib must be a name or a (name, value) tuple"
+                );
+            return -1;
+        }
+
+        /* expat reports namespaced names as "uri}local" */
+        self->filter_key = PyUnicode_AsUTF8String(key);
+        if (!self->filter_key)
+            return -1;
+        if (PyBytes_AS_STRING(self->filter_key)[0] == '{') {
+            PyObject* raw = PyBytes_FromStringAndSize(
+                PyBytes_AS_STRING(self->filter_key) + 1,
+                PyBytes_GET_SIZE(self->filter_key) - 1);
+            Py_DECREF(self->filter_key);
+            self->filter_key = raw;
+            if (!raw)
+                return -1;
+        }
+
+        if (value) {
+            self->filter_value = PyUnicode_AsUTF8String(value);
+            if (!self->filter_value)
+                return -1;
+        }
+    }
+
+    self->filter = (self->filter_tags || self->filter_key);
+    self->filter_skip = self->filter && skip;
+
+    return 0;
+}
+
+LOCAL(int)
+treebuilder_filter_data(TreeBuilderObject* self)
+{
+    /* return true if character data at the current position is wanted,
+       i.e. it doesn't belong to a skipped element */
+
+    if (!self->filter_skip)
+        return 1;
+    if (self->filter_drop_data)
+        return 0;
+    return !self->filter_depth ||
+        (self->filter_stack[self->filter_depth - 1] & FILTER_BUILT);
+}
+
+/* -------------------------------------------------------------------- */
+/* handlers */
+
+LOCAL(PyObject*)
+treebuilder_handle_start(TreeBuilderObject* self, PyObject* tag,
+                         PyObject* attrib, long line, long col, long pos)
+{
+    PyObject* node;
+    PyObject* this;
+
+    if (self->data) {
+        if (self->this == self->last) {
+            if (treebuilder_set_element_text(self->last, self->data))
+                return NULL;
+        }
+        else {
+            if (treebuilder_set_element_tail(self->last, self->data))
+                return NULL;
+        }
+        self->data = NULL;
+    }
+
+    if (self->element_factory) {
+        node = PyObject_CallFunction(self->element_factory, "OO", tag, attrib);
+    } else {
+        node = create_new_element(tag, attrib);
+    }
+    if (!node) {
+        return NULL;
+    }
+
+    element_add_position((ElementObject*) node, 0, line, col, pos);
+
+    this = self->this;
+
+    if (this != Py_None) {
+        if (treebuilder_add_subelement(this, node) < 0)
+            goto error;
+    } else if (!self->root) {
+        Py_INCREF(node);
+        self->root = node;
+    } else if (!self->filter_skip) {
+        /* (in skip mode, matching elements that have no materialized
+           ancestor are simply left detached) */
+        PyErr_SetString(
+            elementtree_parseerror_obj,
+            "multiple elements on top level"
+            );
+        goto error;
+    }
+
+    if (self->index < PyList_GET_SIZE(self->stack)) {
+        if (PyList_SetItem(self->stack, self->index, this) < 0)
+            goto error;
+        Py_INCREF(this);
+    } else {
+        if (PyList_Append(self->stack, this) < 0)
+            goto error;
+    }
+    self->index++;
+
+    Py_DECREF(this);
+    Py_INCREF(node);
+    self->this = node;
+
+    Py_DECREF(self->last);
+    Py_INCREF(node);
+    self->last = node;
+
+    if (self->start_event_obj && (!self->filter || !self->filter_depth ||
+            (self->filter_stack[self->filter_depth - 1] & FILTER_MATCH))) {
+        if (treebuilder_push_event(self, self->start_event_obj,
+                                   node, NULL) < 0)
+            goto error;
+    }
+
+    return node;
+
+  error:
+    Py_DECREF(node);
+    return NULL;
 }
 
 LOCAL(PyObject*)
 treebuilder_handle_data(TreeBuilderObject* self, PyObject* data)
 {
+    if (self->filter && !treebuilder_filter_data(self))
+        Py_RETURN_NONE;
+
     if (!self->data) {
         if (self->last == Py_None) {
             /* ignore calls to data before the first call to start */
@@ -2432,9 +3133,20 @@ treebuilder_handle_data(TreeBuilderObject* self, PyObject* data)
 }
 
 LOCAL(PyObject*)
-treebuilder_handle_end(TreeBuilderObject* self, PyObject* tag, long line, long col, long pos)
+treebuilder_handle_end(TreeBuilderObject* self, PyObject* tag, long line, long col, long pos, long length)
 {
     PyObject* item;
+    int flags = FILTER_MATCH | FILTER_BUILT;
+
+    if (self->filter && self->filter_depth) {
+        flags = self->filter_stack[--self->filter_depth];
+        if (!(flags & FILTER_BUILT)) {
+            /* skipped element; anything up to the next tag is its tail */
+            self->filter_drop_data = 1;
+            Py_RETURN_NONE;
+        }
+        self->filter_drop_data = 0;
+    }
 
     if (self->data) {
         if (self->this == self->last) {
@@ -2466,17 +3178,13 @@ treebuilder_handle_end(TreeBuilderObject* self, PyObject* tag, long line, long c
     self->this = item;
 
     element_add_position((ElementObject*) self->last, 1, line, col, pos);
+    ((ElementObject*) self->last)->end_length = length;
+    ((ElementObject*) self->last)->end_parsed = pos >= 0;
 
-    if (self->end_event_obj) {
-        PyObject* res;
-        PyObject* action = self->end_event_obj;
-        PyObject* node = (PyObject*) self->last;
-        res = PyTuple_Pack(2, action, node);
-        if (res) {
-            PyList_Append(self->events, res);
-            Py_DECREF(res);
-        } else
-            PyErr_Clear(); /* FIXME: propagate error */
+    if (self->end_event_obj && (flags & FILTER_MATCH)) {
+        if (treebuilder_push_event(self, self->end_event_obj,
+                                   self->last, self->this) < 0)
+            return NULL;
     }
 
     Py_INCREF(self->last);
@@ -2487,11 +3195,10 @@ LOCAL(void)
 treebuilder_handle_namespace(TreeBuilderObject* self, int start,
                              PyObject *prefix, PyObject *uri)
 {
-    PyObject* res;
     PyObject* action;
     PyObject* parcel;
 
-    if (!self->events)
+    if (!self->events && !self->ring)
         return;
 
     if (start) {
@@ -2501,29 +3208,18 @@ treebuilder_handle_namespace(TreeBuilderObject* self, int start,
         parcel = Py_BuildValue("OO", prefix, uri);
         if (!parcel)
             return;
-        Py_INCREF(action);
     } else {
         if (!self->end_ns_event_obj)
             return;
         action = self->end_ns_event_obj;
-        Py_INCREF(action);
         parcel = Py_None;
         Py_INCREF(parcel);
     }
 
-    res = PyTuple_New(2);
-
-    if (res) {
-        PyTuple_SET_ITEM(res, 0, action);
-        PyTuple_SET_ITEM(res, 1, parcel);
-        PyList_Append(self->events, res);
-        Py_DECREF(res);
-    }
-    else {
-        Py_DECREF(action);
-        Py_DECREF(parcel);
+    if (treebuilder_push_event(self, action, parcel, NULL) < 0)
         PyErr_Clear(); /* FIXME: propagate error */
-    }
+
+    Py_DECREF(parcel);
 }
 
 /* -------------------------------------------------------------------- */
@@ -2546,7 +3242,7 @@ treebuilder_end(TreeBuilderObject* self, PyObject* args)
     if (!PyArg_ParseTuple(args, "O:end", &tag))
         return NULL;
 
-    return treebuilder_handle_end(self, tag, -1, -1, -1);
+    return treebuilder_handle_end(self, tag, -1, -1, -1, 0);
 }
 
 LOCAL(PyObject*)
@@ -2556,6 +3252,10 @@ treebuilder_done(TreeBuilderObject* self)
 
     /* FIXME: check stack size? */
 
+    if (self->root && Element_CheckExact(self->root) &&
+        !element_build_index((ElementObject*) self->root))
+        return NULL;
+
     if (self->root)
         res = self->root;
     else
@@ -2662,6 +3362,7 @@ typedef struct {
     PyObject *entity;
 
     PyObject *names;
+    PyObject *dtd; /* expat reads it when the prolog ends */
 
     PyObject *handle_start;
     PyObject *handle_data;
@@ -2673,6 +3374,18 @@ typedef struct {
 
     PyObject *handle_close;
 
+    /* parse_for() state */
+    Py_ssize_t document_size; /* -1 until parse_for() gets a document */
+    int document_done;
+    _PyTime_t deadline; /* 0 when not parsing against a time budget */
+    int deadline_countdown;
+
+#if defined(XML_PARSER_STATS)
+    unsigned long handler_calls;
+    _PyTime_t handler_time; /* inside our handlers */
+    _PyTime_t parse_time; /* inside expat, handlers included */
+#endif
+
 } XMLParserObject;
 
 static PyTypeObject XMLParser_Type;
@@ -2799,17 +3512,16 @@ expat_set_error(enum XML_Error error_code, int line, int column, char *message)
 /* handlers */
 
 static void
-expat_default_handler(XMLParserObject* self, const XML_Char* data_in,
-                      int data_len)
+expat_undefined_entity_handler(XMLParserObject* self, const XML_Char* name)
 {
+    /* reference to an entity that isn't declared in the document; look
+       it up in the parser's entity dictionary */
+
     PyObject* key;
     PyObject* value;
     PyObject* res;
 
-    if (data_len < 2 || data_in[0] != '&')
-        return;
-
-    key = PyUnicode_DecodeUTF8(data_in + 1, data_len - 2, "strict");
+    key = PyUnicode_DecodeUTF8(name, strlen(name), "strict");
     if (!key)
         return;
 
@@ -2827,8 +3539,9 @@ expat_default_handler(XMLParserObject* self, const XML_Char* data_in,
         Py_XDECREF(res);
     } else if (!PyErr_Occurred()) {
         /* Report the first error, not the last */
-        char message[128] = "undefined entity ";
-        strncat(message, data_in, data_len < 100?data_len:100);
+        char message[128];
+        PyOS_snprintf(message, sizeof(message), "undefined entity &%.100s;",
+                      name);
         expat_set_error(
             XML_ERROR_UNDEFINED_ENTITY,
             EXPAT(GetErrorLineNumber)(self->parser),
@@ -2840,6 +3553,22 @@ expat_default_handler(XMLParserObject* self, const XML_Char* data_in,
     Py_DECREF(key);
 }
 
+/* events between clock reads while parsing against a deadline */
+#define DEADLINE_CHECK_INTERVAL 64
+
+LOCAL(void)
+expat_check_deadline(XMLParserObject* self)
+{
+    /* suspend the parser once parse_for()'s time slice is used up */
+    if (!self->deadline || --self->deadline_countdown > 0)
+        return;
+    self->deadline_countdown = DEADLINE_CHECK_INTERVAL;
+    if (_PyTime_GetMonotonicClock() >= self->deadline) {
+        self->deadline = 0;
+        XML_StopParser(self->parser, XML_TRUE);
+    }
+}
+
 static void
 expat_start_handler(XMLParserObject* self, const XML_Char* tag_in,
                     const XML_Char **attrib_in)
@@ -2849,11 +3578,24 @@ expat_start_handler(XMLParserObject* self, const XML_Char* tag_in,
     PyObject* attrib;
     int ok;
 
+    expat_check_deadline(self);
+
     /* tag name */
     tag = makeuniversal(self, tag_in);
     if (!tag)
         return; /* parser will look for errors */
 
+    if (TreeBuilder_CheckExact(self->target) &&
+        ((TreeBuilderObject*) self->target)->filter) {
+        /* filtered events; elements may be skipped altogether */
+        ok = treebuilder_filter_start((TreeBuilderObject*) self->target,
+                                      tag, attrib_in);
+        if (ok <= 0) {
+            Py_DECREF(tag);
+            return;
+        }
+    }
+
     /* attributes */
     if (attrib_in[0]) {
         attrib = PyDict_New();
@@ -2910,6 +3652,11 @@ expat_data_handler(XMLParserObject* self, const XML_Char* data_in,
     PyObject* data;
     PyObject* res;
 
+    if (TreeBuilder_CheckExact(self->target) &&
+        ((TreeBuilderObject*) self->target)->filter &&
+        !treebuilder_filter_data((TreeBuilderObject*) self->target))
+        return;
+
     data = PyUnicode_DecodeUTF8(data_in, data_len, "strict");
     if (!data)
         return; /* parser will look for errors */
@@ -2933,6 +3680,8 @@ expat_end_handler(XMLParserObject* self, const XML_Char* tag_in)
     PyObject* tag;
     PyObject* res = NULL;
 
+    expat_check_deadline(self);
+
     if (TreeBuilder_CheckExact(self->target))
         /* shortcut */
         /* the standard tree builder doesn't look at the end tag */
@@ -2940,7 +3689,8 @@ expat_end_handler(XMLParserObject* self, const XML_Char* tag_in)
             (TreeBuilderObject*) self->target, Py_None,
             (long) XML_GetCurrentLineNumber(self->parser),
             (long) XML_GetCurrentColumnNumber(self->parser),
-            (long) XML_GetCurrentByteIndex(self->parser));
+            (long) XML_GetCurrentByteIndex(self->parser),
+            (long) XML_GetCurrentByteCount(self->parser));
     else if (self->handle_end) {
         tag = makeuniversal(self, tag_in);
         if (tag) {
@@ -3140,100 +3890,282 @@ expat_unknown_encoding_handler(XMLParserObject *self, const XML_Char *name,
     return XML_STATUS_OK;
 }
 
+#if defined(XML_PARSER_STATS)
+/* instrumented builds go through these, to count handler calls and the
+   time spent in them */
+
+#define TIMED_HANDLER(handler, params, args)                            \
+    static void                                                         \
+    handler##_timed params                                              \
+    {                                                                   \
+        _PyTime_t t0 = _PyTime_GetMonotonicClock();                     \
+        handler args;                                                   \
+        self->handler_time += _PyTime_GetMonotonicClock() - t0;         \
+        self->handler_calls++;                                          \
+    }
+
+TIMED_HANDLER(expat_start_handler,
+              (XMLParserObject* self, const XML_Char* tag_in,
+               const XML_Char **attrib_in),
+              (self, tag_in, attrib_in))
+TIMED_HANDLER(expat_end_handler,
+              (XMLParserObject* self, const XML_Char* tag_in),
+              (self, tag_in))
+TIMED_HANDLER(expat_data_handler,
+              (XMLParserObject* self, const XML_Char* data_in, int data_len),
+              (self, data_in, data_len))
+TIMED_HANDLER(expat_comment_handler,
+              (XMLParserObject* self, const XML_Char* comment_in),
+              (self, comment_in))
+TIMED_HANDLER(expat_pi_handler,
+              (XMLParserObject* self, const XML_Char* target_in,
+               const XML_Char* data_in),
+              (self, target_in, data_in))
+
+#define HANDLER(handler) handler##_timed
+#else
+#define HANDLER(handler) handler
+#endif
+
 /* -------------------------------------------------------------------- */
+/* precompiled DTDs: a DTD is parsed once into an expat DTD, and copied
+   from there into each parser created with it, instead of being read
+   again by every parse that needs its entities and attribute defaults */
+
+typedef struct {
+    PyObject_HEAD
+
+    XML_Parser parser; /* holds the declarations; never parses documents */
+} DTDObject;
+
+static PyTypeObject DTD_Type;
+
+#define DTD_CheckExact(op) (Py_TYPE(op) == &DTD_Type)
 
 static PyObject *
-xmlparser_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+dtd_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
-    XMLParserObject *self = (XMLParserObject *)type->tp_alloc(type, 0);
-    if (self) {
+    DTDObject *self = (DTDObject *)type->tp_alloc(type, 0);
+    if (self)
         self->parser = NULL;
-        self->target = self->entity = self->names = NULL;
-        self->handle_start = self->handle_data = self->handle_end = NULL;
-        self->handle_comment = self->handle_pi = self->handle_close = NULL;
-        self->handle_doctype = NULL;
-    }
     return (PyObject *)self;
 }
 
 static int
-xmlparser_init(PyObject *self, PyObject *args, PyObject *kwds)
+dtd_init(PyObject *self_, PyObject *args, PyObject *kwds)
 {
-    XMLParserObject *self_xp = (XMLParserObject *)self;
-    PyObject *target = NULL, *html = NULL;
-    char *encoding = NULL;
-    static char *kwlist[] = {"html", "target", "encoding", 0};
-
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OOz:XMLParser", kwlist,
-                                     &html, &target, &encoding)) {
-        return -1;
-    }
+    static char *kwlist[] = {"data", 0};
+    DTDObject *self = (DTDObject *)self_;
+    char *data;
+    int data_len;
 
-    self_xp->entity = PyDict_New();
-    if (!self_xp->entity)
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s#:DTD", kwlist,
+                                     &data, &data_len))
         return -1;
 
-    self_xp->names = PyDict_New();
-    if (!self_xp->names) {
-        Py_CLEAR(self_xp->entity);
+    if (self->parser) {
+        /* parsers created with it still read its declarations */
+        PyErr_SetString(PyExc_ValueError, "DTD already initialized");
         return -1;
     }
-
-    self_xp->parser = EXPAT(ParserCreate_MM)(encoding, &ExpatMemoryHandler, "}");
-    if (!self_xp->parser) {
-        Py_CLEAR(self_xp->entity);
-        Py_CLEAR(self_xp->names);
+    /* same namespace handling as the parsers that will use it */
+    self->parser = EXPAT(ParserCreate_MM)(NULL, &ExpatMemoryHandler, "}");
+    if (!self->parser) {
         PyErr_NoMemory();
         return -1;
     }
 
-    if (target) {
-        Py_INCREF(target);
-    } else {
-        target = treebuilder_new(&TreeBuilder_Type, NULL, NULL);
-        if (!target) {
-            Py_CLEAR(self_xp->entity);
-            Py_CLEAR(self_xp->names);
-            EXPAT(ParserFree)(self_xp->parser);
-            return -1;
-        }
+    if (XML_ParseDTD(self->parser, data, data_len) != XML_STATUS_OK) {
+        expat_set_error(
+            EXPAT(GetErrorCode)(self->parser),
+            EXPAT(GetErrorLineNumber)(self->parser),
+            EXPAT(GetErrorColumnNumber)(self->parser),
+            NULL
+            );
+        return -1;
     }
-    self_xp->target = target;
 
-    self_xp->handle_start = PyObject_GetAttrString(target, "start");
-    self_xp->handle_data = PyObject_GetAttrString(target, "data");
-    self_xp->handle_end = PyObject_GetAttrString(target, "end");
-    self_xp->handle_comment = PyObject_GetAttrString(target, "comment");
-    self_xp->handle_pi = PyObject_GetAttrString(target, "pi");
-    self_xp->handle_close = PyObject_GetAttrString(target, "close");
-    self_xp->handle_doctype = PyObject_GetAttrString(target, "doctype");
+    return 0;
+}
 
-    PyErr_Clear();
+static void
+dtd_dealloc(DTDObject *self)
+{
+    if (self->parser)
+        EXPAT(ParserFree)(self->parser);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
 
-    /* configure parser */
-    EXPAT(SetUserData)(self_xp->parser, self_xp);
-    EXPAT(SetElementHandler)(
-        self_xp->parser,
-        (XML_StartElementHandler) expat_start_handler,
-        (XML_EndElementHandler) expat_end_handler
-        );
-    EXPAT(SetDefaultHandlerExpand)(
-        self_xp->parser,
-        (XML_DefaultHandler) expat_default_handler
-        );
+static PyTypeObject DTD_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "cElementTree.DTD", sizeof(DTDObject), 0,
+    /* methods */
+    (destructor)dtd_dealloc,                        /* tp_dealloc */
+    0,                                              /* tp_print */
+    0,                                              /* tp_getattr */
+    0,                                              /* tp_setattr */
+    0,                                              /* tp_reserved */
+    0,                                              /* tp_repr */
+    0,                                              /* tp_as_number */
+    0,                                              /* tp_as_sequence */
+    0,                                              /* tp_as_mapping */
+    0,                                              /* tp_hash */
+    0,                                              /* tp_call */
+    0,                                              /* tp_str */
+    0,                                              /* tp_getattro */
+    0,                                              /* tp_setattro */
+    0,                                              /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                             /* tp_flags */
+    0,                                              /* tp_doc */
+    0,                                              /* tp_traverse */
+    0,                                              /* tp_clear */
+    0,                                              /* tp_richcompare */
+    0,                                              /* tp_weaklistoffset */
+    0,                                              /* tp_iter */
+    0,                                              /* tp_iternext */
+    0,                                              /* tp_methods */
+    0,                                              /* tp_members */
+    0,                                              /* tp_getset */
+    0,                                              /* tp_base */
+    0,                                              /* tp_dict */
+    0,                                              /* tp_descr_get */
+    0,                                              /* tp_descr_set */
+    0,                                              /* tp_dictoffset */
+    (initproc)dtd_init,                             /* tp_init */
+    PyType_GenericAlloc,                            /* tp_alloc */
+    dtd_new,                                        /* tp_new */
+    0,                                              /* tp_free */
+};
+
+/* -------------------------------------------------------------------- */
+
+static PyObject *
+xmlparser_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    XMLParserObject *self = (XMLParserObject *)type->tp_alloc(type, 0);
+    if (self) {
+        self->parser = NULL;
+        self->target = self->entity = self->names = self->dtd = NULL;
+        self->handle_start = self->handle_data = self->handle_end = NULL;
+        self->handle_comment = self->handle_pi = self->handle_close = NULL;
+        self->handle_doctype = NULL;
+        self->document_size = -1;
+        self->document_done = 0;
+        self->deadline = 0;
+        self->deadline_countdown = 0;
+#if defined(XML_PARSER_STATS)
+        self->handler_calls = 0;
+        self->handler_time = self->parse_time = 0;
+#endif
+    }
+    return (PyObject *)self;
+}
+
+static int
+xmlparser_init(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    XMLParserObject *self_xp = (XMLParserObject *)self;
+    PyObject *target = NULL, *html = NULL;
+    char *encoding = NULL;
+    int size_hint = 0;
+    int context_bytes = 0;
+    PyObject *dtd = NULL;
+    static char *kwlist[] = {"html", "target", "encoding", "size_hint",
+                             "context_bytes", "dtd", 0};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OOziiO!:XMLParser",
+                                     kwlist, &html, &target, &encoding,
+                                     &size_hint, &context_bytes,
+                                     &DTD_Type, &dtd)) {
+        return -1;
+    }
+
+    self_xp->entity = PyDict_New();
+    if (!self_xp->entity)
+        return -1;
+
+    self_xp->names = PyDict_New();
+    if (!self_xp->names) {
+        Py_CLEAR(self_xp->entity);
+        return -1;
+    }
+
+    self_xp->parser = EXPAT(ParserCreate_MM)(encoding, &ExpatMemoryHandler, "}");
+    if (!self_xp->parser) {
+        Py_CLEAR(self_xp->entity);
+        Py_CLEAR(self_xp->names);
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    if (size_hint > 0)
+        XML_SetPoolSizeHint(self_xp->parser, size_hint);
+    /* we never ask for the input context, so by default don't keep any
+       and let expat parse fed data in place */
+    XML_SetContextBytes(self_xp->parser, context_bytes);
+
+    if (dtd && !((DTDObject*) dtd)->parser) {
+        Py_CLEAR(self_xp->entity);
+        Py_CLEAR(self_xp->names);
+        EXPAT(ParserFree)(self_xp->parser);
+        self_xp->parser = NULL;
+        PyErr_SetString(PyExc_ValueError, "DTD not initialized");
+        return -1;
+    }
+    if (dtd) {
+        /* can't fail before parsing has started */
+        XML_CopyDTD(self_xp->parser, ((DTDObject*) dtd)->parser);
+        Py_INCREF(dtd);
+        Py_XSETREF(self_xp->dtd, dtd);
+    }
+
+    if (target) {
+        Py_INCREF(target);
+    } else {
+        target = treebuilder_new(&TreeBuilder_Type, NULL, NULL);
+        if (!target) {
+            Py_CLEAR(self_xp->entity);
+            Py_CLEAR(self_xp->names);
+            EXPAT(ParserFree)(self_xp->parser);
+            return -1;
+        }
+    }
+    self_xp->target = target;
+
+    self_xp->handle_start = PyObject_GetAttrString(target, "start");
+    self_xp->handle_data = PyObject_GetAttrString(target, "data");
+    self_xp->handle_end = PyObject_GetAttrString(target, "end");
+    self_xp->handle_comment = PyObject_GetAttrString(target, "comment");
+    self_xp->handle_pi = PyObject_GetAttrString(target, "pi");
+    self_xp->handle_close = PyObject_GetAttrString(target, "close");
+    self_xp->handle_doctype = PyObject_GetAttrString(target, "doctype");
+
+    PyErr_Clear();
+
+    /* configure parser */
+    EXPAT(SetUserData)(self_xp->parser, self_xp);
+    EXPAT(SetElementHandler)(
+        self_xp->parser,
+        (XML_StartElementHandler) HANDLER(expat_start_handler),
+        (XML_EndElementHandler) HANDLER(expat_end_handler)
+        );
+    XML_SetUndefinedEntityHandler(
+        self_xp->parser,
+        (XML_UndefinedEntityHandler) expat_undefined_entity_handler
+        );
     EXPAT(SetCharacterDataHandler)(
         self_xp->parser,
-        (XML_CharacterDataHandler) expat_data_handler
+        (XML_CharacterDataHandler) HANDLER(expat_data_handler)
         );
     if (self_xp->handle_comment)
         EXPAT(SetCommentHandler)(
             self_xp->parser,
-            (XML_CommentHandler) expat_comment_handler
+            (XML_CommentHandler) HANDLER(expat_comment_handler)
             );
     if (self_xp->handle_pi)
         EXPAT(SetProcessingInstructionHandler)(
             self_xp->parser,
-            (XML_ProcessingInstructionHandler) expat_pi_handler
+            (XML_ProcessingInstructionHandler) HANDLER(expat_pi_handler)
             );
     EXPAT(SetStartDoctypeDeclHandler)(
         self_xp->parser,
@@ -3260,6 +4192,7 @@ xmlparser_gc_traverse(XMLParserObject *self, visitproc visit, void *arg)
     Py_VISIT(self->target);
     Py_VISIT(self->entity);
     Py_VISIT(self->names);
+    Py_VISIT(self->dtd);
 
     return 0;
 }
@@ -3280,6 +4213,7 @@ xmlparser_gc_clear(XMLParserObject *self)
     Py_CLEAR(self->target);
     Py_CLEAR(self->entity);
     Py_CLEAR(self->names);
+    Py_CLEAR(self->dtd);
 
     return 0;
 }
@@ -3296,9 +4230,16 @@ LOCAL(PyObject*)
 expat_parse(XMLParserObject* self, char* data, int data_len, int final)
 {
     int ok;
+#if defined(XML_PARSER_STATS)
+    _PyTime_t t0 = _PyTime_GetMonotonicClock();
+#endif
 
     ok = EXPAT(Parse)(self->parser, data, data_len, final);
 
+#if defined(XML_PARSER_STATS)
+    self->parse_time += _PyTime_GetMonotonicClock() - t0;
+#endif
+
     if (PyErr_Occurred())
         return NULL;
 
@@ -3324,7 +4265,12 @@ xmlparser_close(XMLParserObject* self, PyObject* args)
     if (!PyArg_ParseTuple(args, ":close"))
         return NULL;
 
-    res = expat_parse(self, "", 0, 1);
+    if (self->document_done) {
+        /* parse_for() already finished the parse */
+        Py_INCREF(Py_None);
+        res = Py_None;
+    } else
+        res = expat_parse(self, "", 0, 1);
     if (!res)
         return NULL;
 
@@ -3351,6 +4297,86 @@ xmlparser_feed(XMLParserObject* self, PyObject* args)
     return expat_parse(self, data, data_len, 0);
 }
 
+static PyObject*
+xmlparser_parse_for(XMLParserObject* self, PyObject* args)
+{
+    /* parse a complete document in slices of about deadline_ms each; the
+       document is passed on the first call only.  returns the fraction
+       parsed so far, and 1.0 once done, after which close() returns the
+       result as usual */
+
+    double deadline_ms;
+    char* data = NULL;
+    int data_len = 0;
+    enum XML_Status status;
+#if defined(XML_PARSER_STATS)
+    _PyTime_t t0;
+#endif
+
+    if (!PyArg_ParseTuple(args, "d|s#:parse_for", &deadline_ms,
+                          &data, &data_len))
+        return NULL;
+
+    if (data && self->document_size >= 0) {
+        PyErr_SetString(PyExc_ValueError, "document already given");
+        return NULL;
+    }
+    if (!data && self->document_size < 0) {
+        PyErr_SetString(PyExc_ValueError, "no document to parse");
+        return NULL;
+    }
+    if (self->document_done)
+        return PyFloat_FromDouble(1.0);
+
+    if (data) {
+        /* copy it into expat's own buffer once, so suspending doesn't
+           make expat save the rest of it on every slice */
+        void* buffer = XML_GetBuffer(self->parser, data_len);
+        if (!buffer)
+            return PyErr_NoMemory();
+        memcpy(buffer, data, data_len);
+        self->document_size = data_len;
+    }
+
+    self->deadline = _PyTime_GetMonotonicClock() +
+        (_PyTime_t) (deadline_ms * 1e6);
+    self->deadline_countdown = DEADLINE_CHECK_INTERVAL;
+
+#if defined(XML_PARSER_STATS)
+    t0 = _PyTime_GetMonotonicClock();
+#endif
+    if (data)
+        status = XML_ParseBuffer(self->parser, data_len, 1);
+    else
+        status = XML_ResumeParser(self->parser);
+#if defined(XML_PARSER_STATS)
+    self->parse_time += _PyTime_GetMonotonicClock() - t0;
+#endif
+
+    self->deadline = 0;
+
+    if (PyErr_Occurred())
+        return NULL;
+
+    if (status == XML_STATUS_ERROR) {
+        expat_set_error(
+            EXPAT(GetErrorCode)(self->parser),
+            EXPAT(GetErrorLineNumber)(self->parser),
+            EXPAT(GetErrorColumnNumber)(self->parser),
+            NULL
+            );
+        return NULL;
+    }
+
+    if (status == XML_STATUS_SUSPENDED && self->document_size > 0)
+        return PyFloat_FromDouble(
+            (double) XML_GetCurrentByteIndex(self->parser) /
+            self->document_size);
+
+    self->document_done = 1;
+    return PyFloat_FromDouble(1.0);
+}
+
 static PyObject*
 xmlparser_parse(XMLParserObject* self, PyObject* args)
 {
@@ -3432,19 +4458,16 @@ xmlparser_doctype(XMLParserObject *self, PyObject *args)
     Py_RETURN_NONE;
 }
 
-static PyObject*
-xmlparser_setevents(XMLParserObject *self, PyObject* args)
+LOCAL(int)
+xmlparser_setevents_impl(XMLParserObject *self, PyObject* events,
+                         PyObject* event_set)
 {
-    /* activate element event reporting */
+    /* activate element event reporting, either into the given list or,
+       if events is NULL, into the target's event ring buffer */
 
     Py_ssize_t i;
     TreeBuilderObject* target;
-
-    PyObject* events; /* event collector */
-    PyObject* event_set = Py_None;
-    if (!PyArg_ParseTuple(args, "O!|O:_setevents",  &PyList_Type, &events,
-                          &event_set))
-        return NULL;
+    PyObject* seq;
 
     if (!TreeBuilder_CheckExact(self->target)) {
         PyErr_SetString(
@@ -3452,14 +4475,18 @@ xmlparser_setevents(XMLParserObject *self, PyObject* args)
             "event handling only supported for ElementTree.TreeBuilder "
             "targets"
             );
-        return NULL;
+        return -1;
     }
 
     target = (TreeBuilderObject*) self->target;
 
-    Py_INCREF(events);
-    Py_XDECREF(target->events);
-    target->events = events;
+    if (events) {
+        treebuilder_clear_ring(target);
+        Py_INCREF(events);
+        Py_XDECREF(target->events);
+        target->events = events;
+    } else if (treebuilder_init_ring(target) < 0)
+        return -1;
 
     /* clear out existing events */
     Py_CLEAR(target->start_event_obj);
@@ -3470,22 +4497,26 @@ xmlparser_setevents(XMLParserObject *self, PyObject* args)
     if (event_set == Py_None) {
         /* default is "end" only */
         target->end_event_obj = PyUnicode_FromString("end");
-        Py_RETURN_NONE;
+        return target->end_event_obj ? 0 : -1;
     }
 
-    if (!PyTuple_Check(event_set)) /* FIXME: handle arbitrary sequences */
+    seq = PySequence_Fast(event_set, "");
+    if (!seq)
         goto error;
 
-    for (i = 0; i < PyTuple_GET_SIZE(event_set); i++) {
-        PyObject* item = PyTuple_GET_ITEM(event_set, i);
+    for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+        PyObject* item = PySequence_Fast_GET_ITEM(seq, i);
         char* event;
         if (PyUnicode_Check(item)) {
             event = _PyUnicode_AsString(item);
-            if (event == NULL)
+            if (event == NULL) {
+                Py_DECREF(seq);
                 goto error;
+            }
         } else if (PyBytes_Check(item))
             event = PyBytes_AS_STRING(item);
         else {
+            Py_DECREF(seq);
             goto error;
         }
         if (strcmp(event, "start") == 0) {
@@ -3519,26 +4550,125 @@ xmlparser_setevents(XMLParserObject *self, PyObject* args)
                 PyExc_ValueError,
                 "unknown event '%s'", event
                 );
-            return NULL;
+            Py_DECREF(seq);
+            return -1;
         }
     }
 
-    Py_RETURN_NONE;
+    Py_DECREF(seq);
+    return 0;
 
   error:
     PyErr_SetString(
         PyExc_TypeError,
         "invalid event tuple"
         );
+    return -1;
+}
+
+static PyObject*
+xmlparser_setevents(XMLParserObject *self, PyObject* args)
+{
+    /* activate element event reporting */
+
+    PyObject* events; /* event collector */
+    PyObject* event_set = Py_None;
+    if (!PyArg_ParseTuple(args, "O!|O:_setevents",  &PyList_Type, &events,
+                          &event_set))
+        return NULL;
+
+    if (xmlparser_setevents_impl(self, events, event_set) < 0)
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+xmlparser_stats(XMLParserObject* self, PyObject* args)
+{
+    /* parser counters; everything but the buffer and pool totals needs
+       a build with XML_PARSER_STATS */
+
+    unsigned long moved, allocs;
+    PyObject* stats;
+#if defined(XML_PARSER_STATS)
+    XML_ParserStats counters;
+    PyObject* tokens;
+    PyObject* extra;
+    int i;
+#endif
+
+    if (!PyArg_ParseTuple(args, ":stats"))
+        return NULL;
+
+    XML_GetBufferStats(self->parser, &moved, &allocs);
+    stats = Py_BuildValue(
+        "{sksksk}",
+        "pool_grows", XML_GetPoolGrowCount(self->parser),
+        "buffer_bytes_moved", moved,
+        "buffer_allocs", allocs
+        );
+
+#if defined(XML_PARSER_STATS)
+    if (!stats)
+        return NULL;
+
+    XML_GetParserStats(self->parser, &counters);
+
+    tokens = PyDict_New();
+    if (!tokens || PyDict_SetItemString(stats, "tokens", tokens) < 0) {
+        Py_XDECREF(tokens);
+        goto error;
+    }
+    Py_DECREF(tokens);
+    for (i = 0; i < XML_STATS_TOKEN_TYPES; i++) {
+        PyObject* count;
+        if (!counters.tokens[i])
+            continue;
+        count = PyLong_FromUnsignedLong(counters.tokens[i]);
+        if (!count || PyDict_SetItemString(
+                tokens, XML_GetStatsTokenName(i), count) < 0) {
+            Py_XDECREF(count);
+            goto error;
+        }
+        Py_DECREF(count);
+    }
+
+    extra = Py_BuildValue(
+        "{sksksksksksdsd}",
+        "lookups", counters.lookups,
+        "lookup_probes", counters.lookupProbes,
+        "pool_grow_calls", counters.poolGrows,
+        "pool_grow_bytes", counters.poolGrowBytes,
+        "handler_calls", self->handler_calls,
+        "handler_time", _PyTime_AsSecondsDouble(self->handler_time),
+        "expat_time", _PyTime_AsSecondsDouble(
+            self->parse_time - self->handler_time)
+        );
+    if (!extra || PyDict_Update(stats, extra) < 0) {
+        Py_XDECREF(extra);
+        goto error;
+    }
+    Py_DECREF(extra);
+#endif
+
+    return stats;
+
+#if defined(XML_PARSER_STATS)
+  error:
+    Py_DECREF(stats);
     return NULL;
+#endif
 }
 
 static PyMethodDef xmlparser_methods[] = {
     {"feed", (PyCFunction) xmlparser_feed, METH_VARARGS},
+    {"parse_for", (PyCFunction) xmlparser_parse_for, METH_VARARGS},
     {"close", (PyCFunction) xmlparser_close, METH_VARARGS},
     {"_parse", (PyCFunction) xmlparser_parse, METH_VARARGS},
     {"_setevents", (PyCFunction) xmlparser_setevents, METH_VARARGS},
     {"doctype", (PyCFunction) xmlparser_doctype, METH_VARARGS},
+    {"stats", (PyCFunction) xmlparser_stats, METH_VARARGS},
     {NULL, NULL}
 };
 
@@ -3562,6 +4692,13 @@ xmlparser_getattro(XMLParserObject* self, PyObject* nameobj)
             res = PyLong_FromLong(XML_GetCurrentColumnNumber(self->parser));
         else if (PyUnicode_CompareWithASCIIString(nameobj, "CurrentByteIndex") == 0)
             res = PyLong_FromLong(XML_GetCurrentByteIndex(self->parser));
+        else if (PyUnicode_CompareWithASCIIString(nameobj, "pool_grows") == 0)
+            return PyLong_FromUnsignedLong(XML_GetPoolGrowCount(self->parser));
+        else if (PyUnicode_CompareWithASCIIString(nameobj, "buffer_stats") == 0) {
+            unsigned long moved, allocs;
+            XML_GetBufferStats(self->parser, &moved, &allocs);
+            return Py_BuildValue("(kk)", moved, allocs);
+        }
         else
             goto generic;
 
@@ -3614,6 +4751,587 @@ static PyTypeObject XMLParser_Type = {
     0,                                              /* tp_free */
 };
 
+/* ==================================================================== */
+/* the iterparse type */
+
+/* default number of bytes read from the source per parser feed */
+#define ITERPARSE_CHUNK_SIZE (64*1024)
+
+typedef struct {
+    PyObject_HEAD
+
+    PyObject *file; /* source file object */
+    PyObject *reader; /* bound read method of the source */
+    int close_file; /* true if we opened the source ourselves */
+
+    XMLParserObject *parser; /* NULL once the document is done */
+    TreeBuilderObject *target; /* the parser's tree builder */
+
+    PyObject *root; /* root element, once the parser is closed */
+
+    /* delayed parse error; reported once pending events are consumed */
+    PyObject *error_type;
+    PyObject *error_value;
+    PyObject *error_traceback;
+
+    Py_ssize_t chunk_size; /* bytes per read() call */
+
+    int clear; /* detach elements from the tree once consumed */
+    PyObject *consumed; /* element of the last consumed "end" event */
+    PyObject *consumed_parent; /* and its parent */
+
+} IterParseObject;
+
+static PyTypeObject IterParse_Type;
+
+LOCAL(void)
+iterparse_release_consumed(IterParseObject* self)
+{
+    /* in clear mode, detach the element of the last consumed "end" event
+       from its parent, so that memory use stays bounded */
+
+    PyObject* elem = self->consumed;
+    PyObject* parent = self->consumed_parent;
+
+    self->consumed = self->consumed_parent = NULL;
+
+    if (!elem)
+        return;
+
+    if (parent && Element_CheckExact(parent)) {
+        ElementObjectExtra* extra = ((ElementObject*) parent)->extra;
+        if (extra) {
+            int i;
+            ELEMENT_MUTATED();
+            /* consumed children are dropped as we go, so the element is
+               normally found right away */
+            for (i = 0; i < extra->length; i++) {
+                if (extra->children[i] == elem) {
+                    extra->length--;
+                    memmove(extra->children + i, extra->children + i + 1,
+                            (extra->length - i) * sizeof(PyObject*));
+                    Py_DECREF(elem);
+                    break;
+                }
+            }
+        }
+    }
+
+    Py_DECREF(elem);
+    Py_XDECREF(parent);
+}
+
+static PyObject *
+iterparse_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"source", "events", "chunk_size", "clear",
+                             "tags", "attrib", "skip", 0};
+    PyObject *source;
+    PyObject *events = Py_None;
+    Py_ssize_t chunk_size = ITERPARSE_CHUNK_SIZE;
+    int clear = 0;
+    PyObject *tags = Py_None;
+    PyObject *attrib = Py_None;
+    int skip = 0;
+    IterParseObject *self;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OniOOi:iterparse", kwlist,
+                                     &source, &events, &chunk_size, &clear,
+                                     &tags, &attrib, &skip))
+        return NULL;
+
+    if (chunk_size <= 0 || chunk_size > INT_MAX) {
+        PyErr_SetString(PyExc_ValueError, "chunk_size out of range");
+        return NULL;
+    }
+
+    self = (IterParseObject *)type->tp_alloc(type, 0);
+    if (!self)
+        return NULL;
+
+    self->chunk_size = chunk_size;
+    self->clear = clear;
+
+    if (!PyObject_HasAttrString(source, "read")) {
+        PyObject* io = PyImport_ImportModule("io");
+        if (!io)
+            goto error;
+        self->file = PyObject_CallMethod(io, "open", "Os", source, "rb");
+        Py_DECREF(io);
+        if (!self->file)
+            goto error;
+        self->close_file = 1;
+    } else {
+        Py_INCREF(source);
+        self->file = source;
+    }
+
+    self->reader = PyObject_GetAttrString(self->file, "read");
+    if (!self->reader)
+        goto error;
+
+    self->parser = (XMLParserObject*) PyObject_CallFunctionObjArgs(
+        (PyObject*) &XMLParser_Type, NULL);
+    if (!self->parser)
+        goto error;
+
+    Py_INCREF(self->parser->target);
+    self->target = (TreeBuilderObject*) self->parser->target;
+
+    if (xmlparser_setevents_impl(self->parser, NULL, events) < 0)
+        goto error;
+
+    if (treebuilder_set_filter(self->target, tags, attrib, skip) < 0)
+        goto error;
+
+    Py_INCREF(Py_None);
+    self->root = Py_None;
+
+    return (PyObject *)self;
+
+  error:
+    if (self->close_file && self->file) {
+        PyObject* res = PyObject_CallMethod(self->file, "close", NULL);
+        Py_XDECREF(res);
+    }
+    Py_DECREF(self);
+    return NULL;
+}
+
+static int
+iterparse_gc_traverse(IterParseObject *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->file);
+    Py_VISIT(self->reader);
+    Py_VISIT(self->parser);
+    Py_VISIT(self->target);
+    Py_VISIT(self->root);
+    Py_VISIT(self->error_type);
+    Py_VISIT(self->error_value);
+    Py_VISIT(self->error_traceback);
+    Py_VISIT(self->consumed);
+    Py_VISIT(self->consumed_parent);
+    return 0;
+}
+
+static int
+iterparse_gc_clear(IterParseObject *self)
+{
+    Py_CLEAR(self->consumed_parent);
+    Py_CLEAR(self->consumed);
+    Py_CLEAR(self->error_traceback);
+    Py_CLEAR(self->error_value);
+    Py_CLEAR(self->error_type);
+    Py_CLEAR(self->root);
+    Py_CLEAR(self->target);
+    Py_CLEAR(self->parser);
+    Py_CLEAR(self->reader);
+    Py_CLEAR(self->file);
+    return 0;
+}
+
+static void
+iterparse_dealloc(IterParseObject *self)
+{
+    PyObject_GC_UnTrack(self);
+    iterparse_gc_clear(self);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+LOCAL(int)
+iterparse_feed(IterParseObject* self)
+{
+    /* read the next chunk from the source and feed it to the parser,
+       closing the parser at end of input.  parse errors are stored, to
+       be reported once the events produced before them are consumed.
+       returns -1 if reading the source fails */
+
+    PyObject* buffer;
+    PyObject* res;
+
+    buffer = PyObject_CallFunction(self->reader, "n", self->chunk_size);
+    if (!buffer)
+        return -1;
+
+    if (PyUnicode_CheckExact(buffer)) {
+        /* A unicode object is encoded into bytes using UTF-8 */
+        PyObject* temp;
+        if (PyUnicode_GET_LENGTH(buffer) == 0) {
+            Py_DECREF(buffer);
+            buffer = NULL;
+        } else {
+            temp = PyUnicode_AsEncodedString(buffer, "utf-8", "surrogatepass");
+            Py_DECREF(buffer);
+            if (!temp)
+                return -1;
+            buffer = temp;
+        }
+    }
+    else if (!PyBytes_CheckExact(buffer) || PyBytes_GET_SIZE(buffer) == 0) {
+        Py_DECREF(buffer);
+        buffer = NULL;
+    }
+
+    if (buffer) {
+        res = expat_parse(
+            self->parser, PyBytes_AS_STRING(buffer),
+            (int) PyBytes_GET_SIZE(buffer), 0
+            );
+        Py_DECREF(buffer);
+    } else {
+        res = expat_parse(self->parser, "", 0, 1);
+        if (res) {
+            Py_DECREF(res);
+            res = treebuilder_done(self->target);
+            if (res) {
+                Py_DECREF(self->root);
+                self->root = res;
+                Py_INCREF(res);
+            }
+        }
+        Py_CLEAR(self->parser);
+    }
+
+    if (!res)
+        PyErr_Fetch(&self->error_type, &self->error_value,
+                    &self->error_traceback);
+    else
+        Py_DECREF(res);
+
+    return 0;
+}
+
+static PyObject*
+iterparse_iternext(IterParseObject* self)
+{
+    EventItem event;
+    PyObject* res;
+
+    if (self->clear)
+        iterparse_release_consumed(self);
+
+    for (;;) {
+        if (self->target && treebuilder_pop_event(self->target, &event)) {
+            res = PyTuple_Pack(2, event.action, event.item);
+            if (res && self->clear && event.parent) {
+                /* keep a hold on the element until the next call */
+                self->consumed = event.item;
+                self->consumed_parent = event.parent;
+            } else {
+                Py_DECREF(event.item);
+                Py_XDECREF(event.parent);
+            }
+            Py_DECREF(event.action);
+            return res;
+        }
+
+        if (self->error_type) {
+            PyErr_Restore(self->error_type, self->error_value,
+                          self->error_traceback);
+            self->error_type = self->error_value = NULL;
+            self->error_traceback = NULL;
+            return NULL;
+        }
+
+        if (!self->parser) {
+            /* all done; drop the builder and close the source */
+            Py_CLEAR(self->target);
+            if (self->close_file && self->file) {
+                self->close_file = 0;
+                res = PyObject_CallMethod(self->file, "close", NULL);
+                if (!res)
+                    return NULL;
+                Py_DECREF(res);
+            }
+            return NULL;
+        }
+
+        if (iterparse_feed(self) < 0)
+            return NULL;
+    }
+}
+
+static PyMemberDef iterparse_members[] = {
+    {"root", T_OBJECT, offsetof(IterParseObject, root), READONLY},
+    {"chunk_size", T_PYSSIZET, offsetof(IterParseObject, chunk_size), READONLY},
+    {NULL}
+};
+
+static PyTypeObject IterParse_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "cElementTree.iterparse", sizeof(IterParseObject), 0,
+    /* methods */
+    (destructor)iterparse_dealloc,                  /* tp_dealloc */
+    0,                                              /* tp_print */
+    0,                                              /* tp_getattr */
+    0,                                              /* tp_setattr */
+    0,                                              /* tp_reserved */
+    0,                                              /* tp_repr */
+    0,                                              /* tp_as_number */
+    0,                                              /* tp_as_sequence */
+    0,                                              /* tp_as_mapping */
+    0,                                              /* tp_hash */
+    0,                                              /* tp_call */
+    0,                                              /* tp_str */
+    0,                                              /* tp_getattro */
+    0,                                              /* tp_setattro */
+    0,                                              /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,        /* tp_flags */
+    0,                                              /* tp_doc */
+    (traverseproc)iterparse_gc_traverse,            /* tp_traverse */
+    (inquiry)iterparse_gc_clear,                    /* tp_clear */
+    0,                                              /* tp_richcompare */
+    0,                                              /* tp_weaklistoffset */
+    PyObject_SelfIter,                              /* tp_iter */
+    (iternextfunc)iterparse_iternext,               /* tp_iternext */
+    0,                                              /* tp_methods */
+    iterparse_members,                              /* tp_members */
+    0,                                              /* tp_getset */
+    0,                                              /* tp_base */
+    0,                                              /* tp_dict */
+    0,                                              /* tp_descr_get */
+    0,                                              /* tp_descr_set */
+    0,                                              /* tp_dictoffset */
+    0,                                              /* tp_init */
+    PyType_GenericAlloc,                            /* tp_alloc */
+    iterparse_new,                                  /* tp_new */
+    0,                                              /* tp_free */
+};
+
+
+/* -------------------------------------------------------------------- */
+/* incremental reparse */
+
+LOCAL(PyObject*)
+reparse_getbytes(PyObject* obj, const char* what)
+{
+    if (PyBytes_Check(obj)) {
+        Py_INCREF(obj);
+        return obj;
+    }
+    if (PyUnicode_Check(obj))
+        return PyUnicode_AsUTF8String(obj);
+    PyErr_Format(PyExc_TypeError, "%s must be bytes or str", what);
+    return NULL;
+}
+
+LOCAL(Py_ssize_t)
+reparse_find_close(const char* buf, Py_ssize_t pos, Py_ssize_t end)
+{
+    /* find the '>' closing the tag at pos, or -1 */
+
+    char quote = 0;
+
+    for (; pos < end; pos++) {
+        char c = buf[pos];
+        if (quote) {
+            if (c == quote)
+                quote = 0;
+        } else if (c == '"' || c == '\'')
+            quote = c;
+        else if (c == '>')
+            return pos;
+    }
+    return -1;
+}
+
+LOCAL(Py_ssize_t)
+reparse_absorbs(ElementIndexEntry* entry, const char* buf, Py_ssize_t size,
+                Py_ssize_t offset, Py_ssize_t removed, Py_ssize_t delta)
+{
+    /* check that the edit lies within the content of an element, leaving
+       both its tags alone.  returns the end of the element in the new
+       buffer, or -1 if it cannot absorb the edit */
+
+    Py_ssize_t pos;
+
+    if (entry->start >= offset || offset + removed > entry->end_tag)
+        return -1;
+
+    /* start tag ends before the edit, and isn't an empty element tag */
+    pos = reparse_find_close(buf, entry->start, offset);
+    if (pos < 0 || buf[pos - 1] == '/')
+        return -1;
+
+    /* the end tag is where it was, give or take the edit */
+    pos = entry->end_tag + delta;
+    if (pos + 1 >= size || buf[pos] != '<' || buf[pos + 1] != '/')
+        return -1;
+    pos = reparse_find_close(buf, pos, size);
+    if (pos < 0)
+        return -1;
+
+    return pos + 1;
+}
+
+LOCAL(PyObject*)
+reparse_parse(const char* data, Py_ssize_t size)
+{
+    /* parse a complete document with a new parser, and return its root */
+
+    XMLParserObject* parser;
+    PyObject* res;
+
+    if (size > INT_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "buffer too large");
+        return NULL;
+    }
+
+    parser = (XMLParserObject*) PyObject_CallObject(
+        (PyObject*) &XMLParser_Type, NULL
+        );
+    if (!parser)
+        return NULL;
+
+    res = expat_parse(parser, (char*) data, (int) size, 1);
+    if (res) {
+        Py_DECREF(res);
+        res = treebuilder_done((TreeBuilderObject*) parser->target);
+    }
+
+    Py_DECREF(parser);
+    return res;
+}
+
+static PyObject*
+reparse(PyObject* self_, PyObject* args)
+{
+    /* update a document tree after an edit.  the smallest element whose
+       content holds the whole edit is parsed again and spliced into the
+       tree, and the positions of everything after it are moved.  if no
+       such element exists, or the element doesn't parse on its own, the
+       whole buffer is parsed again.  returns the (possibly new) root */
+
+    ElementObject* root;
+    ElementObject* elem = NULL;
+    ElementObject* parent = NULL;
+    ElementObject* subtree;
+    ElementIndex* index;
+    ElementPosition start, end, newend;
+    PositionShift shift;
+    PyObject* inserted_in;
+    PyObject* buffer_in;
+    PyObject* inserted = NULL;
+    PyObject* buffer = NULL;
+    PyObject* res = NULL;
+    const char* buf;
+    Py_ssize_t offset, removed, delta, size, fragend = -1;
+    Py_ssize_t i, j, k = 0;
+
+    if (!PyArg_ParseTuple(args, "O!nnOO:reparse", &Element_Type, &root,
+                          &offset, &removed, &inserted_in, &buffer_in))
+        return NULL;
+
+    inserted = reparse_getbytes(inserted_in, "inserted text");
+    if (!inserted)
+        goto done;
+    buffer = reparse_getbytes(buffer_in, "buffer");
+    if (!buffer)
+        goto done;
+
+    buf = PyBytes_AS_STRING(buffer);
+    size = PyBytes_GET_SIZE(buffer);
+    delta = PyBytes_GET_SIZE(inserted) - removed;
+
+    if (offset < 0 || removed < 0 ||
+        offset + PyBytes_GET_SIZE(inserted) > size ||
+        memcmp(buf + offset, PyBytes_AS_STRING(inserted),
+               PyBytes_GET_SIZE(inserted)) != 0) {
+        PyErr_SetString(PyExc_ValueError, "edit doesn't match buffer");
+        goto done;
+    }
+
+    index = element_get_index(root);
+    if (!index)
+        goto done;
+
+    /* innermost element around the edit that can absorb it, and that is
+       a direct child of the enclosing indexed element */
+    i = element_index_search(index, offset) - 1;
+    while (i >= 0 && index->entries[i].parent >= 0) {
+        fragend = reparse_absorbs(&index->entries[i], buf, size,
+                                  offset, removed, delta);
+        if (fragend >= 0) {
+            elem = (ElementObject*) index->entries[i].element;
+            parent = (ElementObject*) index->entries[
+                index->entries[i].parent].element;
+            for (k = 0; k < parent->extra->length; k++)
+                if (parent->extra->children[k] == (PyObject*) elem)
+                    break;
+            if (k < parent->extra->length)
+                break;
+        }
+        i = index->entries[i].parent;
+    }
+
+    if (i < 0 || index->entries[i].parent < 0 ||
+        !element_position_read(elem, 0, &start) ||
+        !element_position_read(elem, 1, &end)) {
+        res = reparse_parse(buf, size);
+        goto done;
+    }
+
+    subtree = (ElementObject*) reparse_parse(buf + start.bytePos,
+                                             fragend - start.bytePos);
+    if (!subtree || !Element_CheckExact(subtree)) {
+        /* e.g. prefixes or entities declared outside the element */
+        Py_XDECREF(subtree);
+        PyErr_Clear();
+        res = reparse_parse(buf, size);
+        goto done;
+    }
+
+    /* everything from here on changes the tree; the index entries stay
+       usable until the spliced out element is released below */
+    ELEMENT_MUTATED();
+
+    /* move the new subtree into place */
+    shift.line = 1;
+    shift.col = start.col;
+    shift.lines = start.line - 1;
+    shift.bytes = start.bytePos;
+    element_shift_subtree(subtree, &shift);
+
+    /* everything after the element moves along with its end tag */
+    if (!element_position_read(subtree, 1, &newend))
+        newend = end;
+    shift.line = end.line;
+    shift.col = newend.col - end.col;
+    shift.lines = newend.line - end.line;
+    shift.bytes = delta;
+
+    for (j = index->entries[i].parent; j >= 0; j = index->entries[j].parent)
+        element_shift_position((ElementObject*) index->entries[j].element,
+                               1, &shift);
+    for (j = i + 1; j < index->length; j++)
+        if (index->entries[j].start > end.bytePos) {
+            ElementObject* later = (ElementObject*) index->entries[j].element;
+            element_shift_position(later, 0, &shift);
+            element_shift_position(later, 1, &shift);
+        }
+
+    /* splice it in */
+    Py_INCREF(JOIN_OBJ(elem->tail));
+    Py_DECREF(JOIN_OBJ(subtree->tail));
+    subtree->tail = elem->tail;
+
+    parent->extra->children[k] = (PyObject*) subtree;
+    Py_DECREF(elem);
+
+    dealloc_index(subtree->extra->index);
+    subtree->extra->index = NULL;
+
+    if (element_build_index(root)) {
+        Py_INCREF(root);
+        res = (PyObject*) root;
+    }
+
+  done:
+    Py_XDECREF(inserted);
+    Py_XDECREF(buffer);
+    return res;
+}
+
 #endif
 
 /* ==================================================================== */
@@ -3621,6 +5339,9 @@ static PyTypeObject XMLParser_Type = {
 
 static PyMethodDef _functions[] = {
     {"SubElement", (PyCFunction) subelement, METH_VARARGS | METH_KEYWORDS},
+#if defined(USE_EXPAT)
+    {"reparse", (PyCFunction) reparse, METH_VARARGS},
+#endif
     {NULL, NULL}
 };
 
@@ -3651,6 +5372,10 @@ PyInit__cElementTree(void)
 #if defined(USE_EXPAT)
     if (PyType_Ready(&XMLParser_Type) < 0)
         return NULL;
+    if (PyType_Ready(&IterParse_Type) < 0)
+        return NULL;
+    if (PyType_Ready(&DTD_Type) < 0)
+        return NULL;
 #endif
 
     m = PyModule_Create(&cElementTreemodule);
@@ -3741,55 +5466,6 @@ PyInit__cElementTree(void)
         "  return tree\n"
         "cElementTree.parse = parse\n"
 
-        "class iterparse(object):\n"
-        " root = None\n"
-        " def __init__(self, file, events=None):\n"
-        "  self._close_file = False\n"
-        "  if not hasattr(file, 'read'):\n"
-        "    file = open(file, 'rb')\n"
-        "    self._close_file = True\n"
-        "  self._file = file\n"
-        "  self._events = []\n"
-        "  self._index = 0\n"
-        "  self._error = None\n"
-        "  self.root = self._root = None\n"
-        "  b = cElementTree.TreeBuilder()\n"
-        "  self._parser = cElementTree.XMLParser(b)\n"
-        "  self._parser._setevents(self._events, events)\n"
-        " def __next__(self):\n"
-        "  while True:\n"
-        "    try:\n"
-        "      item = self._events[self._index]\n"
-        "      self._index += 1\n"
-        "      return item\n"
-        "    except IndexError:\n"
-        "      pass\n"
-        "    if self._error:\n"
-        "      e = self._error\n"
-        "      self._error = None\n"
-        "      raise e\n"
-        "    if self._parser is None:\n"
-        "      self.root = self._root\n"
-        "      if self._close_file:\n"
-        "        self._file.close()\n"
-        "      raise StopIteration\n"
-        "    # load event buffer\n"
-        "    del self._events[:]\n"
-        "    self._index = 0\n"
-        "    data = self._file.read(16384)\n"
-        "    if data:\n"
-        "      try:\n"
-        "        self._parser.feed(data)\n"
-        "      except SyntaxError as exc:\n"
-        "        self._error = exc\n"
-        "    else:\n"
-        "      self._root = self._parser.close()\n"
-        "      self._parser = None\n"
-        " next = __next__\n"
-        " def __iter__(self):\n"
-        "  return self\n"
-        "cElementTree.iterparse = iterparse\n"
-
         "class PIProxy:\n"
         " def __call__(self, target, text=None):\n"
         "  element = cElementTree.Element(ET.PI)\n"
@@ -3887,6 +5563,12 @@ PyInit__cElementTree(void)
 #if defined(USE_EXPAT)
     Py_INCREF((PyObject *)&XMLParser_Type);
     PyModule_AddObject(m, "XMLParser", (PyObject *)&XMLParser_Type);
+
+    Py_INCREF((PyObject *)&IterParse_Type);
+    PyModule_AddObject(m, "iterparse", (PyObject *)&IterParse_Type);
+
+    Py_INCREF((PyObject *)&DTD_Type);
+    PyModule_AddObject(m, "DTD", (PyObject *)&DTD_Type);
 #endif
 
     return m;
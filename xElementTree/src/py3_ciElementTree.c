@@ -105,6 +105,8 @@ static PyObject* elementtree_parseerror_obj;
 static PyObject* elementtree_deepcopy_obj;
 static PyObject* elementtree_iter_obj;
 static PyObject* elementtree_itertext_obj;
+static PyObject* elementtree_tostring_obj;
+static PyObject* elementtree_dump_obj;
 static PyObject* elementpath_obj;
 
 /* helpers */
@@ -1888,6 +1890,369 @@ element_ass_subscr(PyObject* self_, PyObject* item, PyObject* value)
     }
 }
 
+/* -------------------------------------------------------------------- */
+/* json encoder: writes a tree in the format used by "codeintel json",
+   i.e. what json.dump() writes for
+
+       {root.tag: {"children": [...]}}
+
+   where each element becomes {"name": ..., "tag": ..., <attributes>,
+   "children": [...]}, without building the intermediate dictionaries */
+
+typedef struct {
+    _PyUnicodeWriter buffer;
+    PyObject* write; /* stream.write */
+    PyObject* indent; /* indent unit, or NULL for a single line */
+} JSONWriter;
+
+#define JSON_CHUNK_SIZE 65536
+
+LOCAL(int)
+json_flush(JSONWriter* self)
+{
+    PyObject* chunk;
+    PyObject* res;
+
+    if (!self->buffer.pos)
+        return 0;
+
+    chunk = _PyUnicodeWriter_Finish(&self->buffer);
+    _PyUnicodeWriter_Init(&self->buffer);
+    self->buffer.overallocate = 1;
+    if (!chunk)
+        return -1;
+
+    res = PyObject_CallFunctionObjArgs(self->write, chunk, NULL);
+    Py_DECREF(chunk);
+    if (!res)
+        return -1;
+    Py_DECREF(res);
+    return 0;
+}
+
+LOCAL(int)
+json_newline(JSONWriter* self, int level)
+{
+    /* item separator whitespace; nothing at all on a single line */
+
+    int i;
+
+    if (!self->indent)
+        return 0;
+    if (_PyUnicodeWriter_WriteChar(&self->buffer, '\n') < 0)
+        return -1;
+    for (i = 0; i < level; i++)
+        if (_PyUnicodeWriter_WriteStr(&self->buffer, self->indent) < 0)
+            return -1;
+    return 0;
+}
+
+LOCAL(int)
+json_comma(JSONWriter* self, int level)
+{
+    if (self->indent) {
+        if (_PyUnicodeWriter_WriteChar(&self->buffer, ',') < 0)
+            return -1;
+        return json_newline(self, level);
+    }
+    return _PyUnicodeWriter_WriteASCIIString(&self->buffer, ", ", 2);
+}
+
+LOCAL(int)
+json_string(JSONWriter* self, PyObject* text)
+{
+    /* same escaping as json.dump() with ensure_ascii */
+
+    static const char hex[] = "0123456789abcdef";
+    _PyUnicodeWriter* writer = &self->buffer;
+    Py_ssize_t i, start, length;
+    int kind;
+    void* data;
+    char escape[12];
+    Py_UCS4 ch;
+
+    if (PyUnicode_READY(text) < 0)
+        return -1;
+
+    kind = PyUnicode_KIND(text);
+    data = PyUnicode_DATA(text);
+    length = PyUnicode_GET_LENGTH(text);
+
+    if (_PyUnicodeWriter_WriteChar(writer, '"') < 0)
+        return -1;
+
+    for (i = start = 0; i < length; i++) {
+        ch = PyUnicode_READ(kind, data, i);
+        if (ch >= ' ' && ch <= '~' && ch != '"' && ch != '\\')
+            continue;
+        if (i > start &&
+            _PyUnicodeWriter_WriteSubstring(writer, text, start, i) < 0)
+            return -1;
+        start = i + 1;
+        escape[0] = '\\';
+        switch (ch) {
+        case '"': case '\\': escape[1] = (char) ch; break;
+        case '\n': escape[1] = 'n'; break;
+        case '\r': escape[1] = 'r'; break;
+        case '\t': escape[1] = 't'; break;
+        case '\b': escape[1] = 'b'; break;
+        case '\f': escape[1] = 'f'; break;
+        default:
+            if (ch >= 0x10000) {
+                /* surrogate pair */
+                Py_UCS4 high = 0xd800 | ((ch - 0x10000) >> 10);
+                escape[1] = 'u';
+                escape[2] = hex[(high >> 12) & 0xf];
+                escape[3] = hex[(high >> 8) & 0xf];
+                escape[4] = hex[(high >> 4) & 0xf];
+                escape[5] = hex[high & 0xf];
+                if (_PyUnicodeWriter_WriteASCIIString(writer, escape, 6) < 0)
+                    return -1;
+                ch = 0xdc00 | ((ch - 0x10000) & 0x3ff);
+            }
+            escape[1] = 'u';
+            escape[2] = hex[(ch >> 12) & 0xf];
+            escape[3] = hex[(ch >> 8) & 0xf];
+            escape[4] = hex[(ch >> 4) & 0xf];
+            escape[5] = hex[ch & 0xf];
+            if (_PyUnicodeWriter_WriteASCIIString(writer, escape, 6) < 0)
+                return -1;
+            continue;
+        }
+        if (_PyUnicodeWriter_WriteASCIIString(writer, escape, 2) < 0)
+            return -1;
+    }
+    if (i > start &&
+        _PyUnicodeWriter_WriteSubstring(writer, text, start, i) < 0)
+        return -1;
+
+    return _PyUnicodeWriter_WriteChar(writer, '"');
+}
+
+LOCAL(int)
+json_value(JSONWriter* self, PyObject* value)
+{
+    PyObject* text;
+    int ok;
+
+    if (PyUnicode_Check(value))
+        return json_string(self, value);
+    if (value == Py_None)
+        return _PyUnicodeWriter_WriteASCIIString(&self->buffer, "null", 4);
+    if (value == Py_True)
+        return _PyUnicodeWriter_WriteASCIIString(&self->buffer, "true", 4);
+    if (value == Py_False)
+        return _PyUnicodeWriter_WriteASCIIString(&self->buffer, "false", 5);
+    if (PyLong_Check(value)) {
+        text = PyLong_Type.tp_repr(value);
+        if (!text)
+            return -1;
+        ok = _PyUnicodeWriter_WriteStr(&self->buffer, text);
+        Py_DECREF(text);
+        return ok;
+    }
+    PyErr_Format(PyExc_TypeError, "Object of type '%.200s' is not JSON "
+                 "serializable", Py_TYPE(value)->tp_name);
+    return -1;
+}
+
+LOCAL(int)
+json_item(JSONWriter* self, const char* key, PyObject* value)
+{
+    /* writes "key": value */
+
+    if (_PyUnicodeWriter_WriteChar(&self->buffer, '"') < 0 ||
+        _PyUnicodeWriter_WriteASCIIString(&self->buffer, key,
+                                          strlen(key)) < 0 ||
+        _PyUnicodeWriter_WriteASCIIString(&self->buffer, "\": ", 3) < 0)
+        return -1;
+    return json_value(self, value);
+}
+
+LOCAL(int)
+json_children(JSONWriter* self, ElementObject* element, int level);
+
+LOCAL(int)
+json_element(JSONWriter* self, PyObject* element_, int level)
+{
+    ElementObject* element = (ElementObject*) element_;
+    PyObject* attrib = Py_None;
+    PyObject* name = NULL;
+    PyObject* tag = element->tag;
+    PyObject* key;
+    PyObject* value;
+    Py_ssize_t pos;
+
+    if (!Element_CheckExact(element_)) {
+        PyErr_SetString(PyExc_TypeError, "expected an Element");
+        return -1;
+    }
+
+    /* "name" and "tag" come first; attributes of the same name replace
+       their values in place */
+    if (element->extra && element->extra->attrib != Py_None) {
+        attrib = element->extra->attrib;
+        if (!PyDict_Check(attrib)) {
+            PyErr_SetString(PyExc_TypeError, "attrib must be a dict");
+            return -1;
+        }
+        name = PyDict_GetItemString(attrib, "name");
+        if (name == Py_None)
+            name = NULL; /* not moved to the front, as by get() */
+        value = PyDict_GetItemString(attrib, "tag");
+        if (value)
+            tag = value;
+        if (element->extra->length &&
+            PyDict_GetItemString(attrib, "children")) {
+            PyErr_SetString(PyExc_ValueError,
+                            "element with children has a 'children' "
+                            "attribute");
+            return -1;
+        }
+    }
+
+    if (_PyUnicodeWriter_WriteChar(&self->buffer, '{') < 0 ||
+        json_newline(self, level + 1) < 0)
+        return -1;
+    if (name && (json_item(self, "name", name) < 0 ||
+                 json_comma(self, level + 1) < 0))
+        return -1;
+    if (json_item(self, "tag", tag) < 0)
+        return -1;
+
+    if (attrib != Py_None) {
+        pos = 0;
+        while (PyDict_Next(attrib, &pos, &key, &value)) {
+            if (!PyUnicode_Check(key)) {
+                PyErr_SetString(PyExc_TypeError,
+                                "attribute names must be str");
+                return -1;
+            }
+            if ((name && PyUnicode_CompareWithASCIIString(key, "name") == 0) ||
+                PyUnicode_CompareWithASCIIString(key, "tag") == 0)
+                continue;
+            if (json_comma(self, level + 1) < 0 ||
+                json_string(self, key) < 0 ||
+                _PyUnicodeWriter_WriteASCIIString(&self->buffer, ": ", 2) < 0 ||
+                json_value(self, value) < 0)
+                return -1;
+        }
+    }
+
+    if (element->extra && element->extra->length) {
+        if (json_comma(self, level + 1) < 0 ||
+            json_children(self, element, level + 1) < 0)
+            return -1;
+    }
+
+    if (json_newline(self, level) < 0 ||
+        _PyUnicodeWriter_WriteChar(&self->buffer, '}') < 0)
+        return -1;
+
+    if (self->buffer.pos >= JSON_CHUNK_SIZE)
+        return json_flush(self);
+    return 0;
+}
+
+LOCAL(int)
+json_children(JSONWriter* self, ElementObject* element, int level)
+{
+    /* writes "children": [...] */
+
+    int i;
+
+    if (_PyUnicodeWriter_WriteASCIIString(&self->buffer,
+                                          "\"children\": [", 13) < 0 ||
+        json_newline(self, level + 1) < 0)
+        return -1;
+    for (i = 0; i < element->extra->length; i++) {
+        if (i && json_comma(self, level + 1) < 0)
+            return -1;
+        if (Py_EnterRecursiveCall(" while encoding an element to JSON"))
+            return -1;
+        if (json_element(self, element->extra->children[i], level + 1) < 0) {
+            Py_LeaveRecursiveCall();
+            return -1;
+        }
+        Py_LeaveRecursiveCall();
+    }
+    if (json_newline(self, level) < 0 ||
+        _PyUnicodeWriter_WriteChar(&self->buffer, ']') < 0)
+        return -1;
+    return 0;
+}
+
+static PyObject*
+element_to_json(ElementObject* self, PyObject* args, PyObject* kwds)
+{
+    static char* kwlist[] = {"stream", "indent", 0};
+    JSONWriter writer;
+    PyObject* stream;
+    PyObject* indent = Py_None;
+    int ok = -1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O:to_json", kwlist,
+                                     &stream, &indent))
+        return NULL;
+
+    _PyUnicodeWriter_Init(&writer.buffer);
+    writer.buffer.overallocate = 1;
+    writer.indent = NULL;
+    writer.write = PyObject_GetAttrString(stream, "write");
+    if (!writer.write)
+        return NULL;
+
+    /* like json.dump(), an integer indent means that many spaces */
+    if (PyLong_Check(indent)) {
+        Py_ssize_t n = PyLong_AsSsize_t(indent);
+        if (n == -1 && PyErr_Occurred())
+            goto done;
+        writer.indent = PyUnicode_New(n > 0 ? n : 0, ' ');
+        if (!writer.indent)
+            goto done;
+        if (n > 0)
+            memset(PyUnicode_1BYTE_DATA(writer.indent), ' ', n);
+    } else if (PyUnicode_Check(indent)) {
+        Py_INCREF(indent);
+        writer.indent = indent;
+    } else if (indent != Py_None) {
+        PyErr_SetString(PyExc_TypeError, "indent must be an int, a str or "
+                        "None");
+        goto done;
+    }
+
+    if (!PyUnicode_Check(self->tag)) {
+        PyErr_SetString(PyExc_TypeError, "tag must be a str");
+        goto done;
+    }
+
+    if (_PyUnicodeWriter_WriteChar(&writer.buffer, '{') < 0 ||
+        json_newline(&writer, 1) < 0 ||
+        json_string(&writer, self->tag) < 0 ||
+        _PyUnicodeWriter_WriteASCIIString(&writer.buffer, ": {", 3) < 0)
+        goto done;
+    if (self->extra && self->extra->length) {
+        if (json_newline(&writer, 2) < 0 ||
+            json_children(&writer, self, 2) < 0 ||
+            json_newline(&writer, 1) < 0)
+            goto done;
+    }
+    if (_PyUnicodeWriter_WriteChar(&writer.buffer, '}') < 0 ||
+        json_newline(&writer, 0) < 0 ||
+        _PyUnicodeWriter_WriteChar(&writer.buffer, '}') < 0)
+        goto done;
+
+    ok = json_flush(&writer);
+
+  done:
+    _PyUnicodeWriter_Dealloc(&writer.buffer);
+    Py_DECREF(writer.write);
+    Py_XDECREF(writer.indent);
+    if (ok < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
 static PyMethodDef element_methods[] = {
 
     {"clear", (PyCFunction) element_clearmethod, METH_VARARGS},
@@ -1916,6 +2281,8 @@ static PyMethodDef element_methods[] = {
 
     {"makeelement", (PyCFunction) element_makeelement, METH_VARARGS},
 
+    {"to_json", (PyCFunction) element_to_json, METH_VARARGS | METH_KEYWORDS},
+
     {"__copy__", (PyCFunction) element_copy, METH_VARARGS},
     {"__deepcopy__", (PyCFunction) element_deepcopy, METH_VARARGS},
     {"__sizeof__", element_sizeof, METH_NOARGS},
@@ -2079,6 +2446,23 @@ static PyTypeObject Element_Type = {
 /* ==================================================================== */
 /* the tree builder type */
 
+/* an entry in the tree builder's event ring buffer.  events are kept as
+   (action, item) pairs and only turned into tuples when consumed; for
+   "end" events, the parent of the closed element is kept as well so
+   that iterparse can detach consumed subtrees. */
+typedef struct {
+    PyObject* action; /* event name object */
+    PyObject* item; /* element, (prefix, uri) tuple, or None */
+    PyObject* parent; /* parent element ("end" events only), or NULL */
+} EventItem;
+
+/* initial size of the event ring buffer (must be a power of two) */
+#define EVENT_RING_SIZE 64
+
+/* per open element flags kept on the tree builder's filter stack */
+#define FILTER_MATCH 1 /* element matches the filter; report its events */
+#define FILTER_BUILT 2 /* element was materialized */
+
 typedef struct {
     PyObject_HEAD
 
@@ -2100,6 +2484,24 @@ typedef struct {
     PyObject *end_event_obj;
     PyObject *start_ns_event_obj;
     PyObject *end_ns_event_obj;
+
+    /* event ring buffer, used instead of the events list by iterparse */
+    EventItem *ring; /* NULL if not collecting into the ring */
+    Py_ssize_t ring_head; /* index of the oldest pending event */
+    Py_ssize_t ring_length; /* number of pending events */
+    Py_ssize_t ring_allocated; /* ring size (a power of two) */
+
+    /* event filter (iterparse tags/attrib/skip); see
+       treebuilder_filter_start */
+    int filter; /* true if events are filtered */
+    PyObject *filter_tags; /* set of tags to report, or NULL for any tag */
+    PyObject *filter_key; /* raw UTF-8 attribute name (bytes), or NULL */
+    PyObject *filter_value; /* required UTF-8 value (bytes), or NULL */
+    int filter_skip; /* don't build elements that don't match */
+    int filter_drop_data; /* drop data (tail of a skipped element) */
+    char *filter_stack; /* FILTER_* flags for each open element */
+    Py_ssize_t filter_depth;
+    Py_ssize_t filter_allocated;
 } TreeBuilderObject;
 
 static PyTypeObject TreeBuilder_Type;
@@ -2135,6 +2537,14 @@ treebuilder_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
         t->events = NULL;
         t->start_event_obj = t->end_event_obj = NULL;
         t->start_ns_event_obj = t->end_ns_event_obj = NULL;
+
+        t->ring = NULL;
+        t->ring_head = t->ring_length = t->ring_allocated = 0;
+
+        t->filter = t->filter_skip = t->filter_drop_data = 0;
+        t->filter_tags = t->filter_key = t->filter_value = NULL;
+        t->filter_stack = NULL;
+        t->filter_depth = t->filter_allocated = 0;
     }
     return (PyObject *)t;
 }
@@ -2171,12 +2581,56 @@ treebuilder_gc_traverse(TreeBuilderObject *self, visitproc visit, void *arg)
     Py_VISIT(self->data);
     Py_VISIT(self->stack);
     Py_VISIT(self->element_factory);
+    Py_VISIT(self->filter_tags);
+    if (self->ring) {
+        Py_ssize_t i;
+        for (i = 0; i < self->ring_length; i++) {
+            EventItem* event = &self->ring[
+                (self->ring_head + i) & (self->ring_allocated - 1)];
+            Py_VISIT(event->item);
+            Py_VISIT(event->parent);
+        }
+    }
     return 0;
 }
 
+LOCAL(void)
+treebuilder_clear_ring(TreeBuilderObject *self)
+{
+    /* drop all pending events, and release the ring buffer itself */
+
+    EventItem* ring = self->ring;
+    Py_ssize_t i;
+
+    if (!ring)
+        return;
+
+    self->ring = NULL;
+
+    for (i = 0; i < self->ring_length; i++) {
+        EventItem* event = &ring[
+            (self->ring_head + i) & (self->ring_allocated - 1)];
+        Py_DECREF(event->action);
+        Py_DECREF(event->item);
+        Py_XDECREF(event->parent);
+    }
+
+    self->ring_head = self->ring_length = self->ring_allocated = 0;
+
+    PyObject_Free(ring);
+}
+
 static int
 treebuilder_gc_clear(TreeBuilderObject *self)
 {
+    treebuilder_clear_ring(self);
+    if (self->filter_stack) {
+        PyObject_Free(self->filter_stack);
+        self->filter_stack = NULL;
+    }
+    Py_CLEAR(self->filter_value);
+    Py_CLEAR(self->filter_key);
+    Py_CLEAR(self->filter_tags);
     Py_CLEAR(self->end_ns_event_obj);
     Py_CLEAR(self->start_ns_event_obj);
     Py_CLEAR(self->end_event_obj);
@@ -2258,110 +2712,342 @@ treebuilder_add_subelement(PyObject *element, PyObject *child)
 }
 
 /* -------------------------------------------------------------------- */
-/* handlers */
+/* event buffer */
 
-LOCAL(PyObject*)
-treebuilder_handle_start(TreeBuilderObject* self, PyObject* tag,
-                         PyObject* attrib)
+LOCAL(int)
+treebuilder_init_ring(TreeBuilderObject* self)
 {
-    PyObject* node;
-    PyObject* this;
+    /* switch event collection over to the ring buffer */
 
-    if (self->data) {
-        if (self->this == self->last) {
-            if (treebuilder_set_element_text(self->last, self->data))
-                return NULL;
-        }
-        else {
-            if (treebuilder_set_element_tail(self->last, self->data))
-                return NULL;
-        }
-        self->data = NULL;
-    }
+    if (self->ring)
+        return 0;
 
-    if (self->element_factory) {
-        node = PyObject_CallFunction(self->element_factory, "OO", tag, attrib);
-    } else {
-        node = create_new_element(tag, attrib);
-    }
-    if (!node) {
-        return NULL;
+    self->ring = PyObject_Malloc(EVENT_RING_SIZE * sizeof(EventItem));
+    if (!self->ring) {
+        PyErr_NoMemory();
+        return -1;
     }
+    self->ring_head = self->ring_length = 0;
+    self->ring_allocated = EVENT_RING_SIZE;
 
-    this = self->this;
-
-    if (this != Py_None) {
-        if (treebuilder_add_subelement(this, node) < 0)
-            goto error;
-    } else {
-        if (self->root) {
-            PyErr_SetString(
-                elementtree_parseerror_obj,
-                "multiple elements on top level"
-                );
-            goto error;
-        }
-        Py_INCREF(node);
-        self->root = node;
-    }
+    Py_CLEAR(self->events);
 
-    if (self->index < PyList_GET_SIZE(self->stack)) {
-        if (PyList_SetItem(self->stack, self->index, this) < 0)
-            goto error;
-        Py_INCREF(this);
-    } else {
-        if (PyList_Append(self->stack, this) < 0)
-            goto error;
-    }
-    self->index++;
+    return 0;
+}
 
-    Py_DECREF(this);
-    Py_INCREF(node);
-    self->this = node;
+LOCAL(int)
+treebuilder_push_event(TreeBuilderObject* self, PyObject* action,
+                       PyObject* item, PyObject* parent)
+{
+    /* record an event; the ring takes new references to action, item and
+       parent.  returns -1 (with an exception set) if this fails */
 
-    Py_DECREF(self->last);
-    Py_INCREF(node);
-    self->last = node;
+    EventItem* event;
 
-    if (self->start_event_obj) {
-        PyObject* res;
-        PyObject* action = self->start_event_obj;
-        res = PyTuple_Pack(2, action, node);
+    if (!self->ring) {
+        /* legacy list collector (used by _setevents) */
+        PyObject* res = PyTuple_Pack(2, action, item);
         if (res) {
             PyList_Append(self->events, res);
             Py_DECREF(res);
         } else
             PyErr_Clear(); /* FIXME: propagate error */
+        return 0;
     }
 
-    return node;
+    if (self->ring_length == self->ring_allocated) {
+        /* ring is full; double it, unwrapping the pending events so that
+           they start at the beginning of the new buffer */
+        Py_ssize_t size = self->ring_allocated;
+        Py_ssize_t head = self->ring_head;
+        EventItem* ring = PyObject_Malloc(2 * size * sizeof(EventItem));
+        if (!ring) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        memcpy(ring, self->ring + head, (size - head) * sizeof(EventItem));
+        memcpy(ring + size - head, self->ring, head * sizeof(EventItem));
+        PyObject_Free(self->ring);
+        self->ring = ring;
+        self->ring_head = 0;
+        self->ring_allocated = 2 * size;
+    }
 
-  error:
-    Py_DECREF(node);
-    return NULL;
+    event = &self->ring[
+        (self->ring_head + self->ring_length) & (self->ring_allocated - 1)];
+    Py_INCREF(action); event->action = action;
+    Py_INCREF(item); event->item = item;
+    Py_XINCREF(parent); event->parent = parent;
+    self->ring_length++;
+
+    return 0;
 }
 
-LOCAL(PyObject*)
-treebuilder_handle_data(TreeBuilderObject* self, PyObject* data)
+LOCAL(int)
+treebuilder_pop_event(TreeBuilderObject* self, EventItem* event)
 {
-    if (!self->data) {
-        if (self->last == Py_None) {
-            /* ignore calls to data before the first call to start */
-            Py_RETURN_NONE;
-        }
-        /* store the first item as is */
-        Py_INCREF(data); self->data = data;
-    } else {
-        /* more than one item; use a list to collect items */
-        if (PyBytes_CheckExact(self->data) && Py_REFCNT(self->data) == 1 &&
-            PyBytes_CheckExact(data) && PyBytes_GET_SIZE(data) == 1) {
-            /* XXX this code path unused in Python 3? */
-            /* expat often generates single character data sections; handle
-               the most common case by resizing the existing string... */
-            Py_ssize_t size = PyBytes_GET_SIZE(self->data);
-            if (_PyBytes_Resize(&self->data, size + 1) < 0)
-                return NULL;
-            PyBytes_AS_STRING(self->data)[size] = PyBytes_AS_STRING(data)[0];
+    /* move the oldest pending event into *event (the caller takes over
+       the references).  returns 0 if there are no pending events */
+
+    if (!self->ring_length)
+        return 0;
+
+    *event = self->ring[self->ring_head];
+    self->ring_head = (self->ring_head + 1) & (self->ring_allocated - 1);
+    self->ring_length--;
+
+    return 1;
+}
+
+/* -------------------------------------------------------------------- */
+/* event filter */
+
+LOCAL(int)
+treebuilder_filter_start(TreeBuilderObject* self, PyObject* tag,
+                         const char **attrib_in)
+{
+    /* decide what to do with an element that is about to start, and
+       push the resulting FILTER_* flags on the filter stack.  tag is the
+       universal tag name; the attribute predicate is checked against the
+       raw expat attributes, so skipped elements never get an attribute
+       dictionary.  returns the flags, or -1 on error */
+
+    int flags = FILTER_BUILT;
+    int match = 1;
+
+    if (self->filter_tags) {
+        match = PySet_Contains(self->filter_tags, tag);
+        if (match < 0)
+            return -1;
+    }
+
+    if (match && self->filter_key) {
+        const char* key = PyBytes_AS_STRING(self->filter_key);
+        match = 0;
+        for (; attrib_in[0] && attrib_in[1]; attrib_in += 2) {
+            if (strcmp(attrib_in[0], key) == 0) {
+                match = !self->filter_value ||
+                    strcmp(attrib_in[1],
+                           PyBytes_AS_STRING(self->filter_value)) == 0;
+                break;
+            }
+        }
+    }
+
+    if (match)
+        flags |= FILTER_MATCH;
+    else if (self->filter_skip)
+        flags = 0;
+
+    if (self->filter_depth == self->filter_allocated) {
+        Py_ssize_t size = self->filter_allocated ?
+            2 * self->filter_allocated : 64;
+        char* stack = PyObject_Realloc(self->filter_stack, size);
+        if (!stack) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        self->filter_stack = stack;
+        self->filter_allocated = size;
+    }
+    self->filter_stack[self->filter_depth++] = flags;
+
+    if (flags & FILTER_BUILT)
+        self->filter_drop_data = 0;
+
+    return flags;
+}
+
+LOCAL(int)
+treebuilder_set_filter(TreeBuilderObject* self, PyObject* tags,
+                       PyObject* attrib, int skip)
+{
+    /* configure event filtering.  tags is a tag name or a sequence of tag
+       names (None for any tag), attrib an attribute name or a (name,
+       value) pair that matching elements must also have (None for no
+       predicate).  in skip mode, elements that don't match are not
+       built, and character data inside them is ignored */
+
+    PyObject* key = NULL;
+    PyObject* value = NULL;
+
+    Py_CLEAR(self->filter_tags);
+    Py_CLEAR(self->filter_key);
+    Py_CLEAR(self->filter_value);
+    self->filter = self->filter_skip = 0;
+
+    if (tags != Py_None) {
+        if (PyUnicode_Check(tags)) {
+            self->filter_tags = PySet_New(NULL);
+            if (!self->filter_tags || PySet_Add(self->filter_tags, tags) < 0)
+                return -1;
+        } else {
+            self->filter_tags = PySet_New(tags);
+            if (!self->filter_tags)
+                return -1;
+        }
+    }
+
+    if (attrib != Py_None) {
+        if (PyTuple_Check(attrib)) {
+            if (!PyArg_ParseTuple(attrib, "UU:attrib", &key, &value))
+                return -1;
+        } else if (PyUnicode_Check(attrib))
+            key = attrib;
+        else {
+            PyErr_SetString(
+                PyExc_TypeError,
+                "attrib must be a name or a (name, value) tuple"
+                );
+            return -1;
+        }
+
+        /* expat reports namespaced names as "uri}local" */
+        self->filter_key = PyUnicode_AsUTF8String(key);
+        if (!self->filter_key)
+            return -1;
+        if (PyBytes_AS_STRING(self->filter_key)[0] == '{') {
+            PyObject* raw = PyBytes_FromStringAndSize(
+                PyBytes_AS_STRING(self->filter_key) + 1,
+                PyBytes_GET_SIZE(self->filter_key) - 1);
+            Py_DECREF(self->filter_key);
+            self->filter_key = raw;
+            if (!raw)
+                return -1;
+        }
+
+        if (value) {
+            self->filter_value = PyUnicode_AsUTF8String(value);
+            if (!self->filter_value)
+                return -1;
+        }
+    }
+
+    self->filter = (self->filter_tags || self->filter_key);
+    self->filter_skip = self->filter && skip;
+
+    return 0;
+}
+
+LOCAL(int)
+treebuilder_filter_data(TreeBuilderObject* self)
+{
+    /* return true if character data at the current position is wanted,
+       i.e. it doesn't belong to a skipped element */
+
+    if (!self->filter_skip)
+        return 1;
+    if (self->filter_drop_data)
+        return 0;
+    return !self->filter_depth ||
+        (self->filter_stack[self->filter_depth - 1] & FILTER_BUILT);
+}
+
+/* -------------------------------------------------------------------- */
+/* handlers */
+
+LOCAL(PyObject*)
+treebuilder_handle_start(TreeBuilderObject* self, PyObject* tag,
+                         PyObject* attrib)
+{
+    PyObject* node;
+    PyObject* this;
+
+    if (self->data) {
+        if (self->this == self->last) {
+            if (treebuilder_set_element_text(self->last, self->data))
+                return NULL;
+        }
+        else {
+            if (treebuilder_set_element_tail(self->last, self->data))
+                return NULL;
+        }
+        self->data = NULL;
+    }
+
+    if (self->element_factory) {
+        node = PyObject_CallFunction(self->element_factory, "OO", tag, attrib);
+    } else {
+        node = create_new_element(tag, attrib);
+    }
+    if (!node) {
+        return NULL;
+    }
+
+    this = self->this;
+
+    if (this != Py_None) {
+        if (treebuilder_add_subelement(this, node) < 0)
+            goto error;
+    } else if (!self->root) {
+        Py_INCREF(node);
+        self->root = node;
+    } else if (!self->filter_skip) {
+        /* (in skip mode, matching elements that have no materialized
+           ancestor are simply left detached) */
+        PyErr_SetString(
+            elementtree_parseerror_obj,
+            "multiple elements on top level"
+            );
+        goto error;
+    }
+
+    if (self->index < PyList_GET_SIZE(self->stack)) {
+        if (PyList_SetItem(self->stack, self->index, this) < 0)
+            goto error;
+        Py_INCREF(this);
+    } else {
+        if (PyList_Append(self->stack, this) < 0)
+            goto error;
+    }
+    self->index++;
+
+    Py_DECREF(this);
+    Py_INCREF(node);
+    self->this = node;
+
+    Py_DECREF(self->last);
+    Py_INCREF(node);
+    self->last = node;
+
+    if (self->start_event_obj && (!self->filter || !self->filter_depth ||
+            (self->filter_stack[self->filter_depth - 1] & FILTER_MATCH))) {
+        if (treebuilder_push_event(self, self->start_event_obj,
+                                   node, NULL) < 0)
+            goto error;
+    }
+
+    return node;
+
+  error:
+    Py_DECREF(node);
+    return NULL;
+}
+
+LOCAL(PyObject*)
+treebuilder_handle_data(TreeBuilderObject* self, PyObject* data)
+{
+    if (self->filter && !treebuilder_filter_data(self))
+        Py_RETURN_NONE;
+
+    if (!self->data) {
+        if (self->last == Py_None) {
+            /* ignore calls to data before the first call to start */
+            Py_RETURN_NONE;
+        }
+        /* store the first item as is */
+        Py_INCREF(data); self->data = data;
+    } else {
+        /* more than one item; use a list to collect items */
+        if (PyBytes_CheckExact(self->data) && Py_REFCNT(self->data) == 1 &&
+            PyBytes_CheckExact(data) && PyBytes_GET_SIZE(data) == 1) {
+            /* XXX this code path unused in Python 3? */
+            /* expat often generates single character data sections; handle
+               the most common case by resizing the existing string... */
+            Py_ssize_t size = PyBytes_GET_SIZE(self->data);
+            if (_PyBytes_Resize(&self->data, size + 1) < 0)
+                return NULL;
+            PyBytes_AS_STRING(self->data)[size] = PyBytes_AS_STRING(data)[0];
         } else if (PyList_CheckExact(self->data)) {
             if (PyList_Append(self->data, data) < 0)
                 return NULL;
@@ -2382,6 +3068,17 @@ LOCAL(PyObject*)
 treebuilder_handle_end(TreeBuilderObject* self, PyObject* tag)
 {
     PyObject* item;
+    int flags = FILTER_MATCH | FILTER_BUILT;
+
+    if (self->filter && self->filter_depth) {
+        flags = self->filter_stack[--self->filter_depth];
+        if (!(flags & FILTER_BUILT)) {
+            /* skipped element; anything up to the next tag is its tail */
+            self->filter_drop_data = 1;
+            Py_RETURN_NONE;
+        }
+        self->filter_drop_data = 0;
+    }
 
     if (self->data) {
         if (self->this == self->last) {
@@ -2412,16 +3109,10 @@ treebuilder_handle_end(TreeBuilderObject* self, PyObject* tag)
     self->last = self->this;
     self->this = item;
 
-    if (self->end_event_obj) {
-        PyObject* res;
-        PyObject* action = self->end_event_obj;
-        PyObject* node = (PyObject*) self->last;
-        res = PyTuple_Pack(2, action, node);
-        if (res) {
-            PyList_Append(self->events, res);
-            Py_DECREF(res);
-        } else
-            PyErr_Clear(); /* FIXME: propagate error */
+    if (self->end_event_obj && (flags & FILTER_MATCH)) {
+        if (treebuilder_push_event(self, self->end_event_obj,
+                                   self->last, self->this) < 0)
+            return NULL;
     }
 
     Py_INCREF(self->last);
@@ -2432,11 +3123,10 @@ LOCAL(void)
 treebuilder_handle_namespace(TreeBuilderObject* self, int start,
                              PyObject *prefix, PyObject *uri)
 {
-    PyObject* res;
     PyObject* action;
     PyObject* parcel;
 
-    if (!self->events)
+    if (!self->events && !self->ring)
         return;
 
     if (start) {
@@ -2446,29 +3136,18 @@ treebuilder_handle_namespace(TreeBuilderObject* self, int start,
         parcel = Py_BuildValue("OO", prefix, uri);
         if (!parcel)
             return;
-        Py_INCREF(action);
     } else {
         if (!self->end_ns_event_obj)
             return;
         action = self->end_ns_event_obj;
-        Py_INCREF(action);
         parcel = Py_None;
         Py_INCREF(parcel);
     }
 
-    res = PyTuple_New(2);
-
-    if (res) {
-        PyTuple_SET_ITEM(res, 0, action);
-        PyTuple_SET_ITEM(res, 1, parcel);
-        PyList_Append(self->events, res);
-        Py_DECREF(res);
-    }
-    else {
-        Py_DECREF(action);
-        Py_DECREF(parcel);
+    if (treebuilder_push_event(self, action, parcel, NULL) < 0)
         PyErr_Clear(); /* FIXME: propagate error */
-    }
+
+    Py_DECREF(parcel);
 }
 
 /* -------------------------------------------------------------------- */
@@ -2481,68 +3160,1232 @@ treebuilder_data(TreeBuilderObject* self, PyObject* args)
     if (!PyArg_ParseTuple(args, "O:data", &data))
         return NULL;
 
-    return treebuilder_handle_data(self, data);
-}
+    return treebuilder_handle_data(self, data);
+}
+
+static PyObject*
+treebuilder_end(TreeBuilderObject* self, PyObject* args)
+{
+    PyObject* tag;
+    if (!PyArg_ParseTuple(args, "O:end", &tag))
+        return NULL;
+
+    return treebuilder_handle_end(self, tag);
+}
+
+LOCAL(PyObject*)
+treebuilder_done(TreeBuilderObject* self)
+{
+    PyObject* res;
+
+    /* FIXME: check stack size? */
+
+    if (self->root)
+        res = self->root;
+    else
+        res = Py_None;
+
+    Py_INCREF(res);
+    return res;
+}
+
+static PyObject*
+treebuilder_close(TreeBuilderObject* self, PyObject* args)
+{
+    if (!PyArg_ParseTuple(args, ":close"))
+        return NULL;
+
+    return treebuilder_done(self);
+}
+
+static PyObject*
+treebuilder_start(TreeBuilderObject* self, PyObject* args)
+{
+    PyObject* tag;
+    PyObject* attrib = Py_None;
+    if (!PyArg_ParseTuple(args, "O|O:start", &tag, &attrib))
+        return NULL;
+
+    return treebuilder_handle_start(self, tag, attrib);
+}
+
+static PyMethodDef treebuilder_methods[] = {
+    {"data", (PyCFunction) treebuilder_data, METH_VARARGS},
+    {"start", (PyCFunction) treebuilder_start, METH_VARARGS},
+    {"end", (PyCFunction) treebuilder_end, METH_VARARGS},
+    {"close", (PyCFunction) treebuilder_close, METH_VARARGS},
+    {NULL, NULL}
+};
+
+static PyTypeObject TreeBuilder_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "ciElementTree.TreeBuilder", sizeof(TreeBuilderObject), 0,
+    /* methods */
+    (destructor)treebuilder_dealloc,                /* tp_dealloc */
+    0,                                              /* tp_print */
+    0,                                              /* tp_getattr */
+    0,                                              /* tp_setattr */
+    0,                                              /* tp_reserved */
+    0,                                              /* tp_repr */
+    0,                                              /* tp_as_number */
+    0,                                              /* tp_as_sequence */
+    0,                                              /* tp_as_mapping */
+    0,                                              /* tp_hash */
+    0,                                              /* tp_call */
+    0,                                              /* tp_str */
+    0,                                              /* tp_getattro */
+    0,                                              /* tp_setattro */
+    0,                                              /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC,
+                                                    /* tp_flags */
+    0,                                              /* tp_doc */
+    (traverseproc)treebuilder_gc_traverse,          /* tp_traverse */
+    (inquiry)treebuilder_gc_clear,                  /* tp_clear */
+    0,                                              /* tp_richcompare */
+    0,                                              /* tp_weaklistoffset */
+    0,                                              /* tp_iter */
+    0,                                              /* tp_iternext */
+    treebuilder_methods,                            /* tp_methods */
+    0,                                              /* tp_members */
+    0,                                              /* tp_getset */
+    0,                                              /* tp_base */
+    0,                                              /* tp_dict */
+    0,                                              /* tp_descr_get */
+    0,                                              /* tp_descr_set */
+    0,                                              /* tp_dictoffset */
+    (initproc)treebuilder_init,                     /* tp_init */
+    PyType_GenericAlloc,                            /* tp_alloc */
+    treebuilder_new,                                /* tp_new */
+    0,                                              /* tp_free */
+};
+
+/* ==================================================================== */
+/* serializer.  a C version of ElementTree's tostring() and dump() for
+   trees of plain elements, producing the same output as ElementTree does
+   on this Python version; everything else (comments, processing
+   instructions, namespaces, QNames, other methods and encodings) is
+   passed on to ElementTree itself. */
+
+/* serialize_* return values besides 0 and -1: the tree needs ElementTree */
+#define SERIALIZE_FALLBACK 1
+
+LOCAL(int)
+serialize_escaped(_PyUnicodeWriter* writer, PyObject* text, int attrib)
+{
+    /* write text escaped as ElementTree's _escape_cdata/_escape_attrib */
+
+    Py_ssize_t i, start, length;
+    int kind;
+    void* data;
+
+    if (!PyUnicode_Check(text))
+        return SERIALIZE_FALLBACK;
+    if (PyUnicode_READY(text) < 0)
+        return -1;
+
+    kind = PyUnicode_KIND(text);
+    data = PyUnicode_DATA(text);
+    length = PyUnicode_GET_LENGTH(text);
+
+    for (i = start = 0; i < length; i++) {
+        Py_UCS4 ch = PyUnicode_READ(kind, data, i);
+        const char* escape = NULL;
+        Py_ssize_t skip = 0;
+        switch (ch) {
+        case '&':
+            escape = "&amp;";
+            break;
+        case '<':
+            escape = "&lt;";
+            break;
+        case '>':
+            escape = "&gt;";
+            break;
+        case '"':
+            if (attrib)
+                escape = "&quot;";
+            break;
+        case '\n':
+            if (attrib)
+                escape = "&#10;";
+            break;
+        case '\t':
+            if (attrib)
+                escape = "&#09;";
+            break;
+        case '\r':
+#if PY_VERSION_HEX >= 0x03090000
+            if (attrib)
+                escape = "&#13;";
+#else
+            /* CR and CR LF are normalized to LF, and written as such */
+            if (attrib) {
+                escape = "&#10;";
+                if (i + 1 < length && PyUnicode_READ(kind, data, i + 1) == '\n')
+                    skip = 1;
+            }
+#endif
+            break;
+        }
+        if (!escape)
+            continue;
+        if (i > start &&
+            _PyUnicodeWriter_WriteSubstring(writer, text, start, i) < 0)
+            return -1;
+        if (_PyUnicodeWriter_WriteASCIIString(writer, escape,
+                                              strlen(escape)) < 0)
+            return -1;
+        i += skip;
+        start = i + 1;
+    }
+
+    if (start < length &&
+        _PyUnicodeWriter_WriteSubstring(writer, text, start, length) < 0)
+        return -1;
+
+    return 0;
+}
+
+LOCAL(int)
+serialize_name(PyObject* name)
+{
+    /* true if name can be written as is; "{uri}local" names need
+       ElementTree's namespace handling */
+    return PyUnicode_Check(name) &&
+        PyUnicode_READY(name) == 0 &&
+        (PyUnicode_GET_LENGTH(name) == 0 ||
+         PyUnicode_READ_CHAR(name, 0) != '{');
+}
+
+LOCAL(int)
+serialize_attrib(_PyUnicodeWriter* writer, PyObject* attrib)
+{
+    PyObject* keys;
+    Py_ssize_t i;
+    int ok = 0;
+
+    if (!PyDict_Check(attrib))
+        return SERIALIZE_FALLBACK;
+
+    keys = PyDict_Keys(attrib);
+    if (!keys)
+        return -1;
+
+    for (i = 0; i < PyList_GET_SIZE(keys); i++)
+        if (!serialize_name(PyList_GET_ITEM(keys, i))) {
+            Py_DECREF(keys);
+            return PyErr_Occurred() ? -1 : SERIALIZE_FALLBACK;
+        }
+
+#if PY_VERSION_HEX < 0x03080000
+    /* older ElementTrees write attributes in lexical order */
+    if (PyList_Sort(keys) < 0) {
+        Py_DECREF(keys);
+        return -1;
+    }
+#endif
+
+    for (i = 0; i < PyList_GET_SIZE(keys) && !ok; i++) {
+        PyObject* key = PyList_GET_ITEM(keys, i);
+        PyObject* value = PyDict_GetItem(attrib, key);
+        if (!value)
+            continue;
+        if (_PyUnicodeWriter_WriteChar(writer, ' ') < 0 ||
+            _PyUnicodeWriter_WriteStr(writer, key) < 0 ||
+            _PyUnicodeWriter_WriteASCIIString(writer, "=\"", 2) < 0)
+            ok = -1;
+        else
+            ok = serialize_escaped(writer, value, 1);
+        if (!ok && _PyUnicodeWriter_WriteChar(writer, '"') < 0)
+            ok = -1;
+    }
+
+    Py_DECREF(keys);
+    return ok;
+}
+
+LOCAL(int)
+serialize_element(_PyUnicodeWriter* writer, PyObject* element,
+                  int short_empty_elements)
+{
+    ElementObject* self = (ElementObject*) element;
+    PyObject* text;
+    PyObject* tail;
+    int i, length, ok;
+
+    if (!Element_CheckExact(element) || !serialize_name(self->tag))
+        return PyErr_Occurred() ? -1 : SERIALIZE_FALLBACK;
+
+    text = element_get_text(self);
+    if (!text)
+        return -1;
+    if (text != Py_None && !PyUnicode_Check(text))
+        return SERIALIZE_FALLBACK;
+
+    if (Py_EnterRecursiveCall(" while serializing an element"))
+        return -1;
+
+    ok = 0;
+    if (_PyUnicodeWriter_WriteChar(writer, '<') < 0 ||
+        _PyUnicodeWriter_WriteStr(writer, self->tag) < 0)
+        ok = -1;
+    else if (self->extra && self->extra->attrib != Py_None)
+        ok = serialize_attrib(writer, self->extra->attrib);
+
+    length = self->extra ? self->extra->length : 0;
+    if (!ok && ((text != Py_None && PyUnicode_GET_LENGTH(text)) || length ||
+                !short_empty_elements)) {
+        if (_PyUnicodeWriter_WriteChar(writer, '>') < 0)
+            ok = -1;
+        if (!ok && text != Py_None)
+            ok = serialize_escaped(writer, text, 0);
+        for (i = 0; !ok && i < length; i++)
+            ok = serialize_element(writer, self->extra->children[i],
+                                   short_empty_elements);
+        if (!ok && (_PyUnicodeWriter_WriteASCIIString(writer, "</", 2) < 0 ||
+                    _PyUnicodeWriter_WriteStr(writer, self->tag) < 0 ||
+                    _PyUnicodeWriter_WriteChar(writer, '>') < 0))
+            ok = -1;
+    } else if (!ok &&
+               _PyUnicodeWriter_WriteASCIIString(writer, " />", 3) < 0)
+        ok = -1;
+
+    Py_LeaveRecursiveCall();
+    if (ok)
+        return ok;
+
+    tail = element_get_tail(self);
+    if (!tail)
+        return -1;
+    if (tail != Py_None)
+        return serialize_escaped(writer, tail, 0);
+    return 0;
+}
+
+LOCAL(PyObject*)
+serialize_to_string(PyObject* element, int short_empty_elements,
+                    int* fallback)
+{
+    /* returns the serialized tree, or NULL with an exception set, or
+       NULL and *fallback set if ElementTree has to do it */
+
+    _PyUnicodeWriter writer;
+    int ok;
+
+    *fallback = 0;
+
+    _PyUnicodeWriter_Init(&writer);
+    writer.overallocate = 1;
+
+    ok = serialize_element(&writer, element, short_empty_elements);
+    if (ok) {
+        _PyUnicodeWriter_Dealloc(&writer);
+        *fallback = (ok == SERIALIZE_FALLBACK);
+        return NULL;
+    }
+
+    return _PyUnicodeWriter_Finish(&writer);
+}
+
+LOCAL(int)
+serialize_encoding(PyObject* encoding)
+{
+    /* 1 for "unicode", 2 for encodings ElementTree writes without an XML
+       declaration, 0 for anything else */
+
+    PyObject* lower;
+    int res = 0;
+
+    if (!PyUnicode_Check(encoding))
+        return 0;
+    lower = PyObject_CallMethod(encoding, "lower", NULL);
+    if (!lower)
+        return -1;
+    if (PyUnicode_CompareWithASCIIString(lower, "unicode") == 0)
+        res = 1;
+    else if (PyUnicode_CompareWithASCIIString(lower, "us-ascii") == 0 ||
+             PyUnicode_CompareWithASCIIString(lower, "utf-8") == 0)
+        res = 2;
+    Py_DECREF(lower);
+    return res;
+}
+
+static PyObject*
+elementtree_tostring(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    PyObject* element;
+    PyObject* encoding = Py_None;
+    PyObject* method = Py_None;
+    int short_empty_elements = 1;
+    PyObject* key;
+    PyObject* res;
+    PyObject* out;
+    Py_ssize_t pos = 0;
+    int kind, fallback;
+    static char *kwlist[] = {"element", "encoding", "method",
+                             "short_empty_elements", 0};
+
+    /* leave arguments newer ElementTrees know about to them */
+    while (kwds && PyDict_Next(kwds, &pos, &key, NULL))
+        if (!PyUnicode_Check(key) ||
+            (PyUnicode_CompareWithASCIIString(key, "encoding") != 0 &&
+             PyUnicode_CompareWithASCIIString(key, "method") != 0 &&
+             PyUnicode_CompareWithASCIIString(key, "short_empty_elements")))
+            return PyObject_Call(elementtree_tostring_obj, args, kwds);
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OO$p:tostring", kwlist,
+                                     &element, &encoding, &method,
+                                     &short_empty_elements))
+        return NULL;
+
+    if (method != Py_None &&
+        !(PyUnicode_Check(method) &&
+          PyUnicode_CompareWithASCIIString(method, "xml") == 0))
+        return PyObject_Call(elementtree_tostring_obj, args, kwds);
+
+    if (encoding == Py_None)
+        kind = 2; /* us-ascii */
+    else {
+        kind = serialize_encoding(encoding);
+        if (kind < 0)
+            return NULL;
+        if (!kind)
+            return PyObject_Call(elementtree_tostring_obj, args, kwds);
+    }
+
+    res = serialize_to_string(element, short_empty_elements, &fallback);
+    if (!res)
+        return fallback ?
+            PyObject_Call(elementtree_tostring_obj, args, kwds) : NULL;
+
+    if (kind == 1)
+        return res;
+
+    out = PyUnicode_AsEncodedString(
+        res, encoding == Py_None ? "us-ascii" : PyUnicode_AsUTF8(encoding),
+        "xmlcharrefreplace"
+        );
+    Py_DECREF(res);
+    return out;
+}
+
+static PyObject*
+elementtree_dump(PyObject* self, PyObject* args)
+{
+    PyObject* element;
+    PyObject* res;
+    PyObject* out;
+    PyObject* tail;
+    int fallback;
+
+    if (!PyArg_ParseTuple(args, "O:dump", &element))
+        return NULL;
+
+    res = serialize_to_string(element, 1, &fallback);
+    if (!res)
+        return fallback ?
+            PyObject_CallObject(elementtree_dump_obj, args) : NULL;
+
+    out = PySys_GetObject("stdout");
+    if (!out) {
+        Py_DECREF(res);
+        PyErr_SetString(PyExc_RuntimeError, "lost sys.stdout");
+        return NULL;
+    }
+    Py_INCREF(out);
+
+    tail = element_get_tail((ElementObject*) element);
+    if (tail && (tail == Py_None || !PyUnicode_GET_LENGTH(tail) ||
+                 PyUnicode_READ_CHAR(tail, PyUnicode_GET_LENGTH(tail) - 1)
+                 != '\n')) {
+        /* end the output with a newline, as ElementTree does */
+        PyObject* line = PyUnicode_FromFormat("%U\n", res);
+        Py_DECREF(res);
+        res = line;
+    }
+    if (!tail || !res) {
+        Py_XDECREF(res);
+        Py_DECREF(out);
+        return NULL;
+    }
+
+    tail = PyObject_CallMethod(out, "write", "O", res);
+    Py_DECREF(res);
+    Py_DECREF(out);
+    if (!tail)
+        return NULL;
+    Py_DECREF(tail);
+
+    Py_RETURN_NONE;
+}
+
+/* -------------------------------------------------------------------- */
+/* streaming writer: writes a document piece by piece, the same way
+   dump() would write the corresponding tree, and passes it on to a
+   file in chunks.  output goes to file.write as str, or encoded as
+   bytes if an encoding is given (stateless encodings only, since each
+   chunk is encoded separately). */
+
+typedef struct {
+    PyObject_HEAD
+
+    PyObject* write; /* file.write */
+    PyObject* encoding; /* NULL to write str */
+    Py_ssize_t chunk_size;
+
+    _PyUnicodeWriter buffer; /* output not yet written */
+    Py_UCS4 last; /* last character written out */
+
+    PyObject* stack; /* tags of the open elements */
+    int open; /* last start tag still needs its ">" */
+    int closed; /* close() has ended the document */
+} XMLWriterObject;
+
+static PyTypeObject XMLWriter_Type;
+
+static PyObject *
+xmlwriter_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    XMLWriterObject *self = (XMLWriterObject *)type->tp_alloc(type, 0);
+    if (self) {
+        self->write = self->encoding = NULL;
+        self->chunk_size = 0;
+        _PyUnicodeWriter_Init(&self->buffer);
+        self->buffer.overallocate = 1;
+        self->last = 0;
+        self->stack = PyList_New(0);
+        self->open = self->closed = 0;
+        if (!self->stack) {
+            Py_DECREF(self);
+            return NULL;
+        }
+    }
+    return (PyObject *)self;
+}
+
+static int
+xmlwriter_init(PyObject *self_, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"file", "encoding", "chunk_size", 0};
+    XMLWriterObject *self = (XMLWriterObject *)self_;
+    PyObject *file;
+    PyObject *encoding = Py_None;
+    Py_ssize_t chunk_size = 65536;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|On:XMLWriter", kwlist,
+                                     &file, &encoding, &chunk_size))
+        return -1;
+
+    if (encoding != Py_None && !PyUnicode_Check(encoding)) {
+        PyErr_SetString(PyExc_TypeError, "encoding must be a str or None");
+        return -1;
+    }
+
+    Py_CLEAR(self->write);
+    self->write = PyObject_GetAttrString(file, "write");
+    if (!self->write)
+        return -1;
+
+    Py_CLEAR(self->encoding);
+    if (encoding != Py_None &&
+        PyUnicode_CompareWithASCIIString(encoding, "unicode") != 0) {
+        Py_INCREF(encoding);
+        self->encoding = encoding;
+    }
+
+    self->chunk_size = chunk_size > 0 ? chunk_size : 1;
+    return 0;
+}
+
+static int
+xmlwriter_gc_traverse(XMLWriterObject *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->write);
+    Py_VISIT(self->encoding);
+    Py_VISIT(self->stack);
+    return 0;
+}
+
+static int
+xmlwriter_gc_clear(XMLWriterObject *self)
+{
+    Py_CLEAR(self->write);
+    Py_CLEAR(self->encoding);
+    Py_CLEAR(self->stack);
+    return 0;
+}
+
+static void
+xmlwriter_dealloc(XMLWriterObject *self)
+{
+    PyObject_GC_UnTrack(self);
+    xmlwriter_gc_clear(self);
+    _PyUnicodeWriter_Dealloc(&self->buffer);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+LOCAL(int)
+xmlwriter_flush_buffer(XMLWriterObject* self)
+{
+    PyObject* chunk;
+    PyObject* res;
+
+    if (!self->buffer.pos)
+        return 0;
+
+    if (!self->write) {
+        PyErr_SetString(PyExc_ValueError, "XMLWriter not initialized");
+        return -1;
+    }
+
+    chunk = _PyUnicodeWriter_Finish(&self->buffer);
+    _PyUnicodeWriter_Init(&self->buffer);
+    self->buffer.overallocate = 1;
+    if (!chunk)
+        return -1;
+
+    self->last = PyUnicode_READ_CHAR(chunk, PyUnicode_GET_LENGTH(chunk) - 1);
+
+    if (self->encoding) {
+        const char* encoding = PyUnicode_AsUTF8(self->encoding);
+        PyObject* encoded = NULL;
+        if (encoding)
+            encoded = PyUnicode_AsEncodedString(chunk, encoding,
+                                                "xmlcharrefreplace");
+        Py_DECREF(chunk);
+        if (!encoded)
+            return -1;
+        chunk = encoded;
+    }
+
+    res = PyObject_CallFunctionObjArgs(self->write, chunk, NULL);
+    Py_DECREF(chunk);
+    if (!res)
+        return -1;
+    Py_DECREF(res);
+    return 0;
+}
+
+LOCAL(PyObject*)
+xmlwriter_done(XMLWriterObject* self, int ok)
+{
+    /* common method exit: report errors, flush full chunks */
+
+    if (ok == SERIALIZE_FALLBACK) {
+        PyErr_SetString(PyExc_TypeError,
+                        "XMLWriter can only write str names and values, "
+                        "without namespaces");
+        return NULL;
+    }
+    if (ok < 0)
+        return NULL;
+    if (self->buffer.pos >= self->chunk_size &&
+        xmlwriter_flush_buffer(self) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+LOCAL(int)
+xmlwriter_close_start(XMLWriterObject* self)
+{
+    if (!self->open)
+        return 0;
+    self->open = 0;
+    return _PyUnicodeWriter_WriteChar(&self->buffer, '>');
+}
+
+static PyObject*
+xmlwriter_start(XMLWriterObject* self, PyObject* args)
+{
+    PyObject* tag;
+    PyObject* attrib = Py_None;
+    Py_ssize_t pos = self->buffer.pos;
+    int open = self->open;
+    int ok;
+
+    if (!PyArg_ParseTuple(args, "O|O:start", &tag, &attrib))
+        return NULL;
+
+    if (self->closed) {
+        PyErr_SetString(PyExc_ValueError, "XMLWriter closed");
+        return NULL;
+    }
+
+    if (!serialize_name(tag))
+        return xmlwriter_done(self, PyErr_Occurred() ? -1 : SERIALIZE_FALLBACK);
+
+    if (xmlwriter_close_start(self) < 0 ||
+        _PyUnicodeWriter_WriteChar(&self->buffer, '<') < 0 ||
+        _PyUnicodeWriter_WriteStr(&self->buffer, tag) < 0)
+        ok = -1;
+    else if (attrib != Py_None)
+        ok = serialize_attrib(&self->buffer, attrib);
+    else
+        ok = 0;
+    if (!ok && PyList_Append(self->stack, tag) < 0)
+        ok = -1;
+
+    if (ok) {
+        /* drop what was written of the start tag */
+        self->buffer.pos = pos;
+        self->open = open;
+    } else
+        self->open = 1;
+
+    return xmlwriter_done(self, ok);
+}
+
+static PyObject*
+xmlwriter_data(XMLWriterObject* self, PyObject* args)
+{
+    PyObject* data;
+
+    if (!PyArg_ParseTuple(args, "O:data", &data))
+        return NULL;
+
+    if (!PyList_GET_SIZE(self->stack)) {
+        PyErr_SetString(PyExc_ValueError, "no open element");
+        return NULL;
+    }
+
+    if (!PyUnicode_Check(data))
+        return xmlwriter_done(self, SERIALIZE_FALLBACK);
+    if (!PyUnicode_GET_LENGTH(data))
+        Py_RETURN_NONE; /* an empty element stays empty */
+
+    if (xmlwriter_close_start(self) < 0)
+        return NULL;
+
+    return xmlwriter_done(self, serialize_escaped(&self->buffer, data, 0));
+}
+
+static PyObject*
+xmlwriter_end(XMLWriterObject* self, PyObject* args)
+{
+    PyObject* tag = Py_None;
+    PyObject* open_tag;
+    Py_ssize_t depth;
+    int ok;
+
+    if (!PyArg_ParseTuple(args, "|O:end", &tag))
+        return NULL;
+
+    depth = PyList_GET_SIZE(self->stack);
+    if (!depth) {
+        PyErr_SetString(PyExc_ValueError, "no open element");
+        return NULL;
+    }
+    open_tag = PyList_GET_ITEM(self->stack, depth - 1);
+    if (tag != Py_None) {
+        ok = PyObject_RichCompareBool(tag, open_tag, Py_EQ);
+        if (ok < 0)
+            return NULL;
+        if (!ok) {
+            PyErr_Format(PyExc_ValueError, "end tag %R doesn't match %R",
+                         tag, open_tag);
+            return NULL;
+        }
+    }
+
+    if (self->open) {
+        self->open = 0;
+        ok = _PyUnicodeWriter_WriteASCIIString(&self->buffer, " />", 3);
+    } else if (_PyUnicodeWriter_WriteASCIIString(&self->buffer, "</", 2) < 0 ||
+               _PyUnicodeWriter_WriteStr(&self->buffer, open_tag) < 0 ||
+               _PyUnicodeWriter_WriteChar(&self->buffer, '>') < 0)
+        ok = -1;
+    else
+        ok = 0;
+    if (ok < 0)
+        return NULL;
+
+    if (PyList_SetSlice(self->stack, depth - 1, depth, NULL) < 0)
+        return NULL;
+
+    return xmlwriter_done(self, 0);
+}
+
+static PyObject*
+xmlwriter_write_element(XMLWriterObject* self, PyObject* args)
+{
+    /* write a complete element, with its tail.  elements the C
+       serializer can't write (comments, namespaced names, ...) are
+       written by ElementTree's tostring() instead, which declares the
+       namespaces it needs on the element itself rather than on the
+       root, as dump() would */
+
+    PyObject* element;
+    PyObject* text;
+    Py_ssize_t pos = self->buffer.pos;
+    Py_ssize_t start;
+    int open = self->open;
+    int ok;
+
+    if (!PyArg_ParseTuple(args, "O:write_element", &element))
+        return NULL;
+
+    if (self->closed) {
+        PyErr_SetString(PyExc_ValueError, "XMLWriter closed");
+        return NULL;
+    }
+
+    if (xmlwriter_close_start(self) < 0)
+        ok = -1;
+    else {
+        start = self->buffer.pos;
+        ok = serialize_element(&self->buffer, element, 1);
+    }
+    if (ok == SERIALIZE_FALLBACK) {
+        /* not a plain tree; drop what was written of it, and let
+           ElementTree write it instead */
+        self->buffer.pos = start;
+        text = PyObject_CallFunction(elementtree_tostring_obj, "Os",
+                                     element, "unicode");
+        if (!text)
+            ok = -1;
+        else {
+            ok = _PyUnicodeWriter_WriteStr(&self->buffer, text);
+            Py_DECREF(text);
+        }
+    }
+
+    if (ok < 0) {
+        /* drop what was written of the element */
+        self->buffer.pos = pos;
+        self->open = open;
+    }
+    return xmlwriter_done(self, ok);
+}
+
+static PyObject*
+xmlwriter_flush(XMLWriterObject* self, PyObject* args)
+{
+    /* write out everything buffered so far */
+
+    if (!PyArg_ParseTuple(args, ":flush"))
+        return NULL;
+
+    if (xmlwriter_flush_buffer(self) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+xmlwriter_close(XMLWriterObject* self, PyObject* args)
+{
+    /* end the document with a newline if needed, as dump() does, and
+       write out what's left */
+
+    Py_UCS4 last;
+
+    if (!PyArg_ParseTuple(args, ":close"))
+        return NULL;
+
+    if (PyList_GET_SIZE(self->stack)) {
+        PyErr_SetString(PyExc_ValueError, "unclosed elements");
+        return NULL;
+    }
+    self->closed = 1;
+
+    if (self->buffer.pos)
+        last = PyUnicode_READ(self->buffer.kind, self->buffer.data,
+                              self->buffer.pos - 1);
+    else
+        last = self->last;
+    if (last != '\n' && _PyUnicodeWriter_WriteChar(&self->buffer, '\n') < 0)
+        return NULL;
+
+    if (xmlwriter_flush_buffer(self) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef xmlwriter_methods[] = {
+    {"start", (PyCFunction) xmlwriter_start, METH_VARARGS},
+    {"data", (PyCFunction) xmlwriter_data, METH_VARARGS},
+    {"end", (PyCFunction) xmlwriter_end, METH_VARARGS},
+    {"write_element", (PyCFunction) xmlwriter_write_element, METH_VARARGS},
+    {"flush", (PyCFunction) xmlwriter_flush, METH_VARARGS},
+    {"close", (PyCFunction) xmlwriter_close, METH_VARARGS},
+    {NULL, NULL}
+};
+
+static PyTypeObject XMLWriter_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "ciElementTree.XMLWriter", sizeof(XMLWriterObject), 0,
+    /* methods */
+    (destructor)xmlwriter_dealloc,                  /* tp_dealloc */
+    0,                                              /* tp_print */
+    0,                                              /* tp_getattr */
+    0,                                              /* tp_setattr */
+    0,                                              /* tp_reserved */
+    0,                                              /* tp_repr */
+    0,                                              /* tp_as_number */
+    0,                                              /* tp_as_sequence */
+    0,                                              /* tp_as_mapping */
+    0,                                              /* tp_hash */
+    0,                                              /* tp_call */
+    0,                                              /* tp_str */
+    0,                                              /* tp_getattro */
+    0,                                              /* tp_setattro */
+    0,                                              /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+                                                    /* tp_flags */
+    0,                                              /* tp_doc */
+    (traverseproc)xmlwriter_gc_traverse,            /* tp_traverse */
+    (inquiry)xmlwriter_gc_clear,                    /* tp_clear */
+    0,                                              /* tp_richcompare */
+    0,                                              /* tp_weaklistoffset */
+    0,                                              /* tp_iter */
+    0,                                              /* tp_iternext */
+    xmlwriter_methods,                              /* tp_methods */
+    0,                                              /* tp_members */
+    0,                                              /* tp_getset */
+    0,                                              /* tp_base */
+    0,                                              /* tp_dict */
+    0,                                              /* tp_descr_get */
+    0,                                              /* tp_descr_set */
+    0,                                              /* tp_dictoffset */
+    (initproc)xmlwriter_init,                       /* tp_init */
+    PyType_GenericAlloc,                            /* tp_alloc */
+    xmlwriter_new,                                  /* tp_new */
+    0,                                              /* tp_free */
+};
+
+/* ==================================================================== */
+/* the expat interface */
+
+#if defined(USE_EXPAT)
+
+#include "expat/expat.h"
+
+#if defined(USE_PYEXPAT_CAPI)
+#include "pyexpat.h"
+static struct PyExpat_CAPI* expat_capi;
+#define EXPAT(func) (expat_capi->func)
+#else
+#define EXPAT(func) (XML_##func)
+#endif
+
+static XML_Memory_Handling_Suite ExpatMemoryHandler = {
+    PyObject_Malloc, PyObject_Realloc, PyObject_Free};
+
+/* -------------------------------------------------------------------- */
+/* projection target: a parser target that captures selected attributes
+   of selected tags as tuples, without building elements.  the parser
+   matches tags against the compiled spec before creating any objects,
+   so the rest of the document costs no Python objects at all. */
+
+typedef struct {
+    const char *tag; /* expat form ("uri}local" or "local") */
+    PyObject *key; /* spec key, used as the first item of each tuple */
+    Py_ssize_t first_attr; /* index into attrs */
+    Py_ssize_t nattrs;
+} ProjectionTag;
+
+typedef struct {
+    PyObject_HEAD
+
+    ProjectionTag *tags;
+    Py_ssize_t ntags;
+    const char **attrs; /* attribute names, in expat form */
+    PyObject *strings; /* list of bytes objects owning the names */
+
+    PyObject *results; /* list; the first count items are captured */
+    Py_ssize_t count;
+    Py_ssize_t size_hint; /* slots preallocated in each new results list */
+} ProjectionObject;
+
+static PyTypeObject Projection_Type;
+
+#define Projection_CheckExact(op) (Py_TYPE(op) == &Projection_Type)
+
+static PyObject *
+projection_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    ProjectionObject *self = (ProjectionObject *)type->tp_alloc(type, 0);
+    if (self) {
+        self->tags = NULL;
+        self->ntags = 0;
+        self->attrs = NULL;
+        self->strings = self->results = NULL;
+        self->count = self->size_hint = 0;
+    }
+    return (PyObject *)self;
+}
+
+static int
+projection_gc_traverse(ProjectionObject *self, visitproc visit, void *arg)
+{
+    Py_ssize_t i;
+    for (i = 0; i < self->ntags; i++)
+        Py_VISIT(self->tags[i].key);
+    Py_VISIT(self->strings);
+    Py_VISIT(self->results);
+    return 0;
+}
+
+static int
+projection_gc_clear(ProjectionObject *self)
+{
+    ProjectionTag *tags = self->tags;
+    Py_ssize_t i, ntags = self->ntags;
+
+    self->tags = NULL;
+    self->ntags = 0;
+    for (i = 0; i < ntags; i++)
+        Py_DECREF(tags[i].key);
+    if (tags)
+        PyObject_Free(tags);
+    if (self->attrs) {
+        PyObject_Free(self->attrs);
+        self->attrs = NULL;
+    }
+    Py_CLEAR(self->strings);
+    Py_CLEAR(self->results);
+    return 0;
+}
+
+static void
+projection_dealloc(ProjectionObject *self)
+{
+    PyObject_GC_UnTrack(self);
+    projection_gc_clear(self);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+LOCAL(const char*)
+projection_compile_name(ProjectionObject* self, PyObject* name)
+{
+    /* convert a tag or attribute name to the form expat reports it in,
+       keeping the bytes alive in self->strings */
+
+    PyObject* bytes;
+    const char* s;
+    int ok;
+
+    if (!PyUnicode_Check(name)) {
+        PyErr_Format(PyExc_TypeError, "expected str, not %.100s",
+                     Py_TYPE(name)->tp_name);
+        return NULL;
+    }
+    s = PyUnicode_AsUTF8(name);
+    if (!s)
+        return NULL;
+    if (s[0] == '{' && strchr(s, '}'))
+        s++; /* "{uri}local" is "uri}local" to expat */
+    bytes = PyBytes_FromString(s);
+    if (!bytes)
+        return NULL;
+    ok = PyList_Append(self->strings, bytes);
+    Py_DECREF(bytes);
+    if (ok < 0)
+        return NULL;
+    return PyBytes_AS_STRING(bytes);
+}
+
+LOCAL(int)
+projection_reset(ProjectionObject* self)
+{
+    /* start a new results list; close() hands each one off to the
+       caller, so every parse gets its own */
+
+    Py_ssize_t i;
+
+    Py_CLEAR(self->results);
+    self->count = 0;
+    self->results = PyList_New(self->size_hint);
+    if (!self->results)
+        return -1;
+    for (i = 0; i < self->size_hint; i++) {
+        Py_INCREF(Py_None);
+        PyList_SET_ITEM(self->results, i, Py_None);
+    }
+    return 0;
+}
+
+static int
+projection_init(PyObject *self_, PyObject *args, PyObject *kwds)
+{
+    /* spec maps each tag to capture to a sequence of attribute names;
+       each matching element yields (tag, value, ...), with None for
+       missing attributes.  size_hint preallocates the result list */
+
+    static char *kwlist[] = {"spec", "size_hint", 0};
+    ProjectionObject *self = (ProjectionObject *)self_;
+    PyObject *spec;
+    Py_ssize_t size_hint = 0;
+    PyObject *key, *value;
+    Py_ssize_t pos, i, nattrs;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|n:Projection", kwlist,
+                                     &PyDict_Type, &spec, &size_hint))
+        return -1;
+
+    projection_gc_clear(self);
+
+    self->strings = PyList_New(0);
+    if (!self->strings)
+        return -1;
+    self->size_hint = size_hint > 0 ? size_hint : 0;
+    if (projection_reset(self) < 0)
+        return -1;
+
+    /* count the attribute names, so both arrays can be allocated once */
+    nattrs = 0;
+    pos = 0;
+    while (PyDict_Next(spec, &pos, &key, &value)) {
+        Py_ssize_t n;
+        if (PyUnicode_Check(value)) {
+            /* a str is a sequence too, of one-character names */
+            PyErr_Format(PyExc_TypeError,
+                         "attribute names for %R must be a sequence of str, "
+                         "not a str", key);
+            return -1;
+        }
+        n = PySequence_Size(value);
+        if (n < 0)
+            return -1;
+        nattrs += n;
+    }
 
-static PyObject*
-treebuilder_end(TreeBuilderObject* self, PyObject* args)
-{
-    PyObject* tag;
-    if (!PyArg_ParseTuple(args, "O:end", &tag))
-        return NULL;
+    self->tags = PyObject_Malloc(
+        (PyDict_Size(spec) + 1) * sizeof(ProjectionTag));
+    self->attrs = PyObject_Malloc((nattrs + 1) * sizeof(char*));
+    if (!self->tags || !self->attrs) {
+        PyErr_NoMemory();
+        return -1;
+    }
 
-    return treebuilder_handle_end(self, tag);
+    nattrs = 0;
+    pos = 0;
+    while (PyDict_Next(spec, &pos, &key, &value)) {
+        ProjectionTag* tag = &self->tags[self->ntags];
+        PyObject* names = PySequence_Fast(value, "expected a sequence");
+        if (!names)
+            return -1;
+        tag->tag = projection_compile_name(self, key);
+        if (!tag->tag) {
+            Py_DECREF(names);
+            return -1;
+        }
+        tag->first_attr = nattrs;
+        tag->nattrs = PySequence_Fast_GET_SIZE(names);
+        for (i = 0; i < tag->nattrs; i++) {
+            self->attrs[nattrs] = projection_compile_name(
+                self, PySequence_Fast_GET_ITEM(names, i));
+            if (!self->attrs[nattrs]) {
+                Py_DECREF(names);
+                return -1;
+            }
+            nattrs++;
+        }
+        Py_DECREF(names);
+        Py_INCREF(key);
+        tag->key = key;
+        self->ntags++;
+    }
+
+    return 0;
 }
 
-LOCAL(PyObject*)
-treebuilder_done(TreeBuilderObject* self)
+LOCAL(void)
+projection_start(ProjectionObject* self, const XML_Char* tag_in,
+                 const XML_Char **attrib_in)
 {
-    PyObject* res;
+    ProjectionTag* tag = NULL;
+    PyObject* item;
+    Py_ssize_t i;
+    int ok;
 
-    /* FIXME: check stack size? */
+    for (i = 0; i < self->ntags; i++)
+        if (!strcmp(self->tags[i].tag, tag_in)) {
+            tag = &self->tags[i];
+            break;
+        }
+    if (!tag)
+        return;
 
-    if (self->root)
-        res = self->root;
-    else
-        res = Py_None;
+    if (!self->results && projection_reset(self) < 0)
+        return; /* parser will look for errors */
 
-    Py_INCREF(res);
-    return res;
+    item = PyTuple_New(1 + tag->nattrs);
+    if (!item)
+        return; /* parser will look for errors */
+    Py_INCREF(tag->key);
+    PyTuple_SET_ITEM(item, 0, tag->key);
+
+    for (i = 0; i < tag->nattrs; i++) {
+        const char* name = self->attrs[tag->first_attr + i];
+        const XML_Char** attrib;
+        PyObject* value = Py_None;
+        for (attrib = attrib_in; attrib[0]; attrib += 2)
+            if (!strcmp(attrib[0], name)) {
+                value = PyUnicode_DecodeUTF8(attrib[1], strlen(attrib[1]),
+                                             "strict");
+                if (!value) {
+                    Py_DECREF(item);
+                    return;
+                }
+                break;
+            }
+        if (value == Py_None)
+            Py_INCREF(value);
+        PyTuple_SET_ITEM(item, 1 + i, value);
+    }
+
+    if (self->count < PyList_GET_SIZE(self->results)) {
+        /* fill in the preallocated slots first */
+        PyList_SetItem(self->results, self->count, item);
+    } else {
+        ok = PyList_Append(self->results, item);
+        Py_DECREF(item);
+        if (ok < 0)
+            return;
+    }
+    self->count++;
 }
 
 static PyObject*
-treebuilder_close(TreeBuilderObject* self, PyObject* args)
+projection_close(ProjectionObject* self, PyObject* args)
 {
+    /* return the captured tuples, dropping unused preallocated slots;
+       the next parse starts a new list */
+
+    PyObject* results;
+
     if (!PyArg_ParseTuple(args, ":close"))
         return NULL;
 
-    return treebuilder_done(self);
-}
+    if (!self->strings) {
+        PyErr_SetString(PyExc_ValueError, "projection not initialized");
+        return NULL;
+    }
 
-static PyObject*
-treebuilder_start(TreeBuilderObject* self, PyObject* args)
-{
-    PyObject* tag;
-    PyObject* attrib = Py_None;
-    if (!PyArg_ParseTuple(args, "O|O:start", &tag, &attrib))
+    if (!self->results)
+        return PyList_New(0); /* nothing captured since the last close */
+
+    if (self->count < PyList_GET_SIZE(self->results) &&
+        PyList_SetSlice(self->results, self->count,
+                        PyList_GET_SIZE(self->results), NULL) < 0)
         return NULL;
 
-    return treebuilder_handle_start(self, tag, attrib);
+    results = self->results;
+    self->results = NULL;
+    self->count = 0;
+    return results;
 }
 
-static PyMethodDef treebuilder_methods[] = {
-    {"data", (PyCFunction) treebuilder_data, METH_VARARGS},
-    {"start", (PyCFunction) treebuilder_start, METH_VARARGS},
-    {"end", (PyCFunction) treebuilder_end, METH_VARARGS},
-    {"close", (PyCFunction) treebuilder_close, METH_VARARGS},
+static PyMethodDef projection_methods[] = {
+    {"close", (PyCFunction) projection_close, METH_VARARGS},
     {NULL, NULL}
 };
 
-static PyTypeObject TreeBuilder_Type = {
+static PyTypeObject Projection_Type = {
     PyVarObject_HEAD_INIT(NULL, 0)
-    "ciElementTree.TreeBuilder", sizeof(TreeBuilderObject), 0,
+    "ciElementTree.Projection", sizeof(ProjectionObject), 0,
     /* methods */
-    (destructor)treebuilder_dealloc,                /* tp_dealloc */
+    (destructor)projection_dealloc,                 /* tp_dealloc */
     0,                                              /* tp_print */
     0,                                              /* tp_getattr */
     0,                                              /* tp_setattr */
@@ -2557,16 +4400,16 @@ static PyTypeObject TreeBuilder_Type = {
     0,                                              /* tp_getattro */
     0,                                              /* tp_setattro */
     0,                                              /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
                                                     /* tp_flags */
     0,                                              /* tp_doc */
-    (traverseproc)treebuilder_gc_traverse,          /* tp_traverse */
-    (inquiry)treebuilder_gc_clear,                  /* tp_clear */
+    (traverseproc)projection_gc_traverse,           /* tp_traverse */
+    (inquiry)projection_gc_clear,                   /* tp_clear */
     0,                                              /* tp_richcompare */
     0,                                              /* tp_weaklistoffset */
     0,                                              /* tp_iter */
     0,                                              /* tp_iternext */
-    treebuilder_methods,                            /* tp_methods */
+    projection_methods,                             /* tp_methods */
     0,                                              /* tp_members */
     0,                                              /* tp_getset */
     0,                                              /* tp_base */
@@ -2574,29 +4417,13 @@ static PyTypeObject TreeBuilder_Type = {
     0,                                              /* tp_descr_get */
     0,                                              /* tp_descr_set */
     0,                                              /* tp_dictoffset */
-    (initproc)treebuilder_init,                     /* tp_init */
+    (initproc)projection_init,                      /* tp_init */
     PyType_GenericAlloc,                            /* tp_alloc */
-    treebuilder_new,                                /* tp_new */
+    projection_new,                                 /* tp_new */
     0,                                              /* tp_free */
 };
 
-/* ==================================================================== */
-/* the expat interface */
-
-#if defined(USE_EXPAT)
-
-#include "expat/expat.h"
-
-#if defined(USE_PYEXPAT_CAPI)
-#include "pyexpat.h"
-static struct PyExpat_CAPI* expat_capi;
-#define EXPAT(func) (expat_capi->func)
-#else
-#define EXPAT(func) (XML_##func)
-#endif
-
-static XML_Memory_Handling_Suite ExpatMemoryHandler = {
-    PyObject_Malloc, PyObject_Realloc, PyObject_Free};
+/* -------------------------------------------------------------------- */
 
 typedef struct {
     PyObject_HEAD
@@ -2607,6 +4434,7 @@ typedef struct {
     PyObject *entity;
 
     PyObject *names;
+    PyObject *dtd; /* expat reads it when the prolog ends */
 
     PyObject *handle_start;
     PyObject *handle_data;
@@ -2618,6 +4446,18 @@ typedef struct {
 
     PyObject *handle_close;
 
+    /* parse_for() state */
+    Py_ssize_t document_size; /* -1 until parse_for() gets a document */
+    int document_done;
+    _PyTime_t deadline; /* 0 when not parsing against a time budget */
+    int deadline_countdown;
+
+#if defined(XML_PARSER_STATS)
+    unsigned long handler_calls;
+    _PyTime_t handler_time; /* inside our handlers */
+    _PyTime_t parse_time; /* inside expat, handlers included */
+#endif
+
 } XMLParserObject;
 
 static PyTypeObject XMLParser_Type;
@@ -2744,17 +4584,16 @@ expat_set_error(enum XML_Error error_code, int line, int column, char *message)
 /* handlers */
 
 static void
-expat_default_handler(XMLParserObject* self, const XML_Char* data_in,
-                      int data_len)
+expat_undefined_entity_handler(XMLParserObject* self, const XML_Char* name)
 {
+    /* reference to an entity that isn't declared in the document; look
+       it up in the parser's entity dictionary */
+
     PyObject* key;
     PyObject* value;
     PyObject* res;
 
-    if (data_len < 2 || data_in[0] != '&')
-        return;
-
-    key = PyUnicode_DecodeUTF8(data_in + 1, data_len - 2, "strict");
+    key = PyUnicode_DecodeUTF8(name, strlen(name), "strict");
     if (!key)
         return;
 
@@ -2772,8 +4611,9 @@ expat_default_handler(XMLParserObject* self, const XML_Char* data_in,
         Py_XDECREF(res);
     } else if (!PyErr_Occurred()) {
         /* Report the first error, not the last */
-        char message[128] = "undefined entity ";
-        strncat(message, data_in, data_len < 100?data_len:100);
+        char message[128];
+        PyOS_snprintf(message, sizeof(message), "undefined entity &%.100s;",
+                      name);
         expat_set_error(
             XML_ERROR_UNDEFINED_ENTITY,
             EXPAT(GetErrorLineNumber)(self->parser),
@@ -2785,6 +4625,22 @@ expat_default_handler(XMLParserObject* self, const XML_Char* data_in,
     Py_DECREF(key);
 }
 
+/* events between clock reads while parsing against a deadline */
+#define DEADLINE_CHECK_INTERVAL 64
+
+LOCAL(void)
+expat_check_deadline(XMLParserObject* self)
+{
+    /* suspend the parser once parse_for()'s time slice is used up */
+    if (!self->deadline || --self->deadline_countdown > 0)
+        return;
+    self->deadline_countdown = DEADLINE_CHECK_INTERVAL;
+    if (_PyTime_GetMonotonicClock() >= self->deadline) {
+        self->deadline = 0;
+        XML_StopParser(self->parser, XML_TRUE);
+    }
+}
+
 static void
 expat_start_handler(XMLParserObject* self, const XML_Char* tag_in,
                     const XML_Char **attrib_in)
@@ -2794,11 +4650,29 @@ expat_start_handler(XMLParserObject* self, const XML_Char* tag_in,
     PyObject* attrib;
     int ok;
 
+    expat_check_deadline(self);
+
+    if (Projection_CheckExact(self->target)) {
+        projection_start((ProjectionObject*) self->target, tag_in, attrib_in);
+        return;
+    }
+
     /* tag name */
     tag = makeuniversal(self, tag_in);
     if (!tag)
         return; /* parser will look for errors */
 
+    if (TreeBuilder_CheckExact(self->target) &&
+        ((TreeBuilderObject*) self->target)->filter) {
+        /* filtered events; elements may be skipped altogether */
+        ok = treebuilder_filter_start((TreeBuilderObject*) self->target,
+                                      tag, attrib_in);
+        if (ok <= 0) {
+            Py_DECREF(tag);
+            return;
+        }
+    }
+
     /* attributes */
     if (attrib_in[0]) {
         attrib = PyDict_New();
@@ -2852,6 +4726,14 @@ expat_data_handler(XMLParserObject* self, const XML_Char* data_in,
     PyObject* data;
     PyObject* res;
 
+    if (Projection_CheckExact(self->target))
+        return; /* projections don't capture text */
+
+    if (TreeBuilder_CheckExact(self->target) &&
+        ((TreeBuilderObject*) self->target)->filter &&
+        !treebuilder_filter_data((TreeBuilderObject*) self->target))
+        return;
+
     data = PyUnicode_DecodeUTF8(data_in, data_len, "strict");
     if (!data)
         return; /* parser will look for errors */
@@ -2875,6 +4757,8 @@ expat_end_handler(XMLParserObject* self, const XML_Char* tag_in)
     PyObject* tag;
     PyObject* res = NULL;
 
+    expat_check_deadline(self);
+
     if (TreeBuilder_CheckExact(self->target))
         /* shortcut */
         /* the standard tree builder doesn't look at the end tag */
@@ -3079,6 +4963,153 @@ expat_unknown_encoding_handler(XMLParserObject *self, const XML_Char *name,
     return XML_STATUS_OK;
 }
 
+#if defined(XML_PARSER_STATS)
+/* instrumented builds go through these, to count handler calls and the
+   time spent in them */
+
+#define TIMED_HANDLER(handler, params, args)                            \
+    static void                                                         \
+    handler##_timed params                                              \
+    {                                                                   \
+        _PyTime_t t0 = _PyTime_GetMonotonicClock();                     \
+        handler args;                                                   \
+        self->handler_time += _PyTime_GetMonotonicClock() - t0;         \
+        self->handler_calls++;                                          \
+    }
+
+TIMED_HANDLER(expat_start_handler,
+              (XMLParserObject* self, const XML_Char* tag_in,
+               const XML_Char **attrib_in),
+              (self, tag_in, attrib_in))
+TIMED_HANDLER(expat_end_handler,
+              (XMLParserObject* self, const XML_Char* tag_in),
+              (self, tag_in))
+TIMED_HANDLER(expat_data_handler,
+              (XMLParserObject* self, const XML_Char* data_in, int data_len),
+              (self, data_in, data_len))
+TIMED_HANDLER(expat_comment_handler,
+              (XMLParserObject* self, const XML_Char* comment_in),
+              (self, comment_in))
+TIMED_HANDLER(expat_pi_handler,
+              (XMLParserObject* self, const XML_Char* target_in,
+               const XML_Char* data_in),
+              (self, target_in, data_in))
+
+#define HANDLER(handler) handler##_timed
+#else
+#define HANDLER(handler) handler
+#endif
+
+/* -------------------------------------------------------------------- */
+/* precompiled DTDs: a DTD is parsed once into an expat DTD, and copied
+   from there into each parser created with it, instead of being read
+   again by every parse that needs its entities and attribute defaults */
+
+typedef struct {
+    PyObject_HEAD
+
+    XML_Parser parser; /* holds the declarations; never parses documents */
+} DTDObject;
+
+static PyTypeObject DTD_Type;
+
+#define DTD_CheckExact(op) (Py_TYPE(op) == &DTD_Type)
+
+static PyObject *
+dtd_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    DTDObject *self = (DTDObject *)type->tp_alloc(type, 0);
+    if (self)
+        self->parser = NULL;
+    return (PyObject *)self;
+}
+
+static int
+dtd_init(PyObject *self_, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"data", 0};
+    DTDObject *self = (DTDObject *)self_;
+    char *data;
+    int data_len;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s#:DTD", kwlist,
+                                     &data, &data_len))
+        return -1;
+
+    if (self->parser) {
+        /* parsers created with it still read its declarations */
+        PyErr_SetString(PyExc_ValueError, "DTD already initialized");
+        return -1;
+    }
+    /* same namespace handling as the parsers that will use it */
+    self->parser = EXPAT(ParserCreate_MM)(NULL, &ExpatMemoryHandler, "}");
+    if (!self->parser) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    if (XML_ParseDTD(self->parser, data, data_len) != XML_STATUS_OK) {
+        expat_set_error(
+            EXPAT(GetErrorCode)(self->parser),
+            EXPAT(GetErrorLineNumber)(self->parser),
+            EXPAT(GetErrorColumnNumber)(self->parser),
+            NULL
+            );
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+dtd_dealloc(DTDObject *self)
+{
+    if (self->parser)
+        EXPAT(ParserFree)(self->parser);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyTypeObject DTD_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "ciElementTree.DTD", sizeof(DTDObject), 0,
+    /* methods */
+    (destructor)dtd_dealloc,                        /* tp_dealloc */
+    0,                                              /* tp_print */
+    0,                                              /* tp_getattr */
+    0,                                              /* tp_setattr */
+    0,                                              /* tp_reserved */
+    0,                                              /* tp_repr */
+    0,                                              /* tp_as_number */
+    0,                                              /* tp_as_sequence */
+    0,                                              /* tp_as_mapping */
+    0,                                              /* tp_hash */
+    0,                                              /* tp_call */
+    0,                                              /* tp_str */
+    0,                                              /* tp_getattro */
+    0,                                              /* tp_setattro */
+    0,                                              /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                             /* tp_flags */
+    0,                                              /* tp_doc */
+    0,                                              /* tp_traverse */
+    0,                                              /* tp_clear */
+    0,                                              /* tp_richcompare */
+    0,                                              /* tp_weaklistoffset */
+    0,                                              /* tp_iter */
+    0,                                              /* tp_iternext */
+    0,                                              /* tp_methods */
+    0,                                              /* tp_members */
+    0,                                              /* tp_getset */
+    0,                                              /* tp_base */
+    0,                                              /* tp_dict */
+    0,                                              /* tp_descr_get */
+    0,                                              /* tp_descr_set */
+    0,                                              /* tp_dictoffset */
+    (initproc)dtd_init,                             /* tp_init */
+    PyType_GenericAlloc,                            /* tp_alloc */
+    dtd_new,                                        /* tp_new */
+    0,                                              /* tp_free */
+};
+
 /* -------------------------------------------------------------------- */
 
 static PyObject *
@@ -3087,10 +5118,18 @@ xmlparser_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
     XMLParserObject *self = (XMLParserObject *)type->tp_alloc(type, 0);
     if (self) {
         self->parser = NULL;
-        self->target = self->entity = self->names = NULL;
+        self->target = self->entity = self->names = self->dtd = NULL;
         self->handle_start = self->handle_data = self->handle_end = NULL;
         self->handle_comment = self->handle_pi = self->handle_close = NULL;
         self->handle_doctype = NULL;
+        self->document_size = -1;
+        self->document_done = 0;
+        self->deadline = 0;
+        self->deadline_countdown = 0;
+#if defined(XML_PARSER_STATS)
+        self->handler_calls = 0;
+        self->handler_time = self->parse_time = 0;
+#endif
     }
     return (PyObject *)self;
 }
@@ -3101,10 +5140,16 @@ xmlparser_init(PyObject *self, PyObject *args, PyObject *kwds)
     XMLParserObject *self_xp = (XMLParserObject *)self;
     PyObject *target = NULL, *html = NULL;
     char *encoding = NULL;
-    static char *kwlist[] = {"html", "target", "encoding", 0};
-
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OOz:XMLParser", kwlist,
-                                     &html, &target, &encoding)) {
+    int size_hint = 0;
+    int context_bytes = 0;
+    PyObject *dtd = NULL;
+    static char *kwlist[] = {"html", "target", "encoding", "size_hint",
+                             "context_bytes", "dtd", 0};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OOziiO!:XMLParser",
+                                     kwlist, &html, &target, &encoding,
+                                     &size_hint, &context_bytes,
+                                     &DTD_Type, &dtd)) {
         return -1;
     }
 
@@ -3126,6 +5171,27 @@ xmlparser_init(PyObject *self, PyObject *args, PyObject *kwds)
         return -1;
     }
 
+    if (size_hint > 0)
+        XML_SetPoolSizeHint(self_xp->parser, size_hint);
+    /* we never ask for the input context, so by default don't keep any
+       and let expat parse fed data in place */
+    XML_SetContextBytes(self_xp->parser, context_bytes);
+
+    if (dtd && !((DTDObject*) dtd)->parser) {
+        Py_CLEAR(self_xp->entity);
+        Py_CLEAR(self_xp->names);
+        EXPAT(ParserFree)(self_xp->parser);
+        self_xp->parser = NULL;
+        PyErr_SetString(PyExc_ValueError, "DTD not initialized");
+        return -1;
+    }
+    if (dtd) {
+        /* can't fail before parsing has started */
+        XML_CopyDTD(self_xp->parser, ((DTDObject*) dtd)->parser);
+        Py_INCREF(dtd);
+        Py_XSETREF(self_xp->dtd, dtd);
+    }
+
     if (target) {
         Py_INCREF(target);
     } else {
@@ -3153,26 +5219,26 @@ xmlparser_init(PyObject *self, PyObject *args, PyObject *kwds)
     EXPAT(SetUserData)(self_xp->parser, self_xp);
     EXPAT(SetElementHandler)(
         self_xp->parser,
-        (XML_StartElementHandler) expat_start_handler,
-        (XML_EndElementHandler) expat_end_handler
+        (XML_StartElementHandler) HANDLER(expat_start_handler),
+        (XML_EndElementHandler) HANDLER(expat_end_handler)
         );
-    EXPAT(SetDefaultHandlerExpand)(
+    XML_SetUndefinedEntityHandler(
         self_xp->parser,
-        (XML_DefaultHandler) expat_default_handler
+        (XML_UndefinedEntityHandler) expat_undefined_entity_handler
         );
     EXPAT(SetCharacterDataHandler)(
         self_xp->parser,
-        (XML_CharacterDataHandler) expat_data_handler
+        (XML_CharacterDataHandler) HANDLER(expat_data_handler)
         );
     if (self_xp->handle_comment)
         EXPAT(SetCommentHandler)(
             self_xp->parser,
-            (XML_CommentHandler) expat_comment_handler
+            (XML_CommentHandler) HANDLER(expat_comment_handler)
             );
     if (self_xp->handle_pi)
         EXPAT(SetProcessingInstructionHandler)(
             self_xp->parser,
-            (XML_ProcessingInstructionHandler) expat_pi_handler
+            (XML_ProcessingInstructionHandler) HANDLER(expat_pi_handler)
             );
     EXPAT(SetStartDoctypeDeclHandler)(
         self_xp->parser,
@@ -3199,6 +5265,7 @@ xmlparser_gc_traverse(XMLParserObject *self, visitproc visit, void *arg)
     Py_VISIT(self->target);
     Py_VISIT(self->entity);
     Py_VISIT(self->names);
+    Py_VISIT(self->dtd);
 
     return 0;
 }
@@ -3219,6 +5286,7 @@ xmlparser_gc_clear(XMLParserObject *self)
     Py_CLEAR(self->target);
     Py_CLEAR(self->entity);
     Py_CLEAR(self->names);
+    Py_CLEAR(self->dtd);
 
     return 0;
 }
@@ -3235,9 +5303,16 @@ LOCAL(PyObject*)
 expat_parse(XMLParserObject* self, char* data, int data_len, int final)
 {
     int ok;
+#if defined(XML_PARSER_STATS)
+    _PyTime_t t0 = _PyTime_GetMonotonicClock();
+#endif
 
     ok = EXPAT(Parse)(self->parser, data, data_len, final);
 
+#if defined(XML_PARSER_STATS)
+    self->parse_time += _PyTime_GetMonotonicClock() - t0;
+#endif
+
     if (PyErr_Occurred())
         return NULL;
 
@@ -3263,7 +5338,12 @@ xmlparser_close(XMLParserObject* self, PyObject* args)
     if (!PyArg_ParseTuple(args, ":close"))
         return NULL;
 
-    res = expat_parse(self, "", 0, 1);
+    if (self->document_done) {
+        /* parse_for() already finished the parse */
+        Py_INCREF(Py_None);
+        res = Py_None;
+    } else
+        res = expat_parse(self, "", 0, 1);
     if (!res)
         return NULL;
 
@@ -3287,7 +5367,87 @@ xmlparser_feed(XMLParserObject* self, PyObject* args)
     if (!PyArg_ParseTuple(args, "s#:feed", &data, &data_len))
         return NULL;
 
-    return expat_parse(self, data, data_len, 0);
+    return expat_parse(self, data, data_len, 0);
+}
+
+static PyObject*
+xmlparser_parse_for(XMLParserObject* self, PyObject* args)
+{
+    /* parse a complete document in slices of about deadline_ms each; the
+       document is passed on the first call only.  returns the fraction
+       parsed so far, and 1.0 once done, after which close() returns the
+       result as usual */
+
+    double deadline_ms;
+    char* data = NULL;
+    int data_len = 0;
+    enum XML_Status status;
+#if defined(XML_PARSER_STATS)
+    _PyTime_t t0;
+#endif
+
+    if (!PyArg_ParseTuple(args, "d|s#:parse_for", &deadline_ms,
+                          &data, &data_len))
+        return NULL;
+
+    if (data && self->document_size >= 0) {
+        PyErr_SetString(PyExc_ValueError, "document already given");
+        return NULL;
+    }
+    if (!data && self->document_size < 0) {
+        PyErr_SetString(PyExc_ValueError, "no document to parse");
+        return NULL;
+    }
+    if (self->document_done)
+        return PyFloat_FromDouble(1.0);
+
+    if (data) {
+        /* copy it into expat's own buffer once, so suspending doesn't
+           make expat save the rest of it on every slice */
+        void* buffer = XML_GetBuffer(self->parser, data_len);
+        if (!buffer)
+            return PyErr_NoMemory();
+        memcpy(buffer, data, data_len);
+        self->document_size = data_len;
+    }
+
+    self->deadline = _PyTime_GetMonotonicClock() +
+        (_PyTime_t) (deadline_ms * 1e6);
+    self->deadline_countdown = DEADLINE_CHECK_INTERVAL;
+
+#if defined(XML_PARSER_STATS)
+    t0 = _PyTime_GetMonotonicClock();
+#endif
+    if (data)
+        status = XML_ParseBuffer(self->parser, data_len, 1);
+    else
+        status = XML_ResumeParser(self->parser);
+#if defined(XML_PARSER_STATS)
+    self->parse_time += _PyTime_GetMonotonicClock() - t0;
+#endif
+
+    self->deadline = 0;
+
+    if (PyErr_Occurred())
+        return NULL;
+
+    if (status == XML_STATUS_ERROR) {
+        expat_set_error(
+            EXPAT(GetErrorCode)(self->parser),
+            EXPAT(GetErrorLineNumber)(self->parser),
+            EXPAT(GetErrorColumnNumber)(self->parser),
+            NULL
+            );
+        return NULL;
+    }
+
+    if (status == XML_STATUS_SUSPENDED && self->document_size > 0)
+        return PyFloat_FromDouble(
+            (double) XML_GetCurrentByteIndex(self->parser) /
+            self->document_size);
+
+    self->document_done = 1;
+    return PyFloat_FromDouble(1.0);
 }
 
 static PyObject*
@@ -3371,19 +5531,16 @@ xmlparser_doctype(XMLParserObject *self, PyObject *args)
     Py_RETURN_NONE;
 }
 
-static PyObject*
-xmlparser_setevents(XMLParserObject *self, PyObject* args)
+LOCAL(int)
+xmlparser_setevents_impl(XMLParserObject *self, PyObject* events,
+                         PyObject* event_set)
 {
-    /* activate element event reporting */
+    /* activate element event reporting, either into the given list or,
+       if events is NULL, into the target's event ring buffer */
 
     Py_ssize_t i;
     TreeBuilderObject* target;
-
-    PyObject* events; /* event collector */
-    PyObject* event_set = Py_None;
-    if (!PyArg_ParseTuple(args, "O!|O:_setevents",  &PyList_Type, &events,
-                          &event_set))
-        return NULL;
+    PyObject* seq;
 
     if (!TreeBuilder_CheckExact(self->target)) {
         PyErr_SetString(
@@ -3391,14 +5548,18 @@ xmlparser_setevents(XMLParserObject *self, PyObject* args)
             "event handling only supported for ElementTree.TreeBuilder "
             "targets"
             );
-        return NULL;
+        return -1;
     }
 
     target = (TreeBuilderObject*) self->target;
 
-    Py_INCREF(events);
-    Py_XDECREF(target->events);
-    target->events = events;
+    if (events) {
+        treebuilder_clear_ring(target);
+        Py_INCREF(events);
+        Py_XDECREF(target->events);
+        target->events = events;
+    } else if (treebuilder_init_ring(target) < 0)
+        return -1;
 
     /* clear out existing events */
     Py_CLEAR(target->start_event_obj);
@@ -3409,22 +5570,26 @@ xmlparser_setevents(XMLParserObject *self, PyObject* args)
     if (event_set == Py_None) {
         /* default is "end" only */
         target->end_event_obj = PyUnicode_FromString("end");
-        Py_RETURN_NONE;
+        return target->end_event_obj ? 0 : -1;
     }
 
-    if (!PyTuple_Check(event_set)) /* FIXME: handle arbitrary sequences */
+    seq = PySequence_Fast(event_set, "");
+    if (!seq)
         goto error;
 
-    for (i = 0; i < PyTuple_GET_SIZE(event_set); i++) {
-        PyObject* item = PyTuple_GET_ITEM(event_set, i);
+    for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+        PyObject* item = PySequence_Fast_GET_ITEM(seq, i);
         char* event;
         if (PyUnicode_Check(item)) {
             event = _PyUnicode_AsString(item);
-            if (event == NULL)
+            if (event == NULL) {
+                Py_DECREF(seq);
                 goto error;
+            }
         } else if (PyBytes_Check(item))
             event = PyBytes_AS_STRING(item);
         else {
+            Py_DECREF(seq);
             goto error;
         }
         if (strcmp(event, "start") == 0) {
@@ -3458,26 +5623,125 @@ xmlparser_setevents(XMLParserObject *self, PyObject* args)
                 PyExc_ValueError,
                 "unknown event '%s'", event
                 );
-            return NULL;
+            Py_DECREF(seq);
+            return -1;
         }
     }
 
-    Py_RETURN_NONE;
+    Py_DECREF(seq);
+    return 0;
 
   error:
     PyErr_SetString(
         PyExc_TypeError,
         "invalid event tuple"
         );
+    return -1;
+}
+
+static PyObject*
+xmlparser_setevents(XMLParserObject *self, PyObject* args)
+{
+    /* activate element event reporting */
+
+    PyObject* events; /* event collector */
+    PyObject* event_set = Py_None;
+    if (!PyArg_ParseTuple(args, "O!|O:_setevents",  &PyList_Type, &events,
+                          &event_set))
+        return NULL;
+
+    if (xmlparser_setevents_impl(self, events, event_set) < 0)
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+xmlparser_stats(XMLParserObject* self, PyObject* args)
+{
+    /* parser counters; everything but the buffer and pool totals needs
+       a build with XML_PARSER_STATS */
+
+    unsigned long moved, allocs;
+    PyObject* stats;
+#if defined(XML_PARSER_STATS)
+    XML_ParserStats counters;
+    PyObject* tokens;
+    PyObject* extra;
+    int i;
+#endif
+
+    if (!PyArg_ParseTuple(args, ":stats"))
+        return NULL;
+
+    XML_GetBufferStats(self->parser, &moved, &allocs);
+    stats = Py_BuildValue(
+        "{sksksk}",
+        "pool_grows", XML_GetPoolGrowCount(self->parser),
+        "buffer_bytes_moved", moved,
+        "buffer_allocs", allocs
+        );
+
+#if defined(XML_PARSER_STATS)
+    if (!stats)
+        return NULL;
+
+    XML_GetParserStats(self->parser, &counters);
+
+    tokens = PyDict_New();
+    if (!tokens || PyDict_SetItemString(stats, "tokens", tokens) < 0) {
+        Py_XDECREF(tokens);
+        goto error;
+    }
+    Py_DECREF(tokens);
+    for (i = 0; i < XML_STATS_TOKEN_TYPES; i++) {
+        PyObject* count;
+        if (!counters.tokens[i])
+            continue;
+        count = PyLong_FromUnsignedLong(counters.tokens[i]);
+        if (!count || PyDict_SetItemString(
+                tokens, XML_GetStatsTokenName(i), count) < 0) {
+            Py_XDECREF(count);
+            goto error;
+        }
+        Py_DECREF(count);
+    }
+
+    extra = Py_BuildValue(
+        "{sksksksksksdsd}",
+        "lookups", counters.lookups,
+        "lookup_probes", counters.lookupProbes,
+        "pool_grow_calls", counters.poolGrows,
+        "pool_grow_bytes", counters.poolGrowBytes,
+        "handler_calls", self->handler_calls,
+        "handler_time", _PyTime_AsSecondsDouble(self->handler_time),
+        "expat_time", _PyTime_AsSecondsDouble(
+            self->parse_time - self->handler_time)
+        );
+    if (!extra || PyDict_Update(stats, extra) < 0) {
+        Py_XDECREF(extra);
+        goto error;
+    }
+    Py_DECREF(extra);
+#endif
+
+    return stats;
+
+#if defined(XML_PARSER_STATS)
+  error:
+    Py_DECREF(stats);
     return NULL;
+#endif
 }
 
 static PyMethodDef xmlparser_methods[] = {
     {"feed", (PyCFunction) xmlparser_feed, METH_VARARGS},
+    {"parse_for", (PyCFunction) xmlparser_parse_for, METH_VARARGS},
     {"close", (PyCFunction) xmlparser_close, METH_VARARGS},
     {"_parse", (PyCFunction) xmlparser_parse, METH_VARARGS},
     {"_setevents", (PyCFunction) xmlparser_setevents, METH_VARARGS},
     {"doctype", (PyCFunction) xmlparser_doctype, METH_VARARGS},
+    {"stats", (PyCFunction) xmlparser_stats, METH_VARARGS},
     {NULL, NULL}
 };
 
@@ -3495,6 +5759,14 @@ xmlparser_getattro(XMLParserObject* self, PyObject* nameobj)
                 "Expat %d.%d.%d", XML_MAJOR_VERSION,
                 XML_MINOR_VERSION, XML_MICRO_VERSION);
         }
+        else if (PyUnicode_CompareWithASCIIString(nameobj, "pool_grows") == 0)
+            return PyLong_FromUnsignedLong(
+                XML_GetPoolGrowCount(self->parser));
+        else if (PyUnicode_CompareWithASCIIString(nameobj, "buffer_stats") == 0) {
+            unsigned long moved, allocs;
+            XML_GetBufferStats(self->parser, &moved, &allocs);
+            return Py_BuildValue("(kk)", moved, allocs);
+        }
         else
             goto generic;
 
@@ -3547,6 +5819,357 @@ static PyTypeObject XMLParser_Type = {
     0,                                              /* tp_free */
 };
 
+/* ==================================================================== */
+/* the iterparse type */
+
+/* default number of bytes read from the source per parser feed */
+#define ITERPARSE_CHUNK_SIZE (64*1024)
+
+typedef struct {
+    PyObject_HEAD
+
+    PyObject *file; /* source file object */
+    PyObject *reader; /* bound read method of the source */
+    int close_file; /* true if we opened the source ourselves */
+
+    XMLParserObject *parser; /* NULL once the document is done */
+    TreeBuilderObject *target; /* the parser's tree builder */
+
+    PyObject *root; /* root element, once the parser is closed */
+
+    /* delayed parse error; reported once pending events are consumed */
+    PyObject *error_type;
+    PyObject *error_value;
+    PyObject *error_traceback;
+
+    Py_ssize_t chunk_size; /* bytes per read() call */
+
+    int clear; /* detach elements from the tree once consumed */
+    PyObject *consumed; /* element of the last consumed "end" event */
+    PyObject *consumed_parent; /* and its parent */
+
+} IterParseObject;
+
+static PyTypeObject IterParse_Type;
+
+LOCAL(void)
+iterparse_release_consumed(IterParseObject* self)
+{
+    /* in clear mode, detach the element of the last consumed "end" event
+       from its parent, so that memory use stays bounded */
+
+    PyObject* elem = self->consumed;
+    PyObject* parent = self->consumed_parent;
+
+    self->consumed = self->consumed_parent = NULL;
+
+    if (!elem)
+        return;
+
+    if (parent && Element_CheckExact(parent)) {
+        ElementObjectExtra* extra = ((ElementObject*) parent)->extra;
+        if (extra) {
+            int i;
+            /* consumed children are dropped as we go, so the element is
+               normally found right away */
+            for (i = 0; i < extra->length; i++) {
+                if (extra->children[i] == elem) {
+                    extra->length--;
+                    memmove(extra->children + i, extra->children + i + 1,
+                            (extra->length - i) * sizeof(PyObject*));
+                    Py_DECREF(elem);
+                    break;
+                }
+            }
+            if (extra->names != Py_None) { /* FIXME: could just update dict */
+                Py_DECREF(extra->names);
+                extra->names = Py_None;
+                Py_INCREF(Py_None);
+            }
+        }
+    }
+
+    Py_DECREF(elem);
+    Py_XDECREF(parent);
+}
+
+static PyObject *
+iterparse_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"source", "events", "chunk_size", "clear",
+                             "tags", "attrib", "skip", 0};
+    PyObject *source;
+    PyObject *events = Py_None;
+    Py_ssize_t chunk_size = ITERPARSE_CHUNK_SIZE;
+    int clear = 0;
+    PyObject *tags = Py_None;
+    PyObject *attrib = Py_None;
+    int skip = 0;
+    IterParseObject *self;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OniOOi:iterparse", kwlist,
+                                     &source, &events, &chunk_size, &clear,
+                                     &tags, &attrib, &skip))
+        return NULL;
+
+    if (chunk_size <= 0 || chunk_size > INT_MAX) {
+        PyErr_SetString(PyExc_ValueError, "chunk_size out of range");
+        return NULL;
+    }
+
+    self = (IterParseObject *)type->tp_alloc(type, 0);
+    if (!self)
+        return NULL;
+
+    self->chunk_size = chunk_size;
+    self->clear = clear;
+
+    if (!PyObject_HasAttrString(source, "read")) {
+        PyObject* io = PyImport_ImportModule("io");
+        if (!io)
+            goto error;
+        self->file = PyObject_CallMethod(io, "open", "Os", source, "rb");
+        Py_DECREF(io);
+        if (!self->file)
+            goto error;
+        self->close_file = 1;
+    } else {
+        Py_INCREF(source);
+        self->file = source;
+    }
+
+    self->reader = PyObject_GetAttrString(self->file, "read");
+    if (!self->reader)
+        goto error;
+
+    self->parser = (XMLParserObject*) PyObject_CallFunctionObjArgs(
+        (PyObject*) &XMLParser_Type, NULL);
+    if (!self->parser)
+        goto error;
+
+    Py_INCREF(self->parser->target);
+    self->target = (TreeBuilderObject*) self->parser->target;
+
+    if (xmlparser_setevents_impl(self->parser, NULL, events) < 0)
+        goto error;
+
+    if (treebuilder_set_filter(self->target, tags, attrib, skip) < 0)
+        goto error;
+
+    Py_INCREF(Py_None);
+    self->root = Py_None;
+
+    return (PyObject *)self;
+
+  error:
+    if (self->close_file && self->file) {
+        PyObject* res = PyObject_CallMethod(self->file, "close", NULL);
+        Py_XDECREF(res);
+    }
+    Py_DECREF(self);
+    return NULL;
+}
+
+static int
+iterparse_gc_traverse(IterParseObject *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->file);
+    Py_VISIT(self->reader);
+    Py_VISIT(self->parser);
+    Py_VISIT(self->target);
+    Py_VISIT(self->root);
+    Py_VISIT(self->error_type);
+    Py_VISIT(self->error_value);
+    Py_VISIT(self->error_traceback);
+    Py_VISIT(self->consumed);
+    Py_VISIT(self->consumed_parent);
+    return 0;
+}
+
+static int
+iterparse_gc_clear(IterParseObject *self)
+{
+    Py_CLEAR(self->consumed_parent);
+    Py_CLEAR(self->consumed);
+    Py_CLEAR(self->error_traceback);
+    Py_CLEAR(self->error_value);
+    Py_CLEAR(self->error_type);
+    Py_CLEAR(self->root);
+    Py_CLEAR(self->target);
+    Py_CLEAR(self->parser);
+    Py_CLEAR(self->reader);
+    Py_CLEAR(self->file);
+    return 0;
+}
+
+static void
+iterparse_dealloc(IterParseObject *self)
+{
+    PyObject_GC_UnTrack(self);
+    iterparse_gc_clear(self);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+LOCAL(int)
+iterparse_feed(IterParseObject* self)
+{
+    /* read the next chunk from the source and feed it to the parser,
+       closing the parser at end of input.  parse errors are stored, to
+       be reported once the events produced before them are consumed.
+       returns -1 if reading the source fails */
+
+    PyObject* buffer;
+    PyObject* res;
+
+    buffer = PyObject_CallFunction(self->reader, "n", self->chunk_size);
+    if (!buffer)
+        return -1;
+
+    if (PyUnicode_CheckExact(buffer)) {
+        /* A unicode object is encoded into bytes using UTF-8 */
+        PyObject* temp;
+        if (PyUnicode_GET_LENGTH(buffer) == 0) {
+            Py_DECREF(buffer);
+            buffer = NULL;
+        } else {
+            temp = PyUnicode_AsEncodedString(buffer, "utf-8", "surrogatepass");
+            Py_DECREF(buffer);
+            if (!temp)
+                return -1;
+            buffer = temp;
+        }
+    }
+    else if (!PyBytes_CheckExact(buffer) || PyBytes_GET_SIZE(buffer) == 0) {
+        Py_DECREF(buffer);
+        buffer = NULL;
+    }
+
+    if (buffer) {
+        res = expat_parse(
+            self->parser, PyBytes_AS_STRING(buffer),
+            (int) PyBytes_GET_SIZE(buffer), 0
+            );
+        Py_DECREF(buffer);
+    } else {
+        res = expat_parse(self->parser, "", 0, 1);
+        if (res) {
+            Py_DECREF(res);
+            res = treebuilder_done(self->target);
+            if (res) {
+                Py_DECREF(self->root);
+                self->root = res;
+                Py_INCREF(res);
+            }
+        }
+        Py_CLEAR(self->parser);
+    }
+
+    if (!res)
+        PyErr_Fetch(&self->error_type, &self->error_value,
+                    &self->error_traceback);
+    else
+        Py_DECREF(res);
+
+    return 0;
+}
+
+static PyObject*
+iterparse_iternext(IterParseObject* self)
+{
+    EventItem event;
+    PyObject* res;
+
+    if (self->clear)
+        iterparse_release_consumed(self);
+
+    for (;;) {
+        if (self->target && treebuilder_pop_event(self->target, &event)) {
+            res = PyTuple_Pack(2, event.action, event.item);
+            if (res && self->clear && event.parent) {
+                /* keep a hold on the element until the next call */
+                self->consumed = event.item;
+                self->consumed_parent = event.parent;
+            } else {
+                Py_DECREF(event.item);
+                Py_XDECREF(event.parent);
+            }
+            Py_DECREF(event.action);
+            return res;
+        }
+
+        if (self->error_type) {
+            PyErr_Restore(self->error_type, self->error_value,
+                          self->error_traceback);
+            self->error_type = self->error_value = NULL;
+            self->error_traceback = NULL;
+            return NULL;
+        }
+
+        if (!self->parser) {
+            /* all done; drop the builder and close the source */
+            Py_CLEAR(self->target);
+            if (self->close_file && self->file) {
+                self->close_file = 0;
+                res = PyObject_CallMethod(self->file, "close", NULL);
+                if (!res)
+                    return NULL;
+                Py_DECREF(res);
+            }
+            return NULL;
+        }
+
+        if (iterparse_feed(self) < 0)
+            return NULL;
+    }
+}
+
+static PyMemberDef iterparse_members[] = {
+    {"root", T_OBJECT, offsetof(IterParseObject, root), READONLY},
+    {"chunk_size", T_PYSSIZET, offsetof(IterParseObject, chunk_size), READONLY},
+    {NULL}
+};
+
+static PyTypeObject IterParse_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "ciElementTree.iterparse", sizeof(IterParseObject), 0,
+    /* methods */
+    (destructor)iterparse_dealloc,                  /* tp_dealloc */
+    0,                                              /* tp_print */
+    0,                                              /* tp_getattr */
+    0,                                              /* tp_setattr */
+    0,                                              /* tp_reserved */
+    0,                                              /* tp_repr */
+    0,                                              /* tp_as_number */
+    0,                                              /* tp_as_sequence */
+    0,                                              /* tp_as_mapping */
+    0,                                              /* tp_hash */
+    0,                                              /* tp_call */
+    0,                                              /* tp_str */
+    0,                                              /* tp_getattro */
+    0,                                              /* tp_setattro */
+    0,                                              /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,        /* tp_flags */
+    0,                                              /* tp_doc */
+    (traverseproc)iterparse_gc_traverse,            /* tp_traverse */
+    (inquiry)iterparse_gc_clear,                    /* tp_clear */
+    0,                                              /* tp_richcompare */
+    0,                                              /* tp_weaklistoffset */
+    PyObject_SelfIter,                              /* tp_iter */
+    (iternextfunc)iterparse_iternext,               /* tp_iternext */
+    0,                                              /* tp_methods */
+    iterparse_members,                              /* tp_members */
+    0,                                              /* tp_getset */
+    0,                                              /* tp_base */
+    0,                                              /* tp_dict */
+    0,                                              /* tp_descr_get */
+    0,                                              /* tp_descr_set */
+    0,                                              /* tp_dictoffset */
+    0,                                              /* tp_init */
+    PyType_GenericAlloc,                            /* tp_alloc */
+    iterparse_new,                                  /* tp_new */
+    0,                                              /* tp_free */
+};
+
 #endif
 
 /* ==================================================================== */
@@ -3554,6 +6177,9 @@ static PyTypeObject XMLParser_Type = {
 
 static PyMethodDef _functions[] = {
     {"SubElement", (PyCFunction) subelement, METH_VARARGS | METH_KEYWORDS},
+    {"tostring", (PyCFunction) elementtree_tostring,
+     METH_VARARGS | METH_KEYWORDS},
+    {"dump", (PyCFunction) elementtree_dump, METH_VARARGS},
     {NULL, NULL}
 };
 
@@ -3581,9 +6207,17 @@ PyInit__ciElementTree(void)
         return NULL;
     if (PyType_Ready(&Element_Type) < 0)
         return NULL;
+    if (PyType_Ready(&XMLWriter_Type) < 0)
+        return NULL;
 #if defined(USE_EXPAT)
     if (PyType_Ready(&XMLParser_Type) < 0)
         return NULL;
+    if (PyType_Ready(&IterParse_Type) < 0)
+        return NULL;
+    if (PyType_Ready(&DTD_Type) < 0)
+        return NULL;
+    if (PyType_Ready(&Projection_Type) < 0)
+        return NULL;
 #endif
 
     m = PyModule_Create(&ciElementTreemodule);
@@ -3674,55 +6308,6 @@ PyInit__ciElementTree(void)
         "  return tree\n"
         "cElementTree.parse = parse\n"
 
-        "class iterparse(object):\n"
-        " root = None\n"
-        " def __init__(self, file, events=None):\n"
-        "  self._close_file = False\n"
-        "  if not hasattr(file, 'read'):\n"
-        "    file = open(file, 'rb')\n"
-        "    self._close_file = True\n"
-        "  self._file = file\n"
-        "  self._events = []\n"
-        "  self._index = 0\n"
-        "  self._error = None\n"
-        "  self.root = self._root = None\n"
-        "  b = cElementTree.TreeBuilder()\n"
-        "  self._parser = cElementTree.XMLParser(b)\n"
-        "  self._parser._setevents(self._events, events)\n"
-        " def __next__(self):\n"
-        "  while True:\n"
-        "    try:\n"
-        "      item = self._events[self._index]\n"
-        "      self._index += 1\n"
-        "      return item\n"
-        "    except IndexError:\n"
-        "      pass\n"
-        "    if self._error:\n"
-        "      e = self._error\n"
-        "      self._error = None\n"
-        "      raise e\n"
-        "    if self._parser is None:\n"
-        "      self.root = self._root\n"
-        "      if self._close_file:\n"
-        "        self._file.close()\n"
-        "      raise StopIteration\n"
-        "    # load event buffer\n"
-        "    del self._events[:]\n"
-        "    self._index = 0\n"
-        "    data = self._file.read(16384)\n"
-        "    if data:\n"
-        "      try:\n"
-        "        self._parser.feed(data)\n"
-        "      except SyntaxError as exc:\n"
-        "        self._error = exc\n"
-        "    else:\n"
-        "      self._root = self._parser.close()\n"
-        "      self._parser = None\n"
-        " next = __next__\n"
-        " def __iter__(self):\n"
-        "  return self\n"
-        "cElementTree.iterparse = iterparse\n"
-
         "class PIProxy:\n"
         " def __call__(self, target, text=None):\n"
         "  element = cElementTree.Element(ET.PI)\n"
@@ -3758,11 +6343,9 @@ PyInit__ciElementTree(void)
         "  ET._namespace_map[uri] = prefix\n"
         "cElementTree.register_namespace = register_namespace\n"
 
-        "cElementTree.dump = ET.dump\n"
         "cElementTree.ElementPath = ElementPath = ET.ElementPath\n"
         "cElementTree.iselement = ET.iselement\n"
         "cElementTree.QName = ET.QName\n"
-        "cElementTree.tostring = ET.tostring\n"
         "cElementTree.fromstringlist = ET.fromstringlist\n"
         "cElementTree.tostringlist = ET.tostringlist\n"
         "cElementTree.VERSION = '" VERSION "'\n"
@@ -3786,6 +6369,15 @@ PyInit__ciElementTree(void)
     elementtree_iter_obj = PyDict_GetItemString(g, "iter");
     elementtree_itertext_obj = PyDict_GetItemString(g, "itertext");
 
+    /* the serializer falls back on ElementTree's own */
+    temp = PyDict_GetItemString(g, "ET");
+    if (!temp)
+        return NULL;
+    elementtree_tostring_obj = PyObject_GetAttrString(temp, "tostring");
+    elementtree_dump_obj = PyObject_GetAttrString(temp, "dump");
+    if (!elementtree_tostring_obj || !elementtree_dump_obj)
+        return NULL;
+
 #if defined(USE_PYEXPAT_CAPI)
     /* link against pyexpat */
     expat_capi = PyCapsule_Import(PyExpat_CAPSULE_NAME, 0);
@@ -3817,9 +6409,21 @@ PyInit__ciElementTree(void)
     Py_INCREF((PyObject *)&TreeBuilder_Type);
     PyModule_AddObject(m, "TreeBuilder", (PyObject *)&TreeBuilder_Type);
 
+    Py_INCREF((PyObject *)&XMLWriter_Type);
+    PyModule_AddObject(m, "XMLWriter", (PyObject *)&XMLWriter_Type);
+
 #if defined(USE_EXPAT)
     Py_INCREF((PyObject *)&XMLParser_Type);
     PyModule_AddObject(m, "XMLParser", (PyObject *)&XMLParser_Type);
+
+    Py_INCREF((PyObject *)&IterParse_Type);
+    PyModule_AddObject(m, "iterparse", (PyObject *)&IterParse_Type);
+
+    Py_INCREF((PyObject *)&DTD_Type);
+    PyModule_AddObject(m, "DTD", (PyObject *)&DTD_Type);
+
+    Py_INCREF((PyObject *)&Projection_Type);
+    PyModule_AddObject(m, "Projection", (PyObject *)&Projection_Type);
 #endif
 
     return m;
@@ -0,0 +1,48 @@
+"""Tests for precompiled DTDs (DTD() and XMLParser(dtd=...))"""
+
+from __future__ import absolute_import
+
+import unittest
+
+import _cElementTree
+import _ciElementTree
+
+
+class DTDMixin(object):
+    module = None
+
+    def parse(self, dtd, doc):
+        parser = self.module.XMLParser(dtd=self.module.DTD(dtd))
+        parser.feed(doc)
+        return parser.close()
+
+    def test_external_declarations(self):
+        root = self.parse(b'<!ENTITY foo "ext"><!ATTLIST r a CDATA "ext">',
+                          b'<r>&foo;</r>')
+        self.assertEqual(root.text, "ext")
+        self.assertEqual(root.get("a"), "ext")
+
+    def test_internal_subset_wins(self):
+        root = self.parse(b'<!ENTITY foo "ext"><!ENTITY bar "bar">'
+                          b'<!ATTLIST r a CDATA "ext" b CDATA "b">',
+                          b'<!DOCTYPE r [<!ENTITY foo "int">'
+                          b'<!ATTLIST r a CDATA "int">]><r>&foo;&bar;</r>')
+        self.assertEqual(root.text, "intbar")
+        self.assertEqual(root.get("a"), "int")
+        self.assertEqual(root.get("b"), "b")
+
+    def test_reinit(self):
+        dtd = self.module.DTD(b'<!ENTITY foo "ext">')
+        self.assertRaises(ValueError, dtd.__init__, b'<!ENTITY foo "new">')
+
+
+class CElementTreeDTDTest(DTDMixin, unittest.TestCase):
+    module = _cElementTree
+
+
+class CIElementTreeDTDTest(DTDMixin, unittest.TestCase):
+    module = _ciElementTree
+
+
+if __name__ == "__main__":
+    unittest.main()